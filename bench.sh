@@ -0,0 +1,267 @@
+#!/usr/bin/env bash
+
+# Headless benchmark over loopback: builds every variant, sends a random
+# file of each size at each loss rate, several times, and prints one JSON
+# document with every run and, per variant/size/loss, the mean, standard
+# deviation, min, median and max of completion time, throughput, CPU time
+# (sender + receiver, user + system), packets sent and retransmission ratio.
+#
+# Loss is each variant's own coin flip, the same rate on data (receiver
+# drop_prob) and on ACKs (sender prob). no_ack has no ACKs to lose and no
+# drop option, so it only runs at loss 0. Completion time runs from the
+# sender's start to the receiver's exit, so it includes the setup round
+# trip. A run that times out or leaves a different file counts as failed
+# and stays out of the statistics.
+#
+# -i routes every transfer through the impairment relay (impair.c) with
+# those options, e.g. -i "-d 10 -j 1 -g 0.01,0.3 -b 100 -s 7". no_ack's
+# ports are fixed, so it can't be relayed and is left out.
+#
+# Counters: with_ack from its -M metrics file, gemini and xai from their
+# event logs (with_ack/evlog_decode.c), no_ack from its own summary line.
+#
+#   ./bench.sh [-v variants] [-s sizes] [-l losses] [-r runs] [-t timeout] [-i impair_opts] [-o out.json]
+#   ./bench.sh -v with_ack,with_ack_nack -s 1M,1G -l 0,0.02 -r 5 -o base.json
+
+VARIANTS="no_ack,no_ack_fec,with_ack,with_ack_nack,with_ack_uring,with_ack_n4,with_ack_z,gemini,xai"
+SIZES="1K,64K,1M,16M,256M"
+LOSSES="0,0.01,0.05"
+RUNS=3
+TIMEOUT=300
+OUT=-
+IMPAIR=
+WORK="${TMPDIR:-/tmp}/udp_bench"
+PORT=20000 # first port; every run takes the next PORT_STEP
+
+PORT_STEP=20
+REPO="$(cd "$(dirname "$0")" && pwd)"
+
+usage() {
+    echo "Usage: $0 [-v variants] [-s sizes] [-l losses] [-r runs] [-t timeout] [-i impair_opts] [-o out.json]" >&2
+    echo "  variants: $VARIANTS" >&2
+    echo "  sizes: bytes with an optional K, M or G suffix, e.g. 1K,1M,2G" >&2
+    exit 1
+}
+
+while getopts "v:s:l:r:t:i:o:" opt; do
+    case $opt in
+        v) VARIANTS=$OPTARG ;;
+        s) SIZES=$OPTARG ;;
+        l) LOSSES=$OPTARG ;;
+        r) RUNS=$OPTARG ;;
+        t) TIMEOUT=$OPTARG ;;
+        i) IMPAIR=$OPTARG ;;
+        o) OUT=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+[[ $OUT == - ]] && OUT=/dev/stdout
+
+bytes() {
+    local n=${1%[KkMmGg]}
+    case $1 in
+        *[Kk]) echo $((n << 10)) ;;
+        *[Mm]) echo $((n << 20)) ;;
+        *[Gg]) echo $((n << 30)) ;;
+        *) echo "$n" ;;
+    esac
+}
+
+build() {
+    mkdir -p "$WORK/bin" "$WORK/files"
+    gcc -O2 "$REPO/no_ack/sender.c" -o "$WORK/bin/no_ack_send" &&
+    gcc -O2 "$REPO/no_ack/receiver.c" -o "$WORK/bin/no_ack_receive" &&
+    gcc -O2 -pthread "$REPO/with_ack/sender.c" -o "$WORK/bin/with_ack_send" &&
+    gcc -O2 -pthread "$REPO/with_ack/receiver.c" -o "$WORK/bin/with_ack_receive" &&
+    gcc -O2 "$REPO/with_ack/evlog_decode.c" -o "$WORK/bin/evlog_decode" &&
+    gcc -O2 "$REPO/impair.c" -o "$WORK/bin/impair" -lm &&
+    gcc -O2 -pthread "$REPO/gemini/sender.c" -o "$WORK/bin/gemini_send" &&
+    gcc -O2 -pthread "$REPO/gemini/receiver.c" -o "$WORK/bin/gemini_receive" &&
+    gcc -O2 -pthread "$REPO/xai/sender.c" -o "$WORK/bin/xai_send" &&
+    gcc -O2 -pthread "$REPO/xai/receiver.c" -o "$WORK/bin/xai_receive"
+}
+
+# SEND DATA and RETRANSMIT events in an event log, as "packets retransmits"
+count_events() {
+    "$WORK/bin/evlog_decode" -c "$1" 2>/dev/null |
+        awk -F, '$6 == "SEND DATA" { p++ } $6 == "RETRANSMIT" { r++ } END { print p + 0, r + 0 }'
+}
+
+# One transfer of file $1 at loss $2 with variant $3; prints its JSON line
+run_one() {
+    local file=$1 loss=$2 variant=$3 run=$4
+    local name; name=$(basename "$file")
+    local dir="$WORK/run" bin="$WORK/bin" sport=$PORT rport=$((PORT + PORT_STEP / 2)) dport=$((PORT + PORT_STEP / 2))
+    local sflags=() rflags=() recv_out
+    PORT=$((PORT + PORT_STEP))
+    rm -rf "$dir"
+    mkdir -p "$dir/sd" "$dir/rd"
+    ln -s "$file" "$dir/sd/$name"
+
+    local tool
+    case $variant in
+        no_ack*) tool=no_ack ;;
+        with_ack*) tool=with_ack ;;
+        *) tool=$variant ;;
+    esac
+    case $variant in
+        no_ack_fec) sflags=(-f 32,4) ;;
+        with_ack) sflags=(-l 0) rflags=(-l 0) ;;
+        with_ack_nack) sflags=(-l 0 -m nack) rflags=(-l 0) ;;
+        with_ack_uring) sflags=(-l 0 -e uring) rflags=(-l 0 -e uring) ;;
+        with_ack_n4) sflags=(-l 0 -n 4) rflags=(-l 0 -n 4) ;;
+        with_ack_z) sflags=(-l 0 -z) rflags=(-l 0) ;;
+    esac
+    [[ $tool == with_ack ]] && sflags+=(-M "$dir/metrics.json")
+
+    # relayed: the sender talks to the relay on dport, the receiver listens further up
+    local ipid=
+    if [[ -n $IMPAIR ]]; then
+        rport=$((dport + PORT_STEP / 4))
+        local flows=1
+        [[ $variant == with_ack_n4 ]] && flows=4
+        # shellcheck disable=SC2086
+        "$bin/impair" $IMPAIR -n "$flows" "$dport" 127.0.0.1 "$rport" 2> "$dir/impair.txt" &
+        ipid=$!
+    fi
+
+    # receiver first; each side timed by bash, children included
+    if [[ $tool == no_ack ]]; then
+        mkdir -p "$dir/sd/test_files" "$dir/rd/test_files"
+        mv "$dir/sd/$name" "$dir/sd/test_files/$name"
+        recv_out="$dir/rd/test_files/$name"
+        (cd "$dir/rd" && TIMEFORMAT='%3U %3S' && { time timeout "$TIMEOUT" "$bin/no_ack_receive" > out.txt 2>&1; } 2> cpu.txt) &
+    else
+        recv_out="$dir/rd/recv_$name"
+        (cd "$dir/rd" && TIMEFORMAT='%3U %3S' && { time timeout "$TIMEOUT" "$bin/${tool}_receive" "${rflags[@]}" "$rport" "$loss" > out.txt 2>&1; } 2> cpu.txt) &
+    fi
+    local rpid=$!
+    sleep 0.3
+
+    local start end
+    start=$(date +%s%N)
+    if [[ $tool == no_ack ]]; then
+        (cd "$dir/sd" && TIMEFORMAT='%3U %3S' && { time printf '6\n%s\n' "$name" | timeout "$TIMEOUT" "$bin/no_ack_send" "${sflags[@]}" > out.txt 2>&1; } 2> cpu.txt)
+    else
+        (cd "$dir/sd" && TIMEFORMAT='%3U %3S' && { time timeout "$TIMEOUT" "$bin/${tool}_send" "${sflags[@]}" "$sport" 127.0.0.1 "$dport" 1 "$name" "$loss" > out.txt 2>&1; } 2> cpu.txt)
+    fi
+    local send_rc=$?
+    wait "$rpid"
+    local recv_rc=$?
+    end=$(date +%s%N)
+    if [[ -n $ipid ]]; then
+        kill "$ipid"
+        wait "$ipid"
+    fi
+
+    local ok=false
+    [[ $send_rc == 0 && $recv_rc == 0 ]] && cmp -s "$file" "$recv_out" && ok=true
+
+    local packets=0 retransmits=0
+    case $tool in
+        with_ack)
+            packets=$(grep -o '"packets":[0-9]*' "$dir/metrics.json" 2>/dev/null | cut -d: -f2)
+            retransmits=$(grep -o '"retransmits":[0-9]*' "$dir/metrics.json" 2>/dev/null | cut -d: -f2) ;;
+        gemini) read -r packets retransmits < <(count_events "$dir/sd/udp_sender_logs.bin") ;;
+        xai) read -r packets retransmits < <(count_events "$dir/sd/sender_udp_logs.bin") ;;
+        no_ack) packets=$(sed -n 's/^File sent fully: \([0-9]*\) packets.*/\1/p' "$dir/sd/out.txt") ;;
+    esac
+
+    local cpu
+    cpu=$(cat "$dir/sd/cpu.txt" "$dir/rd/cpu.txt" 2>/dev/null | awk '{ t += $1 + $2 } END { printf "%.3f", t }')
+    printf '{"variant":"%s","size":%s,"loss":%s,"run":%d,"ok":%s,"time_s":%s,"cpu_s":%s,"packets":%s,"retransmits":%s}\n' \
+        "$variant" "$(stat -c %s "$file")" "$loss" "$run" "$ok" \
+        "$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", (e - s) / 1e9 }')" "$cpu" "${packets:-0}" "${retransmits:-0}"
+}
+
+# Per variant/size/loss statistics over the successful runs in the JSON
+# lines on stdin: mean, sample stdev, min, median, max
+summarize() {
+    awk '
+    function field(line, key,    m) {
+        if(!match(line, "\"" key "\":[^,}]*")) return ""
+        m = substr(line, RSTART, RLENGTH)
+        sub(/^[^:]*:/, "", m)
+        gsub(/"/, "", m)
+        return m
+    }
+    function stats(key, n,    i, j, v, mean, sd, t, med) {
+        if(n == 0) return "null"
+        for(i = 1; i <= n; i++) v[i] = val[key, i]
+        for(i = 2; i <= n; i++) for(j = i; j > 1 && v[j - 1] > v[j]; j--) { t = v[j]; v[j] = v[j - 1]; v[j - 1] = t }
+        mean = 0
+        for(i = 1; i <= n; i++) mean += v[i]
+        mean /= n
+        sd = 0
+        for(i = 1; i <= n; i++) sd += (v[i] - mean) ^ 2
+        sd = n > 1 ? sqrt(sd / (n - 1)) : 0
+        med = n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2
+        return sprintf("{\"mean\":%.4g,\"stdev\":%.4g,\"min\":%.4g,\"median\":%.4g,\"max\":%.4g}", mean, sd, v[1], med, v[n])
+    }
+    {
+        g = field($0, "variant") SUBSEP field($0, "size") SUBSEP field($0, "loss")
+        if(!(g in runs)) order[++groups] = g
+        runs[g]++
+        if(field($0, "ok") != "true") { failed[g]++; next }
+        n = ++ok[g]
+        t = field($0, "time_s")
+        if(t <= 0) t = 0.001
+        val[g, "time", n] = t
+        val[g, "mbit", n] = field($0, "size") * 8 / t / 1e6
+        val[g, "cpu", n] = field($0, "cpu_s")
+        val[g, "packets", n] = field($0, "packets")
+        val[g, "ratio", n] = field($0, "packets") > 0 ? field($0, "retransmits") / field($0, "packets") : 0
+    }
+    END {
+        for(i = 1; i <= groups; i++) {
+            g = order[i]
+            split(g, k, SUBSEP)
+            n = ok[g] + 0
+            printf "%s{\"variant\":\"%s\",\"size\":%s,\"loss\":%s,\"runs\":%d,\"failed\":%d", (i > 1 ? "," : ""), k[1], k[2], k[3], runs[g], failed[g]
+            split("time:time_s mbit:throughput_mbit cpu:cpu_s packets:packets ratio:retransmit_ratio", names, " ")
+            for(m = 1; m <= 5; m++) {
+                split(names[m], kv, ":")
+                printf ",\"%s\":%s", kv[2], stats(g SUBSEP kv[1], n)
+            }
+            printf "}\n"
+        }
+    }'
+}
+
+if ! build; then
+    echo "Build failed" >&2
+    exit 1
+fi
+
+RESULTS="$WORK/runs.jsonl"
+: > "$RESULTS"
+IFS=, read -ra variants <<< "$VARIANTS"
+IFS=, read -ra sizes <<< "$SIZES"
+IFS=, read -ra losses <<< "$LOSSES"
+for size in "${sizes[@]}"; do
+    file="$WORK/files/bench_$size.bin"
+    n=$(bytes "$size")
+    if [[ ! -f $file || $(stat -c %s "$file") != "$n" ]]; then
+        head -c "$n" /dev/urandom > "$file"
+    fi
+    for loss in "${losses[@]}"; do
+        for variant in "${variants[@]}"; do
+            [[ $variant == no_ack* && -n $IMPAIR ]] && continue
+            [[ $variant == no_ack* ]] && awk -v l="$loss" 'BEGIN { exit !(l > 0) }' && continue
+            for ((run = 1; run <= RUNS; run++)); do
+                echo "$variant $size loss $loss run $run/$RUNS" >&2
+                run_one "$file" "$loss" "$variant" "$run" >> "$RESULTS"
+            done
+        done
+    done
+done
+
+{
+    printf '{"host":{"kernel":"%s","cpus":%d,"date":"%s","commit":"%s"},' \
+        "$(uname -r)" "$(nproc)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(git -C "$REPO" rev-parse --short HEAD 2>/dev/null)"
+    printf '"config":{"runs":%d,"timeout_s":%s,"impair":"%s"},\n"results":[\n' "$RUNS" "$TIMEOUT" "$IMPAIR"
+    summarize < "$RESULTS"
+    printf '],\n"runs":[\n'
+    paste -sd, "$RESULTS"
+    printf ']}\n'
+} > "$OUT"
@@ -0,0 +1,154 @@
+#ifndef EVLOG_H
+#define EVLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Binary event log. log_event() only stamps a fixed-size record with the
+// CLOCK_MONOTONIC time in ns and puts it in a lock-free ring (a bounded
+// multi-producer queue: producers claim a cell by CAS on the head, and a
+// per-cell sequence number says whether it is free or filled). A
+// background thread drains the ring into the file in large writes, so the
+// packet path never formats, locks or flushes. When the ring is full an
+// event is counted and dropped rather than waited for; the drain thread
+// writes the count as an "EVLOG DROPPED" event.
+//
+// With a sample rate n > 1 each thread keeps only every nth event. 0 turns
+// logging off.
+//
+// File: a header per run (runs append), then records, both in host byte
+// order; with_ack/evlog_decode.c turns it back into the text log or CSV.
+
+#define EVLOG_MAGIC "UDPEVLG1"
+#define EVLOG_RING 65536 // records, power of two
+#define EVLOG_DRAIN_US 2000 // drain thread's nap while the ring is empty
+#define EVLOG_NAME 16
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size, sample;
+    uint64_t mono_ns, real_ns; // the same instant on both clocks, to date records
+} EvlogHeader;
+
+typedef struct {
+    uint64_t ns; // CLOCK_MONOTONIC
+    uint32_t seq, ack;
+    uint16_t len;
+    uint8_t type, thread; // thread: order of the logging thread's first event
+    uint32_t spare;
+    char name[EVLOG_NAME]; // NUL-padded, not necessarily terminated
+} EvlogRecord;
+
+typedef struct {
+    uint64_t seq;
+    EvlogRecord rec;
+} EvlogCell;
+
+static EvlogCell *evlog_ring;
+static uint64_t evlog_head, evlog_tail, evlog_dropped;
+static int evlog_sample, evlog_stop, evlog_threads;
+static FILE *evlog_fp;
+static pthread_t evlog_thread;
+static __thread int evlog_count, evlog_id = -1;
+
+static inline uint64_t evlog_now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Records one event, unless sampled out or the ring is full
+static inline void evlog(const char *name, int type, uint32_t seq, uint32_t ack, int len) {
+    if(!evlog_sample || evlog_count++ % evlog_sample) return;
+    if(evlog_id < 0) evlog_id = __atomic_fetch_add(&evlog_threads, 1, __ATOMIC_RELAXED);
+    uint64_t pos = __atomic_load_n(&evlog_head, __ATOMIC_RELAXED);
+    EvlogCell *cell;
+    while(1) {
+        cell = &evlog_ring[pos & (EVLOG_RING - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0 && __atomic_compare_exchange_n(&evlog_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        if(diff < 0) { // full: the drain thread is behind
+            __atomic_add_fetch(&evlog_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if(diff > 0) pos = __atomic_load_n(&evlog_head, __ATOMIC_RELAXED); // another producer got it
+    }
+    cell->rec = (EvlogRecord){ .ns = evlog_now(CLOCK_MONOTONIC), .seq = seq, .ack = ack, .len = len, .type = type, .thread = evlog_id };
+    memcpy(cell->rec.name, name, strnlen(name, EVLOG_NAME)); // the rest was zeroed
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Writes out whatever is in the ring; returns how many records
+static inline int evlog_drain(void) {
+    static EvlogRecord out[1024];
+    int n = 0, total = 0;
+    while(1) {
+        EvlogCell *cell = &evlog_ring[evlog_tail & (EVLOG_RING - 1)];
+        int filled = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == evlog_tail + 1;
+        if(filled) {
+            out[n++] = cell->rec;
+            __atomic_store_n(&cell->seq, evlog_tail + EVLOG_RING, __ATOMIC_RELEASE);
+            evlog_tail++;
+        }
+        if(n == 1024 || (!filled && n > 0)) {
+            fwrite(out, sizeof(out[0]), n, evlog_fp);
+            total += n;
+            n = 0;
+        }
+        if(!filled) break;
+    }
+    uint64_t dropped = __atomic_exchange_n(&evlog_dropped, 0, __ATOMIC_RELAXED);
+    if(dropped) {
+        EvlogRecord r = { .ns = evlog_now(CLOCK_MONOTONIC), .seq = dropped > UINT32_MAX ? UINT32_MAX : dropped };
+        memcpy(r.name, "EVLOG DROPPED", 13);
+        fwrite(&r, sizeof(r), 1, evlog_fp);
+    }
+    return total;
+}
+
+static void *evlog_main(void *arg) {
+    (void)arg;
+    struct timespec nap = { .tv_nsec = EVLOG_DRAIN_US * 1000 };
+    while(!__atomic_load_n(&evlog_stop, __ATOMIC_ACQUIRE)) {
+        if(evlog_drain() == 0) nanosleep(&nap, NULL);
+    }
+    evlog_drain();
+    return NULL;
+}
+
+// Stops the drain thread once the ring is empty and closes the file; run
+// at exit by evlog_open
+static void evlog_close(void) {
+    if(!evlog_fp) return;
+    __atomic_store_n(&evlog_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(evlog_thread, NULL);
+    fclose(evlog_fp);
+    evlog_fp = NULL;
+}
+
+// Appends to path, keeping every sample-th event (0: none). Returns 0, or
+// -1 with errno set.
+static inline int evlog_open(const char *path, int sample) {
+    if(sample <= 0) return 0;
+    if(!(evlog_fp = fopen(path, "ab"))) return -1;
+    setvbuf(evlog_fp, NULL, _IOFBF, 1 << 20);
+    EvlogCell *ring = malloc(EVLOG_RING * sizeof(*ring));
+    if(!ring) return -1;
+    for(uint64_t i = 0; i < EVLOG_RING; i++) ring[i].seq = i;
+    EvlogHeader h = { .record_size = sizeof(EvlogRecord), .sample = sample };
+    memcpy(h.magic, EVLOG_MAGIC, 8);
+    h.mono_ns = evlog_now(CLOCK_MONOTONIC);
+    h.real_ns = evlog_now(CLOCK_REALTIME);
+    fwrite(&h, sizeof(h), 1, evlog_fp);
+    evlog_ring = ring;
+    if(pthread_create(&evlog_thread, NULL, evlog_main, NULL) != 0) return -1;
+    evlog_sample = sample; // from here on events are kept
+    atexit(evlog_close);
+    return 0;
+}
+
+#endif
@@ -1,15 +1,29 @@
+#define _GNU_SOURCE // fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include "packet.h"
+#include "timer.h"
+#include "evlog.h"
 
-FILE *log_fp;
+unsigned char *chunk_map; // One bit per MAX_DATA_SIZE chunk already written
+long n_chunks; // Including the final short (possibly empty) one
+long first_missing; // lowest chunk not yet written, to unwrap seqNums against
 
-void print_progress_bar(int received_bytes, int total_bytes) {
-    if (total_bytes == 0) return;
+int chunk_received(long chunk) {
+    return chunk_map[chunk / 8] >> (chunk % 8) & 1;
+}
+
+void mark_chunk(long chunk) {
+    chunk_map[chunk / 8] |= 1 << (chunk % 8);
+}
+
+void print_progress_bar(long received_bytes, long total_bytes) {
+    if(total_bytes == 0 || !progress_due(received_bytes, total_bytes)) return;
     const int bar_width = 50;
     float percentage = (float)received_bytes / total_bytes;
     int pos = (int)(bar_width * percentage);
@@ -24,10 +38,28 @@ void print_progress_bar(int received_bytes, int total_bytes) {
 }
 
 void log_event(const char *event, Packet *pkt) {
-    time_t now = time(NULL);
-    fprintf(log_fp, "[%ld] %s - type: %d, seqNum: %d, ackNum: %d, len: %d\n",
-            now, event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
-    fflush(log_fp);
+    evlog(event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
+}
+
+// Creates recv_<name> at its full size, and the chunk bitmap for it.
+// Returns the fd, or -1 with errno set.
+int open_output(const char *name, long f_size) {
+    char filename[MAX_DATA_SIZE + 8];
+    snprintf(filename, sizeof(filename), "recv_%s", name);
+    // Preallocate the whole file; chunks land at their offsets in any order
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return -1;
+    if(f_size > 0 && fallocate(fd, 0, 0, f_size) < 0 && ftruncate(fd, f_size) < 0) {
+        close(fd);
+        return -1;
+    }
+    n_chunks = f_size / MAX_DATA_SIZE + 1;
+    chunk_map = calloc((n_chunks + 7) / 8, 1);
+    if(!chunk_map) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 int drop(float prob) {
@@ -41,12 +73,11 @@ int main(int argc, char *argv[]) {
     }
 
     int receiver_port = atoi(argv[1]);
-    int total_received = 0, f_size = 0;
+    long total_received = 0, f_size = 0;
     float drop_prob = atof(argv[2]);
     srand(time(NULL));
 
-    log_fp = fopen("udp_receiver_logs.txt", "a");
-    if (!log_fp) {
+    if(evlog_open("udp_receiver_logs.bin", 1) < 0) {
         perror("Failed to open log file");
         exit(1);
     }
@@ -61,33 +92,11 @@ int main(int argc, char *argv[]) {
     struct sockaddr_in sender_addr;
     socklen_t addlen = sizeof(sender_addr);
 
-    Packet greet_pkt = {0};
-    recvfrom(sockfd, &greet_pkt, sizeof(greet_pkt), 0, (struct sockaddr *)&sender_addr, &addlen);
-    if(greet_pkt.type != TYPE_DATA || strcmp(greet_pkt.data, "Greeting") != 0) {
-        fprintf(stderr, "Invalid greeting\n");
-        exit(1);
-    }
-
-    Packet ok = { .type = TYPE_ACK };
-    strcpy(ok.data, "OK");
-    sendto(sockfd, &ok, sizeof(ok), 0, (struct sockaddr *)&sender_addr, addlen);
-
-    Packet fname = {0};
-    recvfrom(sockfd, &fname, sizeof(fname), 0, (struct sockaddr *)&sender_addr, &addlen);
-    recvfrom(sockfd, &f_size, sizeof(int), 0, (struct sockaddr *)&sender_addr, &addlen);
-
-    char filename[128];
-    snprintf(filename, sizeof(filename), "recv_%s", fname.data);
-    FILE *fp = fopen(filename, "wb");
-    if(!fp) {
-        perror("Failed to open output file.");
-        exit(1);
-    }
-
-    int expected_seq = 3;
+    // Nothing is written until an INIT has named the file and given its size
+    int fd = -1;
     while(1) {
-        Packet pkt = {0};
-        ssize_t len = recvfrom(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&sender_addr, &addlen);
+        Packet pkt;
+        ssize_t len = recv_packet(sockfd, &pkt, &sender_addr, &addlen);
 
         if(len < 0) continue;
 
@@ -96,24 +105,53 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
+        if(pkt.type == TYPE_INIT) {
+            // Every copy gets an ACCEPT: the sender repeats the INIT until one arrives
+            char name[MAX_DATA_SIZE - INIT_HEADER + 1];
+            log_event("RECV INIT", &pkt);
+            if(fd < 0 && decode_init(&pkt, &f_size, name) < 0) continue;
+            Packet accept = { .type = TYPE_ACCEPT };
+            if(fd < 0 && (fd = open_output(name, f_size)) < 0) {
+                accept.length = snprintf(accept.data, MAX_DATA_SIZE, "%s", strerror(errno)); // refuse, saying why
+                perror("Failed to open output file");
+                send_packet(sockfd, &accept, &sender_addr, addlen);
+                exit(1);
+            }
+            send_packet(sockfd, &accept, &sender_addr, addlen);
+            log_event("SEND ACCEPT", &accept);
+            continue;
+        }
+        if(fd < 0) continue; // nothing before the INIT
+
         if(pkt.type == TYPE_DATA) {
             log_event("RECV DATA", &pkt);
-            if(pkt.seqNum == expected_seq) {
-                fwrite(pkt.data, 1, pkt.length, fp);
+            long chunk = seq_unwrap(pkt.seqNum, FIRST_DATA_SEQ + first_missing) - FIRST_DATA_SEQ;
+            long offset = chunk * MAX_DATA_SIZE;
+            if(chunk >= 0 && chunk < n_chunks && offset + pkt.length <= f_size && !chunk_received(chunk)) {
+                if(pwrite(fd, pkt.data, pkt.length, offset) != pkt.length) {
+                    perror("pwrite failed");
+                    exit(1);
+                }
+                mark_chunk(chunk);
+                while(first_missing < n_chunks && chunk_received(first_missing)) first_missing++;
                 total_received += pkt.length;
-                expected_seq++;
                 print_progress_bar(total_received, f_size);
             }
-            Packet ack = { .type = TYPE_ACK, .ackNum = pkt.seqNum };
-            sendto(sockfd, &ack, sizeof(ack), 0, (struct sockaddr *)&sender_addr, addlen);
+            // Header-only ACK: no payload to zero
+            Packet ack;
+            ack.type = TYPE_ACK;
+            ack.seqNum = 0;
+            ack.ackNum = pkt.seqNum;
+            ack.length = 0;
+            send_packet(sockfd, &ack, &sender_addr, addlen);
             log_event("SEND ACK", &ack);
         } else if(pkt.type == TYPE_EOT) {
             log_event("RECV EOT", &pkt);
             break;
         }
     }
-    fclose(fp);
-    fclose(log_fp);
+    close(fd);
+    free(chunk_map);
     close(sockfd);
 
     printf("\nFile received successfully.\n");
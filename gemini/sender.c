@@ -7,20 +7,41 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
 #include <time.h>
 #include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/errqueue.h>
 #include "packet.h"
+#include "timer.h"
+#include "evlog.h"
+
+// Payloads are never copied: a slot keeps the encoded header and a pointer
+// into the mapped input file, and every (re)transmission gathers the two.
+typedef struct {
+    unsigned char hdr[HEADER_SIZE];
+    const char *payload;
+    long seqNum;
+    int length;
+    int acked;
+    int retries;
+    uint64_t sent_at;
+} Slot;
 
 int sockfd;
 struct sockaddr_in receiver_addr;
 socklen_t addrlen = sizeof(receiver_addr);
-Packet last_packet;
-FILE *log_fp;
-volatile sig_atomic_t timeout_occurred = 0;
-
-void print_progress_bar(int sent_bytes, int total_bytes) {
-    if (total_bytes == 0) return;
+Slot window[MAX_WINDOW];
+int log_sample = 1; // -l: keep every nth event in the log, 0 for none
+TimerQueue timers; // Per-packet retransmit deadlines, id = slot index
+RttEstimator rtt;
+int zerocopy; // -z: MSG_ZEROCOPY sends
+unsigned zc_sent, zc_done, zc_copied; // zerocopy sends issued, completed, and completed by copying anyway
+
+void print_progress_bar(long sent_bytes, long total_bytes) {
+    if(total_bytes == 0 || !progress_due(sent_bytes, total_bytes)) return;
     const int bar_width = 50;
     float percentage = (float)sent_bytes / total_bytes;
     int pos = (int)(bar_width * percentage);
@@ -35,36 +56,101 @@ void print_progress_bar(int sent_bytes, int total_bytes) {
 }
 
 void log_event(const char* event, Packet *pkt) {
-    time_t now = time(NULL);
-    fprintf(log_fp, "[%ld] %s - type: %d, seqNum: %d, ackNum: %d, len: %d\n",
-            now, event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
-    fflush(log_fp);
+    evlog(event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
+}
+
+void log_slot(const char* event, Slot *slot) {
+    evlog(event, TYPE_DATA, slot->seqNum, 0, slot->length);
 }
 
-void handle_timeout(int sig) {
-    timeout_occurred = 1;
+// Drain MSG_ZEROCOPY notifications from the socket error queue. The mapping
+// is read-only, so nothing waits on them to reuse memory, but unreaped
+// notifications eat optmem and further zerocopy sends fail with ENOBUFS.
+void reap_zerocopy(void) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    while(1) {
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if(recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) return;
+        for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) continue;
+            // [ee_info, ee_data] is a range of completed send ids
+            unsigned n = serr->ee_data - serr->ee_info + 1;
+            zc_done += n;
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zc_copied += n;
+        }
+    }
+}
+
+void send_slot(Slot *slot) {
+    if(zerocopy) {
+        if(send_parts(sockfd, slot->hdr, slot->payload, slot->length, &receiver_addr, addrlen, MSG_ZEROCOPY) >= 0) {
+            zc_sent++;
+            return;
+        }
+        if(errno != ENOBUFS) return;
+        reap_zerocopy(); // notification queue full: copy this one
+    }
+    send_parts(sockfd, slot->hdr, slot->payload, slot->length, &receiver_addr, addrlen, 0);
+}
+
+void retransmit_expired(void) {
+    uint64_t now = now_us();
+    int id;
+    while((id = timer_pop_expired(&timers, now)) >= 0) {
+        Slot *slot = &window[id];
+        log_slot("TIMEOUT", slot);
+        send_slot(slot); // straight from the mapping again
+        log_slot("RETRANSMIT", slot);
+        slot->retries++;
+        slot->sent_at = now;
+        timer_set(&timers, id, now + rtt_backoff(&rtt, slot->retries));
+    }
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w window] [-z] [-l n] <sender_port> <receiver_ip> <receiver_port> <timeout> <filename> <prob>\n", prog);
+    exit(1);
 }
 
 int main(int argc, char *argv[]) {
-    if(argc != 7) {
-        fprintf(stderr, "Usage: %s <sender_port> <receiver_ip> <receiver_port> <timeout> <filename> <prob>\n", argv[0]);
+    int window_size = DEFAULT_WINDOW;
+    int opt;
+    while((opt = getopt(argc, argv, "w:zl:")) != -1) {
+        switch(opt) {
+            case 'w': window_size = atoi(optarg); break;
+            case 'z': zerocopy = 1; break;
+            case 'l': log_sample = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if(argc - optind != 6) usage(argv[0]);
+    if(window_size < 1 || window_size > MAX_WINDOW) {
+        fprintf(stderr, "Window size must be between 1 and %d\n", MAX_WINDOW);
         exit(1);
     }
+    argv += optind - 1;
 
     int sender_port = atoi(argv[1]);
     char *receiver_ip = argv[2];
     int receiver_port = atoi(argv[3]);
-    int timeout = atoi(argv[4]);
+    double timeout = atof(argv[4]); // Initial RTO (seconds) until the first RTT sample
     char *filename = argv[5];
     double ack_drop_prob = atof(argv[6]);
 
-    int total_sent = 0, f_size;
+    long total_sent = 0, f_size;
 
-    signal(SIGALRM, handle_timeout);
+    rtt_init(&rtt, timeout * 1000000);
+    timer_init(&timers);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(tfd < 0) {
+        perror("timerfd_create failed");
+        exit(1);
+    }
     srand(time(NULL));
 
-    log_fp = fopen("udp_sender_logs.txt", "a");
-    if(!log_fp) {
+    if(evlog_open("udp_sender_logs.bin", log_sample) < 0) {
         perror("Failed to open log file");
         exit(1);
     }
@@ -78,6 +164,25 @@ int main(int argc, char *argv[]) {
     // Set socket to non-blocking
     fcntl(sockfd, F_SETFL, O_NONBLOCK);
 
+    // Let the kernel pin mapped pages instead of copying them; it still
+    // copies whenever it has to (loopback, no NIC scatter/gather)
+    int one = 1;
+    if(zerocopy && setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        perror("SO_ZEROCOPY unsupported, sending with copies");
+        zerocopy = 0;
+    }
+
+    // Sleep in epoll until an ACK arrives or the retransmit timer fires
+    int epfd = epoll_create1(0);
+    if(epfd < 0) {
+        perror("epoll_create1 failed");
+        exit(1);
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = sockfd };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+    ev.data.fd = tfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
     struct sockaddr_in sender_addr;
     memset(&sender_addr, 0, sizeof(sender_addr));
     sender_addr.sin_family = AF_INET;
@@ -98,89 +203,148 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    Packet greet_pkt = {0};
-    greet_pkt.type = TYPE_DATA;
-    greet_pkt.seqNum = 0;
-    strcpy(greet_pkt.data, "Greeting");
-    sendto(sockfd, &greet_pkt, sizeof(greet_pkt), 0, (struct sockaddr *)&receiver_addr, addrlen);
-
-    Packet ack_pkt = {0};
-    while(recvfrom(sockfd, &ack_pkt, sizeof(ack_pkt), 0, (struct sockaddr *)&receiver_addr, &addrlen) <= 0);
-
-    if(ack_pkt.type != TYPE_ACK || strcmp(ack_pkt.data, "OK") != 0) {
-        fprintf(stderr, "Unexpected response. Aborting.\n");
+    // Map the whole file; datagrams are gathered from it directly
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror("open failed");
         exit(1);
     }
+    f_size = st.st_size;
+    const char *map = NULL;
+    if(f_size > 0) {
+        map = mmap(NULL, f_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED) {
+            perror("mmap failed");
+            exit(1);
+        }
+        madvise((void *)map, f_size, MADV_SEQUENTIAL);
+    }
 
-    Packet fname_pkt = {0};
-    fname_pkt.type = TYPE_DATA;
-    fname_pkt.seqNum = 1;
-    strncpy(fname_pkt.data, filename, MAX_DATA_SIZE);
-    sendto(sockfd, &fname_pkt, sizeof(fname_pkt), 0, (struct sockaddr *)&receiver_addr, addrlen);
-
-    FILE *fp = fopen(filename, "rb");
-    if(!fp) {
-        perror("fopen failed");
+    // One INIT carries the name and size. Resend it with backoff until the ACCEPT comes.
+    Packet init;
+    if(encode_init(f_size, filename, &init) < 0) {
+        fprintf(stderr, "File name too long\n");
         exit(1);
     }
-    fseek(fp, 0L, SEEK_END);
-    f_size = ftell(fp);
-    rewind(fp);
-    sendto(sockfd, &f_size, sizeof(int), 0, (struct sockaddr *)&receiver_addr, addrlen);
-
-    int seq = 3;
-    int waiting_ack;
+    send_packet(sockfd, &init, &receiver_addr, addrlen);
+    log_event("SEND INIT", &init);
+    int tries = 0;
+    uint64_t init_sent = now_us(), deadline = init_sent + rtt.rto;
     while(1) {
-        char buffer[MAX_DATA_SIZE];
-        int bytes_read = fread(buffer, 1, MAX_DATA_SIZE, fp);
-
-        last_packet.type = TYPE_DATA;
-        last_packet.seqNum = seq;
-        last_packet.length = bytes_read;
-        memcpy(last_packet.data, buffer, bytes_read);
-
-        sendto(sockfd, &last_packet, sizeof(last_packet), 0, (struct sockaddr *)&receiver_addr, addrlen);
-        log_event("SEND DATA", &last_packet);
-
-        alarm(timeout);
-        waiting_ack = 1;
-
-        while(waiting_ack) {
-            if(timeout_occurred) {
-                log_event("TIMEOUT", &last_packet);
-                sendto(sockfd, &last_packet, sizeof(last_packet), 0, (struct sockaddr *)&receiver_addr, addrlen);
-                log_event("RETRANSMIT", &last_packet);
-                timeout_occurred = 0;
-                alarm(timeout);
+        Packet reply;
+        if(recv_packet(sockfd, &reply, &receiver_addr, &addrlen) > 0) {
+            if(reply.type != TYPE_ACCEPT) continue;
+            log_event("RECV ACCEPT", &reply);
+            if(reply.length > 0) {
+                fprintf(stderr, "Receiver refused: %.*s\n", reply.length, reply.data);
+                exit(1);
+            }
+            if(tries == 0) rtt_sample(&rtt, now_us() - init_sent); // Karn's rule
+            break;
+        }
+        uint64_t now = now_us();
+        if(now >= deadline) {
+            if(++tries == INIT_TRIES) {
+                fprintf(stderr, "No answer from the receiver\n");
+                exit(1);
             }
+            send_packet(sockfd, &init, &receiver_addr, addrlen);
+            log_event("RETRANSMIT INIT", &init);
+            deadline = now + rtt_backoff(&rtt, tries);
+            continue;
+        }
+        struct epoll_event ready;
+        epoll_wait(epfd, &ready, 1, (deadline - now + 999) / 1000);
+    }
+
+    // Selective repeat window. base is the oldest unacked seq.
+    // The final chunk is the first one shorter than MAX_DATA_SIZE (possibly empty).
+    long base = FIRST_DATA_SEQ, next_seq = FIRST_DATA_SEQ, last_seq = FIRST_DATA_SEQ + f_size / MAX_DATA_SIZE;
+    uint64_t armed = 0;
+    while(base <= last_seq) {
+        while(next_seq <= last_seq && next_seq < base + window_size) {
+            Slot *slot = &window[next_seq % MAX_WINDOW];
+            long off = (next_seq - FIRST_DATA_SEQ) * MAX_DATA_SIZE;
+            Packet hdr = { .type = TYPE_DATA, .seqNum = next_seq };
+            hdr.length = f_size - off < MAX_DATA_SIZE ? f_size - off : MAX_DATA_SIZE;
+            encode_header(&hdr, slot->hdr);
+            slot->payload = map + off;
+            slot->seqNum = next_seq;
+            slot->length = hdr.length;
+            slot->acked = 0;
+            slot->retries = 0;
+            slot->sent_at = now_us();
+
+            send_slot(slot);
+            log_slot("SEND DATA", slot);
+            timer_set(&timers, next_seq % MAX_WINDOW, slot->sent_at + rtt.rto);
+            next_seq++;
+        }
 
-            Packet ack;
-            ssize_t recv_len = recvfrom(sockfd, &ack, sizeof(ack), 0, (struct sockaddr *)&receiver_addr, &addrlen);
+        if(timer_next(&timers) != armed) {
+            armed = timer_next(&timers);
+            timer_arm_fd(tfd, armed);
+        }
 
-            if(recv_len > 0) {
-                if(ack.type == TYPE_ACK && ack.ackNum == seq) {
-                    log_event("RECV ACK", &ack);
-                    alarm(0); // Cancel the alarm
-                    waiting_ack = 0;
-                    total_sent += last_packet.length;
-                    print_progress_bar(total_sent, f_size);
+        struct epoll_event events[2];
+        int n_ready = epoll_wait(epfd, events, 2, -1);
+        int sock_ready = 0;
+        for(int i = 0; i < n_ready; i++) {
+            if(events[i].data.fd == tfd) {
+                uint64_t expirations;
+                if(read(tfd, &expirations, sizeof(expirations)) > 0) {
+                    armed = 0;
+                    retransmit_expired();
                 }
+            } else {
+                if(events[i].events & EPOLLERR) reap_zerocopy();
+                sock_ready = events[i].events & EPOLLIN;
             }
         }
-
-        if(bytes_read < MAX_DATA_SIZE) break;
-        seq++;
+        if(!sock_ready) continue;
+
+        // Drain every queued ACK before going back to sleep
+        Packet ack;
+        while(recv_packet(sockfd, &ack, &receiver_addr, &addrlen) > 0) {
+            long acked = seq_unwrap(ack.ackNum, base);
+            if(ack.type != TYPE_ACK || acked < base || acked >= next_seq) continue;
+            Slot *slot = &window[acked % MAX_WINDOW];
+            if(slot->acked) continue;
+            log_event("RECV ACK", &ack);
+            slot->acked = 1;
+            timer_cancel(&timers, acked % MAX_WINDOW);
+            if(slot->retries == 0) rtt_sample(&rtt, now_us() - slot->sent_at); // Karn's rule
+            total_sent += slot->length;
+            print_progress_bar(total_sent, f_size);
+
+            while(base < next_seq && window[base % MAX_WINDOW].acked) base++;
+        }
     }
 
-    Packet eot = { .type = TYPE_EOT, .seqNum = seq };
-    sendto(sockfd, &eot, sizeof(eot), 0, (struct sockaddr *)&receiver_addr, addrlen);
+    Packet eot = { .type = TYPE_EOT, .seqNum = last_seq };
+    send_packet(sockfd, &eot, &receiver_addr, addrlen);
     log_event("SEND EOT", &eot);
 
-    fclose(fp);
-    fclose(log_fp);
+    // Pinned pages outlive munmap anyway; wait briefly so the counts are complete
+    for(int i = 0; i < 10 && zc_done < zc_sent; i++) {
+        struct epoll_event ready;
+        epoll_wait(epfd, &ready, 1, 10);
+        reap_zerocopy();
+    }
+    if(map) munmap((void *)map, f_size);
+    close(fd);
+    close(epfd);
+    close(tfd);
     close(sockfd);
 
     printf("\nFile sent successfully.\n");
+    if(zerocopy) printf("Zerocopy: %u of %u sends completed, %u fell back to copying\n", zc_done, zc_sent, zc_copied);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    printf("CPU time: %.3f s (%.2f CPU-s/GB)\n", cpu, f_size > 0 ? cpu / (f_size / 1e9) : 0.0);
 
     return 0;
 }
@@ -0,0 +1,404 @@
+#define _GNU_SOURCE // ppoll
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+// UDP impairment relay for testing on one machine, no root or tc/netem.
+// Clients send to listen_port (+i for flow i of -n), the relay forwards to
+// target_ip:target_port (+i) from a socket of its own, and the answers go
+// back to whoever last sent on that flow. Each direction is impaired on its
+// own, in this order:
+//
+//   -b  token bucket: mbit/s, bucket size and queue in KB (default 16, 256);
+//       a datagram that finds the queue full is dropped
+//   -g  Gilbert-Elliott loss: p good->bad, r bad->good, and the loss rate in
+//       each state (default 0 and 1); -l is plain random loss
+//   -u  duplication, -c corruption (one flipped bit)
+//   -d  delay, -j jitter (normal, standard deviation in ms), -r p,ms: hold
+//       a datagram back ms longer so the ones behind it overtake
+//
+// A value "a/b" sets forward (to the target) a and reverse b; a single
+// value sets both. Every random choice comes from a per-direction
+// generator seeded by -s, so the same seed and the same arrival order give
+// the same drops, copies and delays. Counts are printed on SIGINT/SIGTERM.
+//
+//   gcc -O2 impair.c -o impair -lm
+//   ./impair -d 20 -j 2 -g 0.01,0.3 -b 50 -s 7 5000 127.0.0.1 1234
+//   ./send 4321 127.0.0.1 5000 1 file 0      (./receive 1234 0)
+
+#define MAX_FLOWS 16
+#define MAX_DATAGRAM 65536
+#define SOCKET_BUFFER (4 << 20)
+#define FORWARD 0
+#define REVERSE 1
+
+typedef struct {
+    double delay, jitter; // us
+    double p, r, loss_good, loss_bad; // Gilbert-Elliott
+    double reorder, reorder_delay; // us
+    double dup, corrupt;
+    double rate, burst, queue; // bytes/us, bytes, bytes; rate 0 for no cap
+} Impair;
+
+typedef struct {
+    Impair cfg;
+    uint64_t rng;
+    int bad; // Gilbert-Elliott state
+    double tokens;
+    uint64_t bucket_at; // when tokens was last brought up to date; past now while a queue is waiting
+    uint64_t in, lost, queue_drops, duplicated, corrupted, reordered, out, send_errors;
+} Direction;
+
+typedef struct {
+    uint64_t at, seq; // departure, and arrival order to break ties
+    int dir, flow, len;
+    unsigned char data[];
+} Pending;
+
+Direction dirs[2];
+int down_fd[MAX_FLOWS], up_fd[MAX_FLOWS]; // clients' side, target's side
+struct sockaddr_in client[MAX_FLOWS], target[MAX_FLOWS];
+int have_client[MAX_FLOWS];
+Pending **heap;
+int heap_n, heap_cap;
+uint64_t next_seq;
+volatile sig_atomic_t stop;
+
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// splitmix64
+uint64_t next_random(Direction *d) {
+    uint64_t z = (d->rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+double uniform(Direction *d) {
+    return (next_random(d) >> 11) * 0x1.0p-53;
+}
+
+int chance(Direction *d, double p) {
+    return uniform(d) < p;
+}
+
+double gaussian(Direction *d) {
+    double u = uniform(d), v = uniform(d);
+    return sqrt(-2 * log(u > 0 ? u : 1e-300)) * cos(2 * M_PI * v);
+}
+
+int before(const Pending *a, const Pending *b) {
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+void heap_push(Pending *p) {
+    if(heap_n == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 1024;
+        if(!(heap = realloc(heap, heap_cap * sizeof(*heap)))) {
+            perror("realloc failed");
+            exit(1);
+        }
+    }
+    int i = heap_n++;
+    while(i > 0 && before(p, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = p;
+}
+
+Pending *heap_pop(void) {
+    Pending *top = heap[0], *last = heap[--heap_n];
+    int i = 0;
+    while(2 * i + 1 < heap_n) {
+        int c = 2 * i + 1;
+        if(c + 1 < heap_n && before(heap[c + 1], heap[c])) c++;
+        if(!before(heap[c], last)) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if(heap_n > 0) heap[i] = last;
+    return top;
+}
+
+// When a datagram of len bytes arriving now leaves the bottleneck, or 0 if
+// the queue in front of it is full
+uint64_t shape(Direction *d, uint64_t now, int len) {
+    const Impair *c = &d->cfg;
+    if(c->rate <= 0) return now;
+    if(d->bucket_at > now && (d->bucket_at - now) * c->rate + len > c->queue) return 0;
+    uint64_t t = d->bucket_at > now ? d->bucket_at : now;
+    d->tokens += (t - d->bucket_at) * c->rate;
+    if(d->tokens > c->burst) d->tokens = c->burst;
+    d->bucket_at = t;
+    if(d->tokens >= len) {
+        d->tokens -= len;
+        return t;
+    }
+    d->bucket_at = t + (uint64_t)ceil((len - d->tokens) / c->rate);
+    d->tokens = 0;
+    return d->bucket_at;
+}
+
+int lose(Direction *d) {
+    const Impair *c = &d->cfg;
+    if(d->bad) {
+        if(chance(d, c->r)) d->bad = 0;
+    } else if(chance(d, c->p)) {
+        d->bad = 1;
+    }
+    return chance(d, d->bad ? c->loss_bad : c->loss_good);
+}
+
+// One datagram in: schedule whatever survives
+void impair(int dir, int flow, const unsigned char *buf, int len, uint64_t now) {
+    Direction *d = &dirs[dir];
+    const Impair *c = &d->cfg;
+    d->in++;
+    if(lose(d)) {
+        d->lost++;
+        return;
+    }
+    int copies = 1;
+    if(chance(d, c->dup)) {
+        copies = 2;
+        d->duplicated++;
+    }
+    for(int i = 0; i < copies; i++) {
+        uint64_t at = shape(d, now, len);
+        if(!at) {
+            d->queue_drops++;
+            continue;
+        }
+        Pending *p = malloc(sizeof(*p) + len);
+        if(!p) {
+            perror("malloc failed");
+            exit(1);
+        }
+        memcpy(p->data, buf, len);
+        if(len > 0 && chance(d, c->corrupt)) {
+            uint64_t bit = next_random(d) % (len * 8);
+            p->data[bit / 8] ^= 1 << (bit % 8);
+            d->corrupted++;
+        }
+        double delay = c->delay + (c->jitter > 0 ? gaussian(d) * c->jitter : 0);
+        if(chance(d, c->reorder)) {
+            delay += c->reorder_delay;
+            d->reordered++;
+        }
+        p->at = at + (delay > 0 ? (uint64_t)delay : 0);
+        p->seq = next_seq++;
+        p->dir = dir;
+        p->flow = flow;
+        p->len = len;
+        heap_push(p);
+    }
+}
+
+void deliver(Pending *p) {
+    Direction *d = &dirs[p->dir];
+    int fd = p->dir == FORWARD ? up_fd[p->flow] : down_fd[p->flow];
+    struct sockaddr_in *to = p->dir == FORWARD ? &target[p->flow] : &client[p->flow];
+    if(sendto(fd, p->data, p->len, 0, (struct sockaddr *)to, sizeof(*to)) < 0) d->send_errors++;
+    else d->out++;
+    free(p);
+}
+
+// "a" or "a/b" into fwd and rev: up to n comma-separated numbers each,
+// the ones left out keeping their defaults. Returns 0 or -1.
+int parse_pair(const char *arg, int n, double *fwd, double *rev) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", arg);
+    char *slash = strchr(buf, '/');
+    if(slash) *slash = '\0';
+    const char *parts[2] = { buf, slash ? slash + 1 : buf };
+    double *out[2] = { fwd, rev };
+    for(int s = 0; s < 2; s++) {
+        const char *q = parts[s];
+        for(int i = 0; i < n; i++) {
+            char *end;
+            double v = strtod(q, &end);
+            if(end == q || v < 0) return -1;
+            out[s][i] = v;
+            if(*end == '\0') break;
+            if(*end != ',' || i == n - 1) return -1;
+            q = end + 1;
+        }
+    }
+    return 0;
+}
+
+// probabilities are at most 1
+int probabilities(const double *v, int n) {
+    for(int i = 0; i < n; i++) if(v[i] > 1) return -1;
+    return 0;
+}
+
+void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d ms] [-j ms] [-l p] [-g p,r[,loss_good,loss_bad]] [-r p,ms] [-u p] [-c p] "
+                    "[-b mbit[,burst_kb[,queue_kb]]] [-n flows] [-s seed] <listen_port> <target_ip> <target_port>\n"
+                    "  each value may be fwd/rev\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    double v[2][4];
+    int flows = 1, opt;
+    uint64_t seed = 1;
+    for(int i = 0; i < 2; i++) dirs[i].cfg = (Impair){ .loss_bad = 1, .burst = 16 * 1024, .queue = 256 * 1024 };
+    while((opt = getopt(argc, argv, "d:j:l:g:r:u:c:b:n:s:")) != -1) {
+        if(strchr("djlgrucb", opt)) {
+            // defaults for the parts that may be left out
+            for(int i = 0; i < 2; i++) {
+                Impair *c = &dirs[i].cfg;
+                v[i][0] = 0;
+                v[i][1] = opt == 'g' ? c->r : opt == 'r' ? c->reorder_delay / 1000 : opt == 'b' ? c->burst / 1024 : 0;
+                v[i][2] = opt == 'g' ? c->loss_good : opt == 'b' ? c->queue / 1024 : 0;
+                v[i][3] = opt == 'g' ? c->loss_bad : 0;
+            }
+            int n = opt == 'g' ? 4 : opt == 'b' ? 3 : opt == 'r' ? 2 : 1;
+            if(parse_pair(optarg, n, v[0], v[1]) < 0) usage(argv[0]);
+            for(int i = 0; i < 2; i++) {
+                Impair *c = &dirs[i].cfg;
+                int bad = 0;
+                switch(opt) {
+                    case 'd': c->delay = v[i][0] * 1000; break;
+                    case 'j': c->jitter = v[i][0] * 1000; break;
+                    case 'l':
+                        bad = probabilities(v[i], 1);
+                        c->p = c->r = 0;
+                        c->loss_good = c->loss_bad = v[i][0];
+                        break;
+                    case 'g':
+                        bad = probabilities(v[i], 4);
+                        c->p = v[i][0];
+                        c->r = v[i][1];
+                        c->loss_good = v[i][2];
+                        c->loss_bad = v[i][3];
+                        break;
+                    case 'r':
+                        bad = probabilities(v[i], 1);
+                        c->reorder = v[i][0];
+                        c->reorder_delay = v[i][1] * 1000;
+                        break;
+                    case 'u': bad = probabilities(v[i], 1); c->dup = v[i][0]; break;
+                    case 'c': bad = probabilities(v[i], 1); c->corrupt = v[i][0]; break;
+                    case 'b':
+                        c->rate = v[i][0] / 8; // Mbit/s is bits/us
+                        c->burst = v[i][1] * 1024;
+                        c->queue = v[i][2] * 1024;
+                        break;
+                }
+                if(bad) {
+                    fprintf(stderr, "-%c: probabilities go up to 1\n", opt);
+                    exit(1);
+                }
+            }
+        } else if(opt == 'n') {
+            flows = atoi(optarg);
+        } else if(opt == 's') {
+            seed = strtoull(optarg, NULL, 0);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if(argc - optind != 3) usage(argv[0]);
+    if(flows < 1 || flows > MAX_FLOWS) {
+        fprintf(stderr, "Flows must be between 1 and %d\n", MAX_FLOWS);
+        exit(1);
+    }
+    int listen_port = atoi(argv[optind]), target_port = atoi(argv[optind + 2]);
+    for(int i = 0; i < 2; i++) {
+        dirs[i].rng = seed * 2 + i;
+        dirs[i].tokens = dirs[i].cfg.burst;
+    }
+
+    struct pollfd fds[2 * MAX_FLOWS];
+    for(int f = 0; f < flows; f++) {
+        target[f] = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(target_port + f) };
+        if(inet_pton(AF_INET, argv[optind + 1], &target[f].sin_addr) <= 0) {
+            fprintf(stderr, "Invalid target IP\n");
+            exit(1);
+        }
+        struct sockaddr_in local = { .sin_family = AF_INET, .sin_port = htons(listen_port + f), .sin_addr.s_addr = INADDR_ANY };
+        down_fd[f] = socket(AF_INET, SOCK_DGRAM, 0);
+        up_fd[f] = socket(AF_INET, SOCK_DGRAM, 0);
+        if(down_fd[f] < 0 || up_fd[f] < 0) {
+            perror("Socket creation failed");
+            exit(1);
+        }
+        if(bind(down_fd[f], (struct sockaddr *)&local, sizeof(local)) < 0) {
+            perror("bind failed");
+            exit(1);
+        }
+        int size = SOCKET_BUFFER;
+        for(int s = 0; s < 2; s++) {
+            int fd = s ? up_fd[f] : down_fd[f];
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fds[2 * f + s] = (struct pollfd){ .fd = fd, .events = POLLIN };
+        }
+    }
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    fprintf(stderr, "Relaying %d-%d -> %s:%d-%d, seed %lu\n", listen_port, listen_port + flows - 1, argv[optind + 1],
+            target_port, target_port + flows - 1, (unsigned long)seed);
+
+    static unsigned char buf[MAX_DATAGRAM];
+    while(!stop) {
+        uint64_t now = now_us();
+        while(heap_n > 0 && heap[0]->at <= now) deliver(heap_pop());
+        struct timespec wait, *timeout = NULL;
+        if(heap_n > 0) {
+            uint64_t us = heap[0]->at - now;
+            wait = (struct timespec){ .tv_sec = us / 1000000, .tv_nsec = us % 1000000 * 1000 };
+            timeout = &wait;
+        }
+        if(ppoll(fds, 2 * flows, timeout, NULL) <= 0) continue;
+        now = now_us();
+        for(int i = 0; i < 2 * flows; i++) {
+            if(!(fds[i].revents & POLLIN)) continue;
+            int f = i / 2, dir = i % 2 ? REVERSE : FORWARD;
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t n;
+            while((n = recvfrom(fds[i].fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len)) >= 0) {
+                if(dir == FORWARD) {
+                    client[f] = from;
+                    have_client[f] = 1;
+                }
+                if(dir == FORWARD || have_client[f]) impair(dir, f, buf, n, now);
+                from_len = sizeof(from);
+            }
+        }
+    }
+
+    const char *names[2] = { "forward", "reverse" };
+    for(int i = 0; i < 2; i++) {
+        Direction *d = &dirs[i];
+        fprintf(stderr, "%s: %lu in, %lu lost, %lu queue drops, %lu duplicated, %lu corrupted, %lu reordered, %lu out, %lu send errors\n",
+                names[i], d->in, d->lost, d->queue_drops, d->duplicated, d->corrupted, d->reordered, d->out, d->send_errors);
+    }
+    return 0;
+}
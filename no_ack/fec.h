@@ -0,0 +1,255 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Forward error correction for the one-way mode: every block of k data
+// chunks is followed by m parity chunks, and any k of the k + m rebuild
+// the block, so up to m losses per block need no retransmission.
+//
+// The code is a systematic Reed-Solomon over GF(2^8) with a Cauchy
+// parity matrix, scaled so its first row is all ones: parity chunk 0 is
+// the plain XOR of the block, and m = 1 is simple XOR parity. Any square
+// submatrix of a Cauchy matrix is invertible, which is what makes every
+// k-of-(k + m) subset decodable.
+//
+// Datagram: FEC_HEADER bytes, then FEC_CHUNK bytes of payload, always full
+// (the tail of the file is zero-padded), so every datagram is FEC_DATAGRAM
+// bytes and GSO/GRO segment them like plain chunks. Big-endian:
+//   [0..3] block  [4] index (data chunks, then parity)  [5] k  [6] m  [7] 0  [8..11] file size
+// The last block holds fewer data chunks when the file runs out; both ends
+// work that out from the file size, so k is the same in every header.
+
+#define FEC_DATAGRAM 1024
+#define FEC_HEADER 12
+#define FEC_CHUNK (FEC_DATAGRAM - FEC_HEADER)
+#define FEC_MAX_K 128
+#define FEC_MAX_M 32
+
+typedef struct {
+    uint32_t block;
+    int index, k, m;
+    uint32_t f_size;
+} FecHeader;
+
+static inline void fec_encode_header(const FecHeader *h, unsigned char *buf) {
+    uint32_t block = htonl(h->block), f_size = htonl(h->f_size);
+    memcpy(buf, &block, 4);
+    buf[4] = h->index;
+    buf[5] = h->k;
+    buf[6] = h->m;
+    buf[7] = 0;
+    memcpy(buf + 8, &f_size, 4);
+}
+
+// Returns 0, or -1 for a datagram that isn't a valid FEC chunk
+static inline int fec_decode_header(const unsigned char *buf, size_t len, FecHeader *h) {
+    uint32_t block, f_size;
+    if(len != FEC_DATAGRAM) return -1;
+    memcpy(&block, buf, 4);
+    memcpy(&f_size, buf + 8, 4);
+    h->block = ntohl(block);
+    h->index = buf[4];
+    h->k = buf[5];
+    h->m = buf[6];
+    h->f_size = ntohl(f_size);
+    if(h->k < 1 || h->k > FEC_MAX_K || h->m > FEC_MAX_M || h->index >= h->k + h->m) return -1;
+    return 0;
+}
+
+// Data chunks in `block`: k, or what is left of the file in the last one
+static inline int fec_block_data(uint32_t block, int k, uint32_t f_size) {
+    uint64_t chunks = ((uint64_t)f_size + FEC_CHUNK - 1) / FEC_CHUNK;
+    uint64_t first = (uint64_t)block * k;
+    if(first >= chunks) return 0;
+    return chunks - first < (uint64_t)k ? (int)(chunks - first) : k;
+}
+
+// GF(2^8) with the usual 0x11d polynomial. gf_lo/gf_hi hold each constant's
+// products with every low and high nibble, for the pshufb multiply.
+static uint8_t gf_exp[512], gf_log[256];
+static uint8_t gf_lo[256][16], gf_hi[256][16];
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static inline uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+static inline void gf_init(void) {
+    int x = 1;
+    for(int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if(x & 0x100) x ^= 0x11d;
+    }
+    for(int c = 0; c < 256; c++) {
+        for(int n = 0; n < 16; n++) {
+            gf_lo[c][n] = gf_mul(c, n);
+            gf_hi[c][n] = gf_mul(c, n << 4);
+        }
+    }
+}
+
+// Parity matrix entry for parity row r and data column j: the Cauchy
+// element 1 / (x_r + y_j) with x_r = 255 - r, y_j = j, divided by the
+// column's row-0 element. Independent of k, so the short last block uses
+// the same rows.
+static inline uint8_t fec_coef(int r, int j) {
+    uint8_t c = gf_inv((255 - r) ^ j), c0 = gf_inv(255 ^ j);
+    return gf_mul(c, gf_inv(c0));
+}
+
+// dst ^= c * src over len bytes, the inner loop of both encode and decode.
+// x86 splits every byte into nibbles and looks both up with pshufb, 16 or
+// 32 bytes per instruction; the tail and other CPUs go a byte at a time.
+static inline void gf_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    for(size_t i = 0; i < len; i++) dst[i] ^= gf_lo[c][src[i] & 15] ^ gf_hi[c][src[i] >> 4];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)gf_lo[c]), hi = _mm_loadu_si128((const __m128i *)gf_hi[c]);
+    __m128i mask = _mm_set1_epi8(15);
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+                                  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), p));
+    }
+    gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_lo[c]));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_hi[c]));
+    __m256i mask = _mm256_set1_epi8(15);
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+                                     _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), p));
+    }
+    gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+typedef void (*GfMulAdd)(uint8_t *, const uint8_t *, uint8_t, size_t);
+
+// Picks the widest kernel this CPU runs; call after gf_init
+static inline GfMulAdd gf_mul_add_select(const char **name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) { *name = "avx2"; return gf_mul_add_avx2; }
+    if(__builtin_cpu_supports("ssse3")) { *name = "ssse3"; return gf_mul_add_ssse3; }
+#endif
+    *name = "scalar";
+    return gf_mul_add_scalar;
+}
+
+static GfMulAdd gf_mul_add = gf_mul_add_scalar;
+
+static inline void fec_init(const char **kernel) {
+    gf_init();
+    gf_mul_add = gf_mul_add_select(kernel);
+}
+
+// XOR is multiplication by one; worth its own loop since parity row 0 is all ones
+static inline void fec_xor(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for(; i < len; i++) dst[i] ^= src[i];
+}
+
+static inline void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if(c == 1) fec_xor(dst, src, len);
+    else if(c) gf_mul_add(dst, src, c, len);
+}
+
+// Fills the m parity chunks of a block from its n data chunks (n <= k),
+// all FEC_CHUNK bytes: chunk i at blk + i * stride, parity r at index n + r.
+static inline void fec_encode(uint8_t *blk, size_t stride, int n, int m) {
+    for(int r = 0; r < m; r++) {
+        uint8_t *p = blk + (n + r) * stride;
+        memset(p, 0, FEC_CHUNK);
+        for(int j = 0; j < n; j++) fec_mul_add(p, blk + j * stride, fec_coef(r, j), FEC_CHUNK);
+    }
+}
+
+// Rebuilds the missing data chunks of a block in place, laid out as for
+// fec_encode, from whichever n of its n + m chunks have[] marks. Returns the
+// number of data chunks recovered, or -1 if fewer than n chunks are present.
+static inline int fec_decode(uint8_t *blk, size_t stride, int n, int m, const uint8_t *have) {
+    int lost[FEC_MAX_M], rows[FEC_MAX_M], e = 0, p = 0;
+    for(int j = 0; j < n; j++) {
+        if(have[j]) continue;
+        if(e == m) return -1;
+        lost[e++] = j;
+    }
+    if(e == 0) return 0;
+    for(int r = 0; r < m && p < e; r++) if(have[n + r]) rows[p++] = r;
+    if(p < e) return -1;
+
+    // syndromes: each used parity chunk minus the data chunks we have
+    // leaves a combination of just the lost ones
+    for(int i = 0; i < e; i++) {
+        uint8_t *s = blk + (n + rows[i]) * stride;
+        for(int j = 0; j < n; j++) if(have[j]) fec_mul_add(s, blk + j * stride, fec_coef(rows[i], j), FEC_CHUNK);
+    }
+
+    // invert the e x e matrix of those rows and lost columns (Gauss-Jordan)
+    uint8_t a[FEC_MAX_M][FEC_MAX_M], inv[FEC_MAX_M][FEC_MAX_M];
+    for(int i = 0; i < e; i++) {
+        for(int j = 0; j < e; j++) {
+            a[i][j] = fec_coef(rows[i], lost[j]);
+            inv[i][j] = i == j;
+        }
+    }
+    for(int c = 0; c < e; c++) {
+        int piv = c;
+        while(!a[piv][c]) piv++; // always found: Cauchy submatrices are nonsingular
+        for(int j = 0; j < e; j++) {
+            uint8_t t = a[c][j]; a[c][j] = a[piv][j]; a[piv][j] = t;
+            t = inv[c][j]; inv[c][j] = inv[piv][j]; inv[piv][j] = t;
+        }
+        uint8_t f = gf_inv(a[c][c]);
+        for(int j = 0; j < e; j++) {
+            a[c][j] = gf_mul(a[c][j], f);
+            inv[c][j] = gf_mul(inv[c][j], f);
+        }
+        for(int i = 0; i < e; i++) {
+            if(i == c || !a[i][c]) continue;
+            uint8_t g = a[i][c];
+            for(int j = 0; j < e; j++) {
+                a[i][j] ^= gf_mul(g, a[c][j]);
+                inv[i][j] ^= gf_mul(g, inv[c][j]);
+            }
+        }
+    }
+
+    for(int i = 0; i < e; i++) {
+        uint8_t *d = blk + lost[i] * stride;
+        memset(d, 0, FEC_CHUNK);
+        for(int r = 0; r < e; r++) fec_mul_add(d, blk + (n + rows[r]) * stride, inv[i][r], FEC_CHUNK);
+    }
+    return e;
+}
+
+#endif
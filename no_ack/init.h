@@ -0,0 +1,45 @@
+#ifndef INIT_H
+#define INIT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Setup datagram: everything the receiver needs before the first chunk, in
+// one frame the sender repeats until the receiver's "OK" comes back. The
+// receiver answers every copy, including late ones among the chunks.
+//
+// Layout, big-endian: INIT_MAGIC (8), flags (4), file size (8), then the
+// file name, not terminated.
+
+#define INIT_MAGIC "UDPINIT1"
+#define INIT_HEADER 20
+#define INIT_FEC 1 // chunks carry FEC headers (sender -f)
+#define INIT_TRIES 8
+#define INIT_TIMEOUT_MS 200 // first wait for the OK, doubled on every retry
+
+// Returns the datagram's length, or -1 if the name doesn't fit in size bytes
+static inline int init_encode(uint32_t flags, uint64_t f_size, const char *name, unsigned char *buf, size_t size) {
+    size_t n = strlen(name);
+    uint32_t f[3] = { htonl(flags), htonl(f_size >> 32), htonl((uint32_t)f_size) };
+    if(n == 0 || INIT_HEADER + n > size) return -1;
+    memcpy(buf, INIT_MAGIC, 8);
+    memcpy(buf + 8, f, 12);
+    memcpy(buf + INIT_HEADER, name, n);
+    return INIT_HEADER + n;
+}
+
+// name needs len - INIT_HEADER + 1 bytes. Returns 0, or -1 for a datagram
+// that isn't an INIT.
+static inline int init_decode(const unsigned char *buf, size_t len, uint32_t *flags, uint64_t *f_size, char *name) {
+    uint32_t f[3];
+    if(len <= INIT_HEADER || memcmp(buf, INIT_MAGIC, 8) != 0 || memchr(buf + INIT_HEADER, '\0', len - INIT_HEADER)) return -1;
+    memcpy(f, buf + 8, 12);
+    *flags = ntohl(f[0]);
+    *f_size = (uint64_t)ntohl(f[1]) << 32 | ntohl(f[2]);
+    memcpy(name, buf + INIT_HEADER, len - INIT_HEADER);
+    name[len - INIT_HEADER] = '\0';
+    return 0;
+}
+
+#endif
@@ -1,14 +1,110 @@
+#define _GNU_SOURCE // recvmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include "fec.h"
+#include "init.h"
 
 #define LISTEN_PORT 1234
 #define BUFFER_SIZE 1024
+#define BATCH 32 // datagrams per recvmmsg call
+#define MAX_BATCH 1024
+#define RCVBUF_SIZE (8 * 1024 * 1024) // absorb sender bursts; the kernel caps this at rmem_max
+#define GRO_BUFFER_SIZE 65536 // one coalesced GRO datagram can be up to 64 KB
+#define FEC_WINDOW 64 // blocks collected at once; a block this far behind is given up
 
-int main() {
+// FEC mode: chunks are written at their offset as they come in, and kept
+// per block until enough have arrived to rebuild the missing ones
+typedef struct {
+    int64_t block; // -1 while the slot is unused
+    int n, count, done; // data chunks in the block, chunks in hand, rebuilt
+    uint8_t have[FEC_MAX_K + FEC_MAX_M];
+    uint8_t *buf; // (k + m) * FEC_CHUNK
+} FecBlock;
+
+FecBlock fec_blocks[FEC_WINDOW];
+int fec_k, fec_m;
+uint32_t fec_size;
+long fec_chunks, fec_written, fec_rebuilt;
+
+void fec_write(int fd, int64_t block, int j, const uint8_t *data) {
+    uint64_t off = ((uint64_t)block * fec_k + j) * FEC_CHUNK;
+    size_t len = fec_size - off < FEC_CHUNK ? fec_size - off : FEC_CHUNK; // drop the tail padding
+    if(pwrite(fd, data, len, off) != (ssize_t)len) {
+        perror("pwrite failed");
+        exit(EXIT_FAILURE);
+    }
+    fec_written++;
+}
+
+// One FEC datagram. Returns 1 once every chunk of the file is on disk.
+int fec_receive(int fd, const unsigned char *data, size_t len) {
+    FecHeader h;
+    if(fec_decode_header(data, len, &h) < 0) return 0;
+    if(!fec_k) { // the first header fixes the code and the file size
+        const char *kernel;
+        fec_init(&kernel);
+        printf("FEC: %d data + %d parity chunks per block (%s)\n", h.k, h.m, kernel);
+        fec_k = h.k;
+        fec_m = h.m;
+        fec_size = h.f_size;
+        fec_chunks = ((long)fec_size + FEC_CHUNK - 1) / FEC_CHUNK;
+        for(int i = 0; i < FEC_WINDOW; i++) {
+            fec_blocks[i].block = -1;
+            fec_blocks[i].buf = malloc((size_t)(fec_k + fec_m) * FEC_CHUNK);
+            if(!fec_blocks[i].buf) {
+                perror("malloc failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    int n = fec_block_data(h.block, fec_k, fec_size);
+    if(h.k != fec_k || h.m != fec_m || h.f_size != fec_size || h.index >= n + fec_m) return 0;
+
+    FecBlock *b = &fec_blocks[h.block % FEC_WINDOW];
+    if(b->block > (int64_t)h.block) return 0; // too late, the slot has moved on
+    if(b->block != h.block) {
+        b->block = h.block;
+        b->n = n;
+        b->count = 0;
+        b->done = 0;
+        memset(b->have, 0, sizeof(b->have));
+    }
+    if(b->done || b->have[h.index]) return 0;
+
+    b->have[h.index] = 1;
+    b->count++;
+    memcpy(b->buf + h.index * FEC_CHUNK, data + FEC_HEADER, FEC_CHUNK);
+    if(h.index < n) fec_write(fd, h.block, h.index, data + FEC_HEADER);
+    if(b->count == n) { // any n of the n + m chunks rebuild the rest
+        int rebuilt = fec_decode(b->buf, FEC_CHUNK, n, fec_m, b->have);
+        for(int j = 0; rebuilt > 0 && j < n; j++) if(!b->have[j]) fec_write(fd, h.block, j, b->buf + j * FEC_CHUNK);
+        if(rebuilt > 0) fec_rebuilt += rebuilt;
+        b->done = 1;
+    }
+    return fec_written == fec_chunks;
+}
+
+int main(int argc, char *argv[]) {
     int sockfd;
+    int batch = BATCH, gro = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "g")) != -1) {
+        switch(opt) {
+            case 'g': gro = 1; break;
+            default: batch = 0; // reported as a usage error below
+        }
+    }
+    if(optind < argc) batch = atoi(argv[optind]);
+    if(batch < 1 || batch > MAX_BATCH) {
+        fprintf(stderr, "Usage: %s [-g] [batch_size 1-%d]\n", argv[0], MAX_BATCH);
+        exit(EXIT_FAILURE);
+    }
     struct sockaddr_in receiver_addr, sender_addr;
     char buffer[BUFFER_SIZE];
     socklen_t addr_len = sizeof(sender_addr);
@@ -19,6 +115,9 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    int rcvbuf = RCVBUF_SIZE;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
     memset(&receiver_addr, 0, sizeof(receiver_addr));
     receiver_addr.sin_family = AF_INET;
     receiver_addr.sin_port = htons(LISTEN_PORT);
@@ -30,26 +129,29 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    ssize_t recv_len = recvfrom(sockfd, buffer, BUFFER_SIZE-1, 0, (struct sockaddr *)&sender_addr, &addr_len);
-    if(recv_len < 0) {
-        perror("Recvfrom failed, line 35");
-        close(EXIT_FAILURE);
-    }
-
-    buffer[recv_len] = '\0';
-    printf("Recerved message: %s\n", buffer);
-
-    // now for file
-    recv_len = recvfrom(sockfd, buffer, BUFFER_SIZE-1, 0, (struct sockaddr *)&sender_addr, &addr_len);
-    if(recv_len < 0) {
-        perror("recvfrom failed, line 45");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+    // anything before the sender's INIT is from an earlier transfer
+    char name[BUFFER_SIZE];
+    uint32_t flags;
+    uint64_t size;
+    static char init[BUFFER_SIZE]; // kept to recognise repeats among the chunks
+    ssize_t init_len;
+    while(1) {
+        ssize_t recv_len = recvfrom(sockfd, buffer, BUFFER_SIZE-1, 0, (struct sockaddr *)&sender_addr, &addr_len);
+        if(recv_len < 0) {
+            perror("Recvfrom failed, line 35");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+        if(init_decode((unsigned char *)buffer, recv_len, &flags, &size, name) == 0) {
+            memcpy(init, buffer, recv_len);
+            init_len = recv_len;
+            break;
+        }
     }
-    buffer[recv_len] = '\0';
-    printf("Received file name: %s\n", buffer);
+    int fec = flags & INIT_FEC; // the sender protects chunks with -f
+    printf("Received INIT: %s, %lu bytes%s\n", name, (unsigned long)size, fec ? ", FEC" : "");
 
-    // reply
+    // reply; the sender repeats its INIT until this arrives
     char *ok_msg = "OK";
     ssize_t sent_bytes = sendto(sockfd, ok_msg, strlen(ok_msg), 0, (struct sockaddr *)&sender_addr, addr_len);
     if(sent_bytes < 0) {
@@ -61,40 +163,121 @@ int main() {
     printf("Sent OK response to sender.\n");
 
     // now let's receive file
-    FILE *fp = fopen(buffer, "wb");
+    FILE *fp = fopen(name, "wb");
     if(fp == NULL) {
         perror("Failed to fopen, line 66");
         close(sockfd);
         exit(EXIT_FAILURE);
     }
 
-    printf("Receiving file content and saving as '%s'...\n", buffer);
+    printf("Receiving file content and saving as '%s'...\n", name);
+
+    // with -g the kernel may hand us several same-sized datagrams glued
+    // together (UDP_GRO); the cmsg tells us where to cut them apart again
+    if(gro) {
+        int on = 1;
+        if(setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+            perror("UDP_GRO not available, receiving plain datagrams");
+            gro = 0;
+        } else if(batch > MAX_BATCH * BUFFER_SIZE / GRO_BUFFER_SIZE) {
+            batch = MAX_BATCH * BUFFER_SIZE / GRO_BUFFER_SIZE;
+        }
+    }
+    size_t unit = gro ? GRO_BUFFER_SIZE : BUFFER_SIZE;
+
+    // file chunks are a full BUFFER_SIZE, so receive into separate buffers
+    // rather than `buffer`, which keeps a byte spare for the terminator
+    static char chunk[MAX_BATCH * BUFFER_SIZE];
+    static char ctrl[MAX_BATCH][CMSG_SPACE(sizeof(int))];
+    struct iovec iov[MAX_BATCH];
+    struct mmsghdr msgs[MAX_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < batch; i++) {
+        iov[i].iov_base = chunk + i * unit;
+        iov[i].iov_len = unit;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
     // until we see "finish"
-    while(1) {
-        ssize_t recv_len = recvfrom(sockfd, buffer, BUFFER_SIZE-1, 0, (struct sockaddr *)&sender_addr, &addr_len);
-        if(recv_len < 0) {
-            perror("recvfrom file chunk failed, line 77");
+    struct timespec start, end;
+    long packets = 0, syscalls = 0;
+    int finished = 0;
+    while(!finished) {
+        for(int i = 0; gro && i < batch; i++) {
+            msgs[i].msg_hdr.msg_control = ctrl[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+        }
+        // block for the first datagram, then take whatever else is queued
+        int n = recvmmsg(sockfd, msgs, batch, MSG_WAITFORONE, NULL);
+        if(n < 0) {
+            perror("recvmmsg file chunk failed");
             fclose(fp);
             close(sockfd);
             exit(EXIT_FAILURE);
         }
+        if(syscalls++ == 0) clock_gettime(CLOCK_MONOTONIC, &start);
 
-        // did we see "finish"
-        if(recv_len == 6 && strncmp(buffer, "Finish", 6) == 0) {
-            printf("Received 'Finish' message.\n");
-            break;
-        }
+        for(int i = 0; i < n && !finished; i++) {
+            char *data = iov[i].iov_base;
+            size_t total = msgs[i].msg_len;
+            size_t seg = total;
+            for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); gro && cm; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+                if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    int gso_size;
+                    memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+                    seg = gso_size;
+                }
+            }
 
-        size_t written = fwrite(buffer, 1, recv_len, fp);
-        if(written != recv_len) {
-            perror("fwrite fialed, line 86");
-            fclose(fp);
-            close(sockfd);
-            exit(EXIT_FAILURE);
+            for(size_t off = 0; off < total; off += seg) {
+                size_t len = total - off < seg ? total - off : seg;
+
+                // did we see "finish"
+                if(len == 6 && strncmp(data + off, "Finish", 6) == 0) {
+                    printf("Received 'Finish' message.\n");
+                    finished = 1;
+                    break;
+                }
+                // our OK got lost: the sender is still repeating its INIT.
+                // It only does so before its first chunk, and a chunk may
+                // well start with the magic, so the copy has to match ours.
+                if(packets == 0 && len == (size_t)init_len && memcmp(data + off, init, len) == 0) {
+                    sendto(sockfd, ok_msg, strlen(ok_msg), 0, (struct sockaddr *)&sender_addr, addr_len);
+                    continue;
+                }
+
+                if(fec) {
+                    packets++;
+                    if(fec_receive(fileno(fp), (unsigned char *)data + off, len)) {
+                        printf("Every chunk is in.\n");
+                        finished = 1;
+                        break;
+                    }
+                    continue;
+                }
+
+                size_t written = fwrite(data + off, 1, len, fp);
+                if(written != len) {
+                    perror("fwrite failed");
+                    fclose(fp);
+                    close(sockfd);
+                    exit(EXIT_FAILURE);
+                }
+                packets++;
+            }
         }
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%ld packets in %ld syscalls, %.3f s (%.0f pkt/s)\n",
+           packets, syscalls, secs, secs > 0 ? packets / secs : 0.0);
 
+    if(fec) {
+        // trims the padding of a lost tail, or sizes a file whose tail never came
+        if(ftruncate(fileno(fp), fec_size) < 0) perror("ftruncate failed");
+        printf("FEC %d+%d: %ld chunks rebuilt, %ld of %ld lost\n", fec_k, fec_m, fec_rebuilt, fec_chunks - fec_written, fec_chunks);
+    }
     fclose(fp);
     printf("File received fully and saved.\n");
 
@@ -1,17 +1,98 @@
+#define _GNU_SOURCE // sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include "fec.h"
+#include "init.h"
 
 #define SERVER_PORT 1234
 #define SERVER_IP "127.0.0.1"
 #define BUFFER 1024
+#define BATCH 32 // chunks per sendmmsg call
+#define MAX_BATCH 1024
+#define GSO_SEGMENTS 63 // chunks per GSO super-buffer; 63 * 1024 stays under the 64 KB UDP limit
 
-int main() {
+_Static_assert(FEC_DATAGRAM == BUFFER, "FEC datagrams must stay chunk-sized for GSO");
+
+// -f k,m: the block being sent, every datagram of it built up front
+int fec_k, fec_m;
+uint32_t f_size, fec_block;
+int fec_next, fec_total; // next datagram of the block to hand out, and how many it has
+static unsigned char fec_blk[(FEC_MAX_K + FEC_MAX_M) * FEC_DATAGRAM];
+
+// plain path for a super-buffer the kernel refused to segment
+long send_chunks(int sockfd, const char *buf, size_t len, struct sockaddr_in *addr) {
+    long packets = 0;
+    for(size_t off = 0; off < len; off += BUFFER) {
+        size_t n = len - off < BUFFER ? len - off : BUFFER;
+        if(sendto(sockfd, buf + off, n, 0, (struct sockaddr *)addr, sizeof(*addr)) < 0) return -1;
+        packets++;
+    }
+    return packets;
+}
+
+// Reads the next block's data chunks behind their headers and computes its
+// parity, so fec_blk holds k + m ready-to-send datagrams. Returns 0 at EOF.
+int fec_next_block(FILE *fp) {
+    int n = fec_block_data(fec_block, fec_k, f_size);
+    if(n == 0) return 0;
+    for(int i = 0; i < n; i++) {
+        unsigned char *d = fec_blk + i * FEC_DATAGRAM;
+        size_t got = fread(d + FEC_HEADER, 1, FEC_CHUNK, fp);
+        memset(d + FEC_HEADER + got, 0, FEC_CHUNK - got); // the file's tail is zero-padded
+    }
+    fec_encode(fec_blk + FEC_HEADER, FEC_DATAGRAM, n, fec_m);
+    for(int i = 0; i < n + fec_m; i++) {
+        FecHeader h = { .block = fec_block, .index = i, .k = fec_k, .m = fec_m, .f_size = f_size };
+        fec_encode_header(&h, fec_blk + i * FEC_DATAGRAM);
+    }
+    fec_block++;
+    fec_next = 0;
+    fec_total = n + fec_m;
+    return 1;
+}
+
+// Up to len bytes of whole FEC datagrams into buf, the FEC stand-in for
+// fread: a short count means the file is done.
+size_t fec_fill(FILE *fp, char *buf, size_t len) {
+    size_t filled = 0;
+    while(filled + FEC_DATAGRAM <= len) {
+        if(fec_next == fec_total && !fec_next_block(fp)) break;
+        memcpy(buf + filled, fec_blk + fec_next++ * FEC_DATAGRAM, FEC_DATAGRAM);
+        filled += FEC_DATAGRAM;
+    }
+    return filled;
+}
+
+int main(int argc, char *argv[]) {
     int sockfd;
+    int batch = BATCH, gso = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "gf:")) != -1) {
+        switch(opt) {
+            case 'g': gso = 1; break;
+            case 'f':
+                if(sscanf(optarg, "%d,%d", &fec_k, &fec_m) != 2 || fec_k < 1 || fec_k > FEC_MAX_K || fec_m < 1 || fec_m > FEC_MAX_M) {
+                    fprintf(stderr, "-f takes k,m with k 1-%d data and m 1-%d parity chunks per block\n", FEC_MAX_K, FEC_MAX_M);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default: batch = 0; // reported as a usage error below
+        }
+    }
+    if(optind < argc) batch = atoi(argv[optind]);
+    if(batch < 1 || batch > MAX_BATCH) {
+        fprintf(stderr, "Usage: %s [-g] [-f k,m] [batch_size 1-%d]\n", argv[0], MAX_BATCH);
+        exit(EXIT_FAILURE);
+    }
     struct sockaddr_in receiver_addr;
-    char *message = "Greeting";
 
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if(sockfd < 0) {
@@ -24,15 +105,6 @@ int main() {
     receiver_addr.sin_port = htons(SERVER_PORT);
     receiver_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
 
-    ssize_t sent_bytes = sendto(sockfd, message, strlen(message), 0, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr));
-    if(sent_bytes < 0) {
-        perror("Sendto failed");
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    }
-
-    printf("Message sent: %s\n", message);
-
     // now file
     char *filename = malloc(127 * sizeof(char));
     char tempname[100];
@@ -64,51 +136,130 @@ int main() {
                 exit(EXIT_FAILURE);
     }
 
-    ssize_t sent_filename = sendto(sockfd, filename, strlen(filename), 0, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr));
-    if(sent_filename < 0) {
-        perror("Sendto filename failed, line 69");
+    FILE *fp = fopen(filename, "rb");
+    if(fp == NULL) {
+        perror("Failed to open file, line 90");
         close(sockfd);
         exit(EXIT_FAILURE);
     }
-    printf("File name sent: %s\n", filename);
+    fseek(fp, 0L, SEEK_END);
+    f_size = ftell(fp);
+    rewind(fp);
 
+    // mode, size and name in one datagram, resent until the receiver's OK
+    unsigned char init[BUFFER];
+    int init_len = init_encode(fec_k ? INIT_FEC : 0, f_size, filename, init, sizeof(init));
     char buffer[BUFFER];
-    socklen_t addr_len = sizeof(receiver_addr);
-    ssize_t recv_len = recvfrom(sockfd, buffer, BUFFER-1, 0, (struct sockaddr *)&receiver_addr, &addr_len);
-    if(recv_len < 0) {
-        perror("RECVFROM failed, line 79");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+    ssize_t recv_len = -1;
+    for(int tries = 0; recv_len < 0; tries++) {
+        if(tries == INIT_TRIES) {
+            fprintf(stderr, "No answer from receiver. Aborting.\n");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+        if(sendto(sockfd, init, init_len, 0, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) < 0) {
+            perror("Sendto failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if(poll(&pfd, 1, INIT_TIMEOUT_MS << tries) <= 0) continue;
+        recv_len = recv(sockfd, buffer, BUFFER - 1, 0);
     }
+    printf("INIT sent: %s, %u bytes\n", filename, f_size);
 
     buffer[recv_len] = '\0';
     printf("Received from receiver: %s\n", buffer);
 
-    // let's open file and send chunks
-    FILE *fp = fopen(filename, "rb");
-    if(fp == NULL) {
-        perror("Failed to open file, line 90");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+    if(fec_k) {
+        const char *kernel;
+        fec_init(&kernel);
+        printf("FEC: %d data + %d parity chunks per block (%s)\n", fec_k, fec_m, kernel);
     }
 
-    char file_buffer[BUFFER];
-    size_t bytes_read;
-    printf("Sending file contents ... \n");
+    // with -g each message is a super-buffer of up to GSO_SEGMENTS chunks that
+    // the kernel cuts into BUFFER-sized datagrams (UDP_SEGMENT)
+    if(gso) {
+        int seg = BUFFER;
+        if(setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) < 0) {
+            perror("UDP_SEGMENT not available, sending plain datagrams");
+            gso = 0;
+        } else if(batch > MAX_BATCH / GSO_SEGMENTS) {
+            batch = MAX_BATCH / GSO_SEGMENTS;
+        }
+    }
+    size_t unit = gso ? GSO_SEGMENTS * BUFFER : BUFFER;
 
-    // chunks now
-    while((bytes_read = fread(file_buffer, 1, BUFFER, fp)) > 0) {
-        ssize_t sent = sendto(sockfd, file_buffer, bytes_read, 0, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr));
-        if(sent < 0) {
-            perror("sendto file chunks failed, line 103");
-            fclose(fp);
-            close(sockfd);
-            exit(EXIT_FAILURE);
+    static char file_buffer[MAX_BATCH * BUFFER];
+    struct iovec iov[MAX_BATCH];
+    struct mmsghdr msgs[MAX_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < batch; i++) {
+        iov[i].iov_base = file_buffer + i * unit;
+        msgs[i].msg_hdr.msg_name = &receiver_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(receiver_addr);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    printf("Sending file contents%s ... \n", gso ? " (GSO)" : "");
+
+    // chunks now, up to `batch` messages per syscall
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long packets = 0, syscalls = 0;
+    while(1) {
+        int n = 0;
+        size_t bytes_read;
+        while(n < batch && (bytes_read = fec_k ? fec_fill(fp, iov[n].iov_base, unit) : fread(iov[n].iov_base, 1, unit, fp)) > 0) {
+            iov[n].iov_len = bytes_read;
+            n++;
+            if(bytes_read < unit) break;
+        }
+        if(n == 0) break;
+
+        int done = 0;
+        while(done < n) {
+            int sent = sendmmsg(sockfd, msgs + done, n - done, 0);
+            if(sent < 0) {
+                if(errno == EINTR) continue;
+                if(gso && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    // the route can't segment after all: switch GSO off for good and
+                    // push the rest of this batch out chunk by chunk
+                    fprintf(stderr, "GSO send failed (%s), sending plain datagrams\n", strerror(errno));
+                    int off = 0;
+                    setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off));
+                    gso = 0;
+                    for(; done < n; done++) {
+                        long p = send_chunks(sockfd, iov[done].iov_base, iov[done].iov_len, &receiver_addr);
+                        if(p < 0) break;
+                        packets += p;
+                        syscalls += p;
+                    }
+                    if(done == n) {
+                        // everything after this reads plain BUFFER-sized chunks
+                        unit = BUFFER;
+                        for(int i = 0; i < batch; i++) iov[i].iov_base = file_buffer + i * unit;
+                        break;
+                    }
+                }
+                perror("sendmmsg file chunks failed");
+                fclose(fp);
+                close(sockfd);
+                exit(EXIT_FAILURE);
+            }
+            for(int i = done; i < done + sent; i++) {
+                packets += (iov[i].iov_len + BUFFER - 1) / BUFFER;
+            }
+            done += sent;
+            syscalls++;
         }
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
     fclose(fp);
-    printf("File sent fully.\n");
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("File sent fully: %ld packets in %ld syscalls, %.3f s (%.0f pkt/s)\n",
+           packets, syscalls, secs, secs > 0 ? packets / secs : 0.0);
 
     char *finish_msg = "Finish";
     ssize_t finish_sent = sendto(sockfd, finish_msg, strlen(finish_msg), 0, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr));
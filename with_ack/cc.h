@@ -0,0 +1,231 @@
+#ifndef CC_H
+#define CC_H
+
+#include <stdint.h>
+#include <string.h>
+#include "packet.h"
+
+// Pluggable congestion control. An algorithm is a table of callbacks that
+// keep cwnd (packets in flight) and pacing_rate (bytes/s) up to date from
+// ACK samples and retransmit timeouts; the sender only reads those two.
+// Timeouts are the sole loss signal: with per-packet timers and no
+// duplicate ACKs, a timeout is what a fast retransmit is to TCP.
+
+#define CC_INIT_CWND 10
+#define CC_MIN_CWND 4
+#define CC_MAX_CWND MAX_WINDOW
+#define PACING_BURST_US 200 // idle credit a paced sender may spend at once
+
+typedef struct {
+    uint64_t now;
+    uint64_t rtt;           // us; 0 for a retransmitted packet (Karn)
+    uint64_t srtt;          // us; 0 until the first RTT sample
+    uint64_t delivery_rate; // bytes/s delivered over this packet's flight, 0 if unknown
+    int in_flight;          // packets still unacked
+    int round_start;        // this ACK opens a new round trip
+} CcSample;
+
+#define BBR_BW_ROUNDS 10
+
+typedef struct {
+    double cwnd;
+    uint64_t pacing_rate; // 0 leaves sends unpaced
+
+    // loss-based (CUBIC)
+    double ssthresh, w_max, origin, k;
+    uint64_t epoch_start, last_cut;
+
+    // model-based (BBR)
+    int mode, cycle, full_bw_rounds, bw_round;
+    uint64_t bw[BBR_BW_ROUNDS]; // per-round max delivery rate
+    uint64_t full_bw, min_rtt, min_rtt_stamp, mode_stamp;
+} CcState;
+
+typedef struct {
+    const char *name;
+    void (*init)(CcState *);
+    void (*on_ack)(CcState *, const CcSample *);
+    void (*on_loss)(CcState *, uint64_t now, uint64_t sent_at); // timeout of a packet last sent at sent_at
+} CcOps;
+
+// Newton's method, to avoid pulling in libm for one cube root
+static inline double cc_cbrt(double x) {
+    if(x <= 0) return 0;
+    double r = x > 1 ? x / 3 : 1;
+    for(int i = 0; i < 40; i++) r -= (r * r * r - x) / (3 * r * r);
+    return r;
+}
+
+static inline uint64_t cc_rate(double packets, double gain, uint64_t srtt) {
+    return srtt ? (uint64_t)(gain * packets * MAX_PACKET_SIZE * 1000000.0 / srtt) : 0;
+}
+
+// fixed: the old behaviour, window_size packets in flight and no pacing
+static inline void fixed_init(CcState *s) {
+    memset(s, 0, sizeof(*s));
+    s->cwnd = CC_MAX_CWND;
+}
+
+static inline void fixed_on_ack(CcState *s, const CcSample *a) { (void)s; (void)a; }
+static inline void fixed_on_loss(CcState *s, uint64_t now, uint64_t sent_at) { (void)s; (void)now; (void)sent_at; }
+
+// cubic: RFC 9438 window growth, multiplicative decrease by 0.7 once per
+// window of losses, paced at 2x (slow start) or 1.2x cwnd/srtt like Linux.
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+static inline void cubic_init(CcState *s) {
+    memset(s, 0, sizeof(*s));
+    s->cwnd = CC_INIT_CWND;
+    s->ssthresh = 1e9;
+}
+
+static inline void cubic_on_ack(CcState *s, const CcSample *a) {
+    if(s->cwnd < s->ssthresh) {
+        s->cwnd += 1;
+    } else {
+        if(!s->epoch_start) {
+            s->epoch_start = a->now;
+            s->origin = s->w_max > s->cwnd ? s->w_max : s->cwnd;
+            s->k = cc_cbrt((s->origin - s->cwnd) / CUBIC_C);
+        }
+        double t = (a->now + a->srtt - s->epoch_start) / 1e6 - s->k;
+        double target = s->origin + CUBIC_C * t * t * t;
+        s->cwnd += target > s->cwnd ? (target - s->cwnd) / s->cwnd : 0.01 / s->cwnd;
+    }
+    if(s->cwnd > CC_MAX_CWND) s->cwnd = CC_MAX_CWND;
+    s->pacing_rate = cc_rate(s->cwnd, s->cwnd < s->ssthresh ? 2.0 : 1.2, a->srtt);
+}
+
+static inline void cubic_on_loss(CcState *s, uint64_t now, uint64_t sent_at) {
+    if(sent_at < s->last_cut) return; // sent before the last cut: same loss episode
+    s->last_cut = now;
+    // fast convergence: give up bandwidth faster when w_max keeps shrinking
+    s->w_max = s->cwnd < s->w_max ? s->cwnd * (1 + CUBIC_BETA) / 2 : s->cwnd;
+    s->cwnd *= CUBIC_BETA;
+    if(s->cwnd < CC_MIN_CWND) s->cwnd = CC_MIN_CWND;
+    s->ssthresh = s->cwnd;
+    s->epoch_start = 0;
+}
+
+// bbr: model the path as bottleneck bandwidth (max delivery rate over the
+// last BBR_BW_ROUNDS rounds) times min RTT, pace at gain * bandwidth and
+// cap inflight at a small multiple of that BDP. Loss is not a signal.
+enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT };
+#define BBR_HIGH_GAIN 2.885 // 2/ln(2): doubles the rate every round
+#define BBR_MIN_RTT_WIN_US 10000000ULL
+#define BBR_PROBE_RTT_US 200000ULL
+
+static const double bbr_cycle_gain[8] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+static inline void bbr_init(CcState *s) {
+    memset(s, 0, sizeof(*s));
+    s->cwnd = CC_INIT_CWND;
+    s->mode = BBR_STARTUP;
+}
+
+static inline uint64_t bbr_btl_bw(const CcState *s) {
+    uint64_t bw = 0;
+    for(int i = 0; i < BBR_BW_ROUNDS; i++) if(s->bw[i] > bw) bw = s->bw[i];
+    return bw;
+}
+
+static inline void bbr_on_ack(CcState *s, const CcSample *a) {
+    if(a->rtt && (!s->min_rtt || a->rtt <= s->min_rtt || a->now - s->min_rtt_stamp > BBR_MIN_RTT_WIN_US)) {
+        s->min_rtt = a->rtt;
+        s->min_rtt_stamp = a->now;
+    }
+    if(a->round_start) {
+        s->bw_round = (s->bw_round + 1) % BBR_BW_ROUNDS;
+        s->bw[s->bw_round] = 0;
+    }
+    if(a->delivery_rate > s->bw[s->bw_round]) s->bw[s->bw_round] = a->delivery_rate;
+
+    uint64_t bw = bbr_btl_bw(s);
+    double bdp = s->min_rtt ? (double)bw * s->min_rtt / 1e6 / MAX_PACKET_SIZE : 0;
+
+    switch(s->mode) {
+        case BBR_STARTUP: // until bandwidth stops growing by 25% for three rounds
+            if(!a->round_start) break;
+            if(bw >= s->full_bw * 5 / 4) {
+                s->full_bw = bw;
+                s->full_bw_rounds = 0;
+            } else if(++s->full_bw_rounds >= 3) {
+                s->mode = BBR_DRAIN;
+            }
+            break;
+        case BBR_DRAIN: // until the queue built in startup is gone
+            if(a->in_flight <= bdp) {
+                s->mode = BBR_PROBE_BW;
+                s->cycle = 0;
+                s->mode_stamp = a->now;
+            }
+            break;
+        case BBR_PROBE_BW: // one gain phase per min RTT
+            if(a->now - s->mode_stamp > s->min_rtt) {
+                s->cycle = (s->cycle + 1) % 8;
+                s->mode_stamp = a->now;
+            }
+            if(a->now - s->min_rtt_stamp > BBR_MIN_RTT_WIN_US) {
+                s->mode = BBR_PROBE_RTT;
+                s->mode_stamp = a->now;
+            }
+            break;
+        case BBR_PROBE_RTT: // drain to a few packets so min RTT can be re-measured
+            if(a->now - s->mode_stamp > BBR_PROBE_RTT_US) {
+                s->mode = BBR_PROBE_BW;
+                s->min_rtt_stamp = a->now;
+                s->mode_stamp = a->now;
+            }
+            break;
+    }
+
+    double pacing_gain = s->mode == BBR_STARTUP ? BBR_HIGH_GAIN
+                       : s->mode == BBR_DRAIN ? 1 / BBR_HIGH_GAIN
+                       : s->mode == BBR_PROBE_BW ? bbr_cycle_gain[s->cycle] : 1;
+    double cwnd_gain = s->mode == BBR_PROBE_BW ? 2 : BBR_HIGH_GAIN;
+    if(bw && bdp > 0) {
+        s->cwnd = s->mode == BBR_PROBE_RTT ? CC_MIN_CWND : cwnd_gain * bdp;
+        s->pacing_rate = (uint64_t)(pacing_gain * bw);
+    } else {
+        s->cwnd += 1; // no model yet: grow like slow start
+        s->pacing_rate = cc_rate(s->cwnd, BBR_HIGH_GAIN, a->srtt);
+    }
+    if(s->cwnd < CC_MIN_CWND) s->cwnd = CC_MIN_CWND;
+    if(s->cwnd > CC_MAX_CWND) s->cwnd = CC_MAX_CWND;
+}
+
+static inline void bbr_on_loss(CcState *s, uint64_t now, uint64_t sent_at) { (void)s; (void)now; (void)sent_at; }
+
+static const CcOps cc_algorithms[] = {
+    { "fixed", fixed_init, fixed_on_ack, fixed_on_loss },
+    { "cubic", cubic_init, cubic_on_ack, cubic_on_loss },
+    { "bbr", bbr_init, bbr_on_ack, bbr_on_loss },
+};
+
+// Algorithm by name, or NULL
+static inline const CcOps *cc_find(const char *name) {
+    for(unsigned i = 0; i < sizeof(cc_algorithms) / sizeof(cc_algorithms[0]); i++) {
+        if(strcmp(cc_algorithms[i].name, name) == 0) return &cc_algorithms[i];
+    }
+    return NULL;
+}
+
+// Userspace pacer: a datagram may leave once now >= next_send, and each one
+// pushes next_send out by its serialization time at `rate`.
+typedef struct {
+    uint64_t next_send; // us
+} Pacer;
+
+static inline int pacer_ready(const Pacer *p, uint64_t rate, uint64_t now) {
+    return rate == 0 || p->next_send <= now;
+}
+
+static inline void pacer_sent(Pacer *p, uint64_t rate, uint64_t now, int bytes) {
+    if(rate == 0) return;
+    // credit for idle time is capped, so a sender back from idle can't dump a whole window
+    if(p->next_send + PACING_BURST_US < now) p->next_send = now - PACING_BURST_US;
+    p->next_send += (uint64_t)bytes * 1000000ULL / rate;
+}
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+// Integrity checks. Every datagram carries a CRC32C (Castagnoli) of its
+// header and payload, so a damaged chunk is dropped like a lost one and
+// repaired the same way. At EOT the sender adds an XXH64 digest of the
+// bytes it sent, and the receiver compares it with what is on disk.
+//
+// CRC32C runs on the CPU's CRC instruction where there is one (SSE4.2 on
+// x86, the CRC extension on ARMv8), else slice-by-8 tables. A datagram is
+// only 1 KB, and one 8-byte CRC step per cycle or so is already far faster
+// than the link, so there is no PCLMUL folding for long buffers.
+
+#define CRC32C_POLY 0x82f63b78 // reflected
+
+static uint32_t crc32c_table[8][256];
+
+// Chainable like zlib's crc32: start from 0, feed the previous result back in
+static inline uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t c = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for(; len >= 8; p += 8, len -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][lo >> 8 & 0xff] ^ crc32c_table[5][lo >> 16 & 0xff] ^ crc32c_table[4][lo >> 24] ^
+            crc32c_table[3][hi & 0xff] ^ crc32c_table[2][hi >> 8 & 0xff] ^ crc32c_table[1][hi >> 16 & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+#endif
+    for(; len > 0; p++, len--) c = c >> 8 ^ crc32c_table[0][(c ^ *p) & 0xff];
+    return ~c;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t c = ~crc;
+    for(; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = c;
+    for(; len > 0; p++, len--) c32 = _mm_crc32_u8(c32, *p);
+    return ~c32;
+}
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+__attribute__((target("arch=armv8-a+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t c = ~crc;
+    for(; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+    }
+    for(; len > 0; p++, len--) c = __crc32cb(c, *p);
+    return ~c;
+}
+#endif
+
+typedef uint32_t (*Crc32cFn)(uint32_t, const void *, size_t);
+
+static Crc32cFn crc32c = crc32c_sw;
+
+// Fastest CRC32C this CPU runs; the tables must be built first
+static inline Crc32cFn crc32c_select(const char **name) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) { *name = "sse4.2"; return crc32c_sse42; }
+#elif defined(__aarch64__)
+    if(getauxval(AT_HWCAP) & HWCAP_CRC32) { *name = "armv8"; return crc32c_armv8; }
+#endif
+    *name = "table";
+    return crc32c_sw;
+}
+
+// Runs before main, so no datagram is ever checked against empty tables
+__attribute__((constructor))
+static void crc32c_init(void) {
+    for(int n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for(int k = 0; k < 8; k++) c = c & 1 ? c >> 1 ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][n] = c;
+    }
+    for(int n = 0; n < 256; n++) {
+        for(int k = 1; k < 8; k++) crc32c_table[k][n] = crc32c_table[k - 1][n] >> 8 ^ crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+    }
+    const char *name;
+    crc32c = crc32c_select(&name);
+}
+
+// XXH64 (seed 0), incrementally: four independent 64-bit lanes over
+// 32-byte stripes, so it runs at memory speed without SIMD.
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char tail[32]; // a partial stripe
+    int tail_len;
+} Digest;
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return x << r | x >> (64 - r);
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    return xxh_rotl(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline void xxh_stripe(uint64_t *v, const unsigned char *p) {
+    for(int i = 0; i < 4; i++) v[i] = xxh_round(v[i], xxh_read64(p + 8 * i));
+}
+
+static inline void digest_init(Digest *d) {
+    memset(d, 0, sizeof(*d));
+    d->v[0] = XXH_P1 + XXH_P2;
+    d->v[1] = XXH_P2;
+    d->v[2] = 0;
+    d->v[3] = -XXH_P1;
+}
+
+static inline void digest_update(Digest *d, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    d->total += len;
+    if(d->tail_len) {
+        size_t take = (size_t)(32 - d->tail_len) < len ? (size_t)(32 - d->tail_len) : len;
+        memcpy(d->tail + d->tail_len, p, take);
+        d->tail_len += take;
+        p += take;
+        len -= take;
+        if(d->tail_len < 32) return;
+        xxh_stripe(d->v, d->tail);
+        d->tail_len = 0;
+    }
+    for(; len >= 32; p += 32, len -= 32) xxh_stripe(d->v, p);
+    memcpy(d->tail, p, len);
+    d->tail_len = len;
+}
+
+static inline uint64_t digest_final(const Digest *d) {
+    uint64_t h;
+    if(d->total >= 32) {
+        h = xxh_rotl(d->v[0], 1) + xxh_rotl(d->v[1], 7) + xxh_rotl(d->v[2], 12) + xxh_rotl(d->v[3], 18);
+        for(int i = 0; i < 4; i++) h = (h ^ xxh_round(0, d->v[i])) * XXH_P1 + XXH_P4;
+    } else {
+        h = XXH_P5;
+    }
+    h += d->total;
+    const unsigned char *p = d->tail;
+    int len = d->tail_len;
+    for(; len >= 8; p += 8, len -= 8) h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    if(len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap32(w);
+#endif
+        h = xxh_rotl(h ^ w * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for(; len > 0; p++, len--) h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Digest of length bytes of fd from offset, read in 64 KB blocks.
+// Returns 0 and sets *out, or -1 on a read error or short file.
+static inline int digest_file(int fd, long offset, long length, uint64_t *out) {
+    static __thread unsigned char buf[1 << 16];
+    Digest d;
+    digest_init(&d);
+    while(length > 0) {
+        ssize_t n = pread(fd, buf, length < (long)sizeof(buf) ? length : (long)sizeof(buf), offset);
+        if(n <= 0) return -1;
+        digest_update(&d, buf, n);
+        offset += n;
+        length -= n;
+    }
+    *out = digest_final(&d);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "checksum.h"
+
+// rsync-style matching for delta transfers (sender -d). The receiver signs
+// every whole DELTA_BLOCK-byte block of its old copy (the basis) with a
+// weak rolling checksum and an XXH64; the sender slides a window over its
+// file in one pass, rolling the weak sum a byte at a time, and wherever
+// the weak sum hits an indexed block and the XXH64 agrees, that block is
+// reused and the window jumps past it. The result is a sorted list of
+// runs, target bytes that are basis bytes; everything between is literal.
+
+#define DELTA_BLOCK 2048
+#define DELTA_MAX_BLOCKS (1 << 24) // signatures per basis (its first 32 GB); the sender refuses more
+
+typedef struct {
+    uint32_t weak;
+    uint64_t strong;
+} BlockSig;
+
+// target bytes [target, target + length) equal basis bytes from `basis` on
+typedef struct {
+    long target, basis, length;
+} DeltaRun;
+
+// rsync's weak checksum: a is the byte sum, b the sum of the running a's,
+// both mod 2^16, so the window slides one byte with a few adds
+static inline void delta_weak_init(const unsigned char *p, int len, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0, s2 = 0;
+    for(int i = 0; i < len; i++) {
+        s1 += p[i];
+        s2 += s1;
+    }
+    *a = s1 & 0xffff;
+    *b = s2 & 0xffff;
+}
+
+// drops `out` from the front of a len-byte window and takes `in` at the end
+static inline void delta_weak_roll(uint32_t *a, uint32_t *b, int len, unsigned char out, unsigned char in) {
+    *a = (*a - out + in) & 0xffff;
+    *b = (*b - (uint32_t)len * out + *a) & 0xffff;
+}
+
+static inline uint32_t delta_weak(uint32_t a, uint32_t b) {
+    return a | b << 16;
+}
+
+static inline uint64_t delta_strong(const unsigned char *p, int len) {
+    Digest d;
+    digest_init(&d);
+    digest_update(&d, p, len);
+    return digest_final(&d);
+}
+
+static inline void delta_sign(const unsigned char *p, int len, BlockSig *sig) {
+    uint32_t a, b;
+    delta_weak_init(p, len, &a, &b);
+    sig->weak = delta_weak(a, b);
+    sig->strong = delta_strong(p, len);
+}
+
+// Open-addressed table of (weak sum, block index + 1; 0 is empty) slots,
+// at most half full. Nearly every window the sender tries is a miss, so a
+// filter on the weak sum turns almost all of them away before the table is
+// touched: two bits per block in one 64-bit word, 16 bits per block in
+// all, small enough to stay in cache, about 1% false hits.
+typedef struct {
+    uint32_t weak, block;
+} DeltaSlot;
+
+typedef struct {
+    const BlockSig *sigs;
+    const unsigned char *valid;
+    int n;
+    DeltaSlot *slots;
+    uint32_t mask;
+    uint64_t *filter;
+    uint32_t filter_mask; // in words
+} DeltaIndex;
+
+static inline uint32_t delta_slot(uint32_t weak, uint32_t mask) {
+    return weak * 2654435761U & mask;
+}
+
+static inline uint64_t delta_filter_bits(uint32_t weak, uint32_t *word, uint32_t mask) {
+    uint64_t h = (weak ^ (uint64_t)weak << 29) * 0x9e3779b97f4a7c15ULL;
+    *word = h >> 40 & mask;
+    return 1ULL << (h & 63) | 1ULL << (h >> 6 & 63);
+}
+
+static inline int delta_maybe(const DeltaIndex *ix, uint32_t weak) {
+    uint32_t word;
+    uint64_t bits = delta_filter_bits(weak, &word, ix->filter_mask);
+    return (ix->filter[word] & bits) == bits;
+}
+
+// Indexes the blocks with valid[k] set (NULL: all). Returns 0, or -1 out of memory.
+static inline int delta_index_init(DeltaIndex *ix, const BlockSig *sigs, const unsigned char *valid, int n) {
+    uint32_t size = 16, words = 8;
+    while(size < 2 * (uint32_t)n) size <<= 1;
+    while(words * 4 < (uint32_t)n) words <<= 1;
+    ix->sigs = sigs;
+    ix->valid = valid;
+    ix->n = n;
+    ix->mask = size - 1;
+    ix->filter_mask = words - 1;
+    ix->slots = calloc(size, sizeof(*ix->slots));
+    ix->filter = calloc(words, sizeof(*ix->filter));
+    if(!ix->slots || !ix->filter) {
+        free(ix->slots);
+        free(ix->filter);
+        return -1;
+    }
+    for(int k = 0; k < n; k++) {
+        if(valid && !valid[k]) continue;
+        uint32_t s = delta_slot(sigs[k].weak, ix->mask);
+        while(ix->slots[s].block) s = (s + 1) & ix->mask;
+        ix->slots[s] = (DeltaSlot){ .weak = sigs[k].weak, .block = k + 1 };
+        uint32_t word;
+        uint64_t bits = delta_filter_bits(sigs[k].weak, &word, ix->filter_mask);
+        ix->filter[word] |= bits;
+    }
+    return 0;
+}
+
+static inline void delta_index_free(DeltaIndex *ix) {
+    free(ix->slots);
+    free(ix->filter);
+}
+
+// Block whose sums match the window at p, preferring `prefer` (the one that
+// would extend the previous run); -1 if none. The strong sum is only taken
+// once a weak sum hits.
+static inline long delta_find(const DeltaIndex *ix, uint32_t weak, const unsigned char *p, long prefer) {
+    uint64_t strong = 0;
+    int have_strong = 0;
+    long found = -1;
+    if(!delta_maybe(ix, weak)) return -1;
+    for(uint32_t s = delta_slot(weak, ix->mask); ix->slots[s].block; s = (s + 1) & ix->mask) {
+        if(ix->slots[s].weak != weak) continue;
+        long k = ix->slots[s].block - 1;
+        if(!have_strong) {
+            strong = delta_strong(p, DELTA_BLOCK);
+            have_strong = 1;
+        }
+        if(ix->sigs[k].strong != strong) continue;
+        if(k == prefer) return k;
+        if(found < 0) found = k;
+    }
+    return found;
+}
+
+// Matches n bytes of target against the index in one pass. Returns the
+// number of runs in *runs (malloc'd, caller frees), adjacent matches that
+// continue in the basis merged into one; -1 out of memory.
+static inline int delta_match(const DeltaIndex *ix, const unsigned char *target, long n, DeltaRun **runs) {
+    int n_runs = 0, cap = 64;
+    *runs = malloc(cap * sizeof(**runs));
+    if(!*runs) return -1;
+    long p = 0;
+    uint32_t a = 0, b = 0;
+    int rolling = 0;
+    while(p + DELTA_BLOCK <= n) {
+        DeltaRun *last = n_runs ? &(*runs)[n_runs - 1] : NULL;
+        long prefer = last && last->target + last->length == p ? (last->basis + last->length) / DELTA_BLOCK : -1;
+        // inside a run the next basis block is the likely match: its strong
+        // sum alone settles it, and the weak sum is only needed if not
+        long k = -1;
+        if(prefer >= 0 && prefer < ix->n && (!ix->valid || ix->valid[prefer]) && ix->sigs[prefer].strong == delta_strong(target + p, DELTA_BLOCK)) k = prefer;
+        if(k < 0 && !rolling) {
+            delta_weak_init(target + p, DELTA_BLOCK, &a, &b);
+            rolling = 1;
+        }
+        if(k < 0) k = delta_find(ix, delta_weak(a, b), target + p, prefer);
+        if(k >= 0) {
+            if(k == prefer) {
+                last->length += DELTA_BLOCK;
+            } else {
+                if(n_runs == cap) {
+                    DeltaRun *more = realloc(*runs, 2 * cap * sizeof(**runs));
+                    if(!more) {
+                        free(*runs);
+                        return -1;
+                    }
+                    *runs = more;
+                    cap *= 2;
+                }
+                (*runs)[n_runs++] = (DeltaRun){ .target = p, .basis = k * DELTA_BLOCK, .length = DELTA_BLOCK };
+            }
+            p += DELTA_BLOCK;
+            rolling = 0;
+            continue;
+        }
+        if(p + DELTA_BLOCK == n) break;
+        delta_weak_roll(&a, &b, DELTA_BLOCK, target[p], target[p + DELTA_BLOCK]);
+        p++;
+    }
+    return n_runs;
+}
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "delta.h"
+
+// Benchmark for delta transfers (sender -d) on a large file with 1% of it
+// modified: random data as the receiver's old copy, and a new version with
+// 1 KB patches rewritten in place over 1% of it plus a few insertions and
+// deletions that shift everything after them. Times the receiver signing
+// its copy and the sender's one-pass match, and counts what goes on the
+// wire against a full send: literal chunks, DATA_REF datagrams and the
+// signature upload, at the transfer's own chunk granularity.
+//
+//   gcc -O2 delta_bench.c -o delta_bench
+//   ./delta_bench [size_mb] [modified_percent]
+
+#define CHUNK 1000 // MAX_DATA_SIZE
+#define WIRE_CHUNK 1020 // plus the header
+#define REF_CHUNKS 64 // REF_GROUP
+#define SIGS_PER_DATAGRAM 83 // SIG_PER_PACKET
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void fill_random(unsigned char *p, long n) {
+    for(long i = 0; i < n; i++) p[i] = next_rand();
+}
+
+// new version of old (n bytes) into out (room for n + 64 KB); returns its size
+static long modify(const unsigned char *old, long n, unsigned char *out, double fraction) {
+    memcpy(out, old, n);
+    for(long k = 0; k < (long)(n * fraction / 1024); k++) fill_random(out + next_rand() % (n - 1024), 1024);
+    for(int k = 0; k < 10; k++) {
+        long at = next_rand() % (n - 8192), len = 1 + next_rand() % 3000;
+        if(k % 2) { // insert
+            memmove(out + at + len, out + at, n - at);
+            fill_random(out + at, len);
+            n += len;
+        } else { // delete
+            memmove(out + at, out + at + len, n - at - len);
+            n -= len;
+        }
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    long size = (argc > 1 ? atol(argv[1]) : 256) << 20;
+    double fraction = (argc > 2 ? atof(argv[2]) : 1) / 100;
+    unsigned char *old = malloc(size), *new = malloc(size + (64 << 10));
+    if(!old || !new) {
+        perror("Out of memory");
+        return 1;
+    }
+    fill_random(old, size);
+    long n = modify(old, size, new, fraction);
+
+    // receiver: sign the old copy
+    double t = now_s();
+    int n_sigs = size / DELTA_BLOCK;
+    BlockSig *sigs = malloc(n_sigs * sizeof(*sigs));
+    for(int k = 0; k < n_sigs; k++) delta_sign(old + (long)k * DELTA_BLOCK, DELTA_BLOCK, &sigs[k]);
+    double t_sign = now_s() - t;
+
+    // sender: index and match in one pass
+    t = now_s();
+    DeltaIndex ix;
+    DeltaRun *runs;
+    if(delta_index_init(&ix, sigs, NULL, n_sigs) < 0) {
+        perror("Out of memory");
+        return 1;
+    }
+    int n_runs = delta_match(&ix, new, n, &runs);
+    double t_match = now_s() - t;
+    if(n_runs < 0) {
+        perror("Out of memory");
+        return 1;
+    }
+
+    // chunks wholly inside runs go as references, REF_CHUNKS per datagram at most
+    long reused = 0, ref_chunks = 0, ref_datagrams = 0, segments = 0;
+    for(int r = 0; r < n_runs; r++) reused += runs[r].length;
+    int r = 0, in_group = 0;
+    for(long c = 0; c < n / CHUNK; c++) {
+        long start = c * CHUNK, end = start + CHUNK;
+        while(r < n_runs && runs[r].target + runs[r].length <= start) r++;
+        long pos = start;
+        int used = 0;
+        for(int q = r; q < n_runs && runs[q].target <= pos && pos < end; q++, used++) pos = runs[q].target + runs[q].length;
+        if(pos < end) {
+            in_group = 0;
+            continue;
+        }
+        ref_chunks++;
+        segments += used;
+        if(in_group == 0) ref_datagrams++;
+        in_group = (in_group + 1) % REF_CHUNKS;
+    }
+    long data_chunks = n / CHUNK + 1 - ref_chunks;
+    long sig_datagrams = (n_sigs + SIGS_PER_DATAGRAM - 1) / SIGS_PER_DATAGRAM;
+    long wire = data_chunks * WIRE_CHUNK + ref_datagrams * 20 + segments * 8 + sig_datagrams * WIRE_CHUNK;
+    long full = (n / CHUNK + 1) * WIRE_CHUNK;
+
+    printf("%ld MB basis, %.1f%% modified, %d-byte blocks\n", size >> 20, fraction * 100, DELTA_BLOCK);
+    printf("sign (receiver)    %8.1f ms %8.0f MB/s\n", t_sign * 1e3, size / t_sign / 1e6);
+    printf("match (sender)     %8.1f ms %8.0f MB/s\n", t_match * 1e3, n / t_match / 1e6);
+    printf("reused             %8.2f%% of the new file in %d runs\n", reused * 100.0 / n, n_runs);
+    printf("datagrams          %8ld data + %ld ref + %ld signature, vs %ld\n", data_chunks, ref_datagrams, sig_datagrams, n / CHUNK + 1);
+    printf("wire bytes         %8.2f%% of a full send (%ld vs %ld)\n", wire * 100.0 / full, wire, full);
+    delta_index_free(&ix);
+    free(runs);
+    free(sigs);
+    free(old);
+    free(new);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "evlog.h"
+
+// Decodes the binary event log (evlog.h) the sender and receiver write to
+// udp_logs.bin: the old text lines by default, or CSV with the exact
+// monotonic and wall-clock times in ns, the thread that logged each event
+// and its time since the previous one (same thread) for latency work.
+// seqNum and ackNum come out signed, as Packet has them.
+// Every run appended to the file starts over with its own header.
+//
+//   gcc -O2 evlog_decode.c -o evlog_decode
+//   ./evlog_decode [-c] [udp_logs.bin]
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c] [log]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int csv = 0, opt;
+    while((opt = getopt(argc, argv, "c")) != -1) {
+        switch(opt) {
+            case 'c': csv = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(argc - optind > 1) usage(argv[0]);
+    const char *path = optind < argc ? argv[optind] : "udp_logs.bin";
+    FILE *fp = fopen(path, "rb");
+    if(!fp) {
+        perror("Failed to open log");
+        exit(1);
+    }
+
+    if(csv) printf("run,thread,mono_ns,wall_ns,delta_ns,event,type,seq,ack,len\n");
+    EvlogHeader h;
+    EvlogRecord r;
+    uint64_t last[256];
+    int run = -1;
+    long records = 0;
+    while(fread(&r, sizeof(r.ns), 1, fp) == 1) {
+        // a record or the next run's header: the magic can't be a plausible timestamp
+        if(memcmp(&r.ns, EVLOG_MAGIC, 8) == 0) {
+            memcpy(h.magic, &r.ns, 8);
+            if(fread((char *)&h + 8, sizeof(h) - 8, 1, fp) != 1 || h.record_size != sizeof(EvlogRecord)) {
+                fprintf(stderr, "%s: bad header after %ld records\n", path, records);
+                exit(1);
+            }
+            run++;
+            memset(last, 0, sizeof(last));
+            if(!csv && h.sample > 1) printf("# run %d: every %u events\n", run, h.sample);
+            continue;
+        }
+        if(run < 0 || fread((char *)&r + sizeof(r.ns), sizeof(r) - sizeof(r.ns), 1, fp) != 1) {
+            fprintf(stderr, "%s: truncated or not an event log after %ld records\n", path, records);
+            exit(1);
+        }
+        records++;
+        uint64_t wall = h.real_ns + (r.ns - h.mono_ns);
+        if(csv) {
+            printf("%d,%u,%lu,%lu,%lu,%.*s,%u,%d,%d,%u\n", run, r.thread, (unsigned long)r.ns, (unsigned long)wall,
+                   (unsigned long)(last[r.thread] ? r.ns - last[r.thread] : 0), EVLOG_NAME, r.name, r.type, (int32_t)r.seq, (int32_t)r.ack, r.len);
+            last[r.thread] = r.ns;
+        } else if(r.type == 0 && strncmp(r.name, "EVLOG DROPPED", EVLOG_NAME) == 0) {
+            printf("[%ld] EVLOG DROPPED - %u events, the ring was full\n", (long)(wall / 1000000000ULL), r.seq);
+        } else {
+            printf("[%ld] %.*s - type: %d, seqNum: %d, ackNum: %d, len: %d\n", (long)(wall / 1000000000ULL), EVLOG_NAME, r.name,
+                   r.type, (int32_t)r.seq, (int32_t)r.ack, r.len);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,139 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Small LZ77 codec writing the LZ4 block format, for compressing a few
+// chunks into one datagram (sender -z). Blocks are at most a few KB, so
+// offsets always fit in 16 bits and a 4K-entry hash table of positions is
+// plenty. Greedy matching, no entropy stage: the point is to be cheap
+// enough to run on every chunk, and to give up cheaply on data that
+// doesn't compress.
+//
+// A block is a run of sequences: token (literal count << 4 | match
+// length - 4, 15 meaning more bytes follow, each added until one isn't
+// 255), literals, 2-byte little-endian match offset. The last sequence is
+// literals only, covering at least the final 5 bytes.
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12 // no match may start within this many bytes of the end
+
+static inline uint32_t lz_hash(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v * 2654435761U >> (32 - LZ_HASH_BITS);
+}
+
+// 255-continued length bytes; returns the new output position
+static inline int lz_put_length(unsigned char *out, int op, int len) {
+    for(; len >= 255; len -= 255) out[op++] = 255;
+    out[op++] = len;
+    return op;
+}
+
+// Worst-case output size of a sequence with lit literals and a match of
+// len bytes (0: the final literals-only sequence)
+static inline int lz_sequence_size(int lit, int len) {
+    int size = 1 + lit + (lit >= 15 ? (lit - 15) / 255 + 1 : 0);
+    if(len) size += 2 + (len - LZ_MIN_MATCH >= 15 ? (len - LZ_MIN_MATCH - 15) / 255 + 1 : 0);
+    return size;
+}
+
+// Compresses n (< 64K) bytes into at most cap. Returns the compressed size,
+// or 0 if it doesn't fit; *consumed then tells how far the input got, so a
+// caller can retry with less.
+static inline int lz_compress(const unsigned char *in, int n, unsigned char *out, int cap, int *consumed) {
+    uint16_t table[1 << LZ_HASH_BITS] = {0};
+    int ip = 0, anchor = 0, op = 0;
+    while(ip <= n - LZ_MATCH_LIMIT) {
+        uint32_t h = lz_hash(in + ip);
+        int ref = table[h];
+        table[h] = ip;
+        if(ref >= ip || memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0) {
+            ip += 1 + ((ip - anchor) >> 6); // skip faster through data that isn't matching
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while(ip + len < n - LZ_LAST_LITERALS && in[ref + len] == in[ip + len]) len++;
+
+        int lit = ip - anchor;
+        if(op + lz_sequence_size(lit, len) > cap) {
+            *consumed = anchor;
+            return 0;
+        }
+        unsigned char *token = &out[op++];
+        *token = (lit < 15 ? lit : 15) << 4 | (len - LZ_MIN_MATCH < 15 ? len - LZ_MIN_MATCH : 15);
+        if(lit >= 15) op = lz_put_length(out, op, lit - 15);
+        memcpy(out + op, in + anchor, lit);
+        op += lit;
+        out[op++] = (ip - ref) & 0xff;
+        out[op++] = (ip - ref) >> 8;
+        if(len - LZ_MIN_MATCH >= 15) op = lz_put_length(out, op, len - LZ_MIN_MATCH - 15);
+        ip += len;
+        anchor = ip;
+        if(ip <= n - LZ_MATCH_LIMIT) table[lz_hash(in + ip - 2)] = ip - 2; // helps the next match start
+    }
+    int lit = n - anchor;
+    if(op + lz_sequence_size(lit, 0) > cap) {
+        *consumed = anchor;
+        return 0;
+    }
+    out[op++] = (lit < 15 ? lit : 15) << 4;
+    if(lit >= 15) op = lz_put_length(out, op, lit - 15);
+    memcpy(out + op, in + anchor, lit);
+    *consumed = n;
+    return op + lit;
+}
+
+// 255-continued length bytes from in[*ip]; -1 if the input runs out
+static inline int lz_get_length(const unsigned char *in, int n, int *ip) {
+    int len = 0, b;
+    do {
+        if(*ip >= n) return -1;
+        b = in[(*ip)++];
+        len += b;
+    } while(b == 255);
+    return len;
+}
+
+// Returns the decompressed size, or -1 if the block is malformed or would
+// exceed cap. Safe on any input.
+static inline int lz_decompress(const unsigned char *in, int n, unsigned char *out, int cap) {
+    int ip = 0, op = 0;
+    while(ip < n) {
+        int token = in[ip++];
+        int lit = token >> 4, len = (token & 15) + LZ_MIN_MATCH;
+        if(lit == 15) {
+            int more = lz_get_length(in, n, &ip);
+            if(more < 0) return -1;
+            lit += more;
+        }
+        if(lit > n - ip || lit > cap - op) return -1;
+        memcpy(out + op, in + ip, lit);
+        ip += lit;
+        op += lit;
+        if(ip == n) return op; // literals-only: the last sequence
+
+        if(n - ip < 2) return -1;
+        int off = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        if(len == 15 + LZ_MIN_MATCH) {
+            int more = lz_get_length(in, n, &ip);
+            if(more < 0) return -1;
+            len += more;
+        }
+        if(off == 0 || off > op || len > cap - op) return -1;
+        if(off >= len) {
+            memcpy(out + op, out + op - off, len);
+        } else {
+            for(int i = 0; i < len; i++) out[op + i] = out[op - off + i]; // overlapping: repeats the last off bytes
+        }
+        op += len;
+    }
+    return -1; // ended on a match: the last sequence has to be literals
+}
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "timer.h"
+
+// Live metrics (-M path). The flows bump counters with relaxed atomics and
+// store their gauges in their own slot; a writer thread rewrites path every
+// METRICS_INTERVAL_US as Prometheus text, or JSON if it ends in ".json",
+// through a temp file renamed over it so a reader never sees half of one.
+// Socket drops are the kernel's count for the watched ports, from
+// /proc/net/udp. RTTs go into a log-linear histogram: 8 buckets per power
+// of two of us, so percentiles are good to within 1/8.
+//
+// The progress bar is redrawn at most every PROGRESS_INTERVAL_US, and
+// when it reaches 100%, however often the flows report.
+
+#define METRICS_INTERVAL_US 1000000
+#define PROGRESS_INTERVAL_US 200000
+#define METRICS_FLOWS 16
+#define RTT_BUCKETS 240 // up to 2^32 us
+
+typedef struct {
+    uint64_t bytes; // goodput: acked (sender), new data on disk (receiver)
+    uint64_t packets, retransmits, timeouts; // data sent fresh, sent again, RTOs that fired
+    uint64_t duplicates; // ACKs for acked packets (sender), chunks already here (receiver)
+    uint64_t acks, bad; // ACKs/NACKs sent (receiver); datagrams failing the header or CRC check
+    uint64_t rtt[RTT_BUCKETS], rtt_count, rtt_sum;
+    struct {
+        int port, active;
+        double cwnd;
+        uint64_t in_flight, srtt, rto, pacing_rate;
+    } flow[METRICS_FLOWS];
+} Metrics;
+
+static Metrics metrics;
+static const char *metrics_path, *metrics_role;
+static uint64_t metrics_started, progress_drawn;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER; // the writer thread against the final write at exit
+
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline int rtt_bucket(uint64_t us) {
+    if(us >= 1ULL << 32) us = (1ULL << 32) - 1;
+    if(us < 8) return us;
+    int msb = 63 - __builtin_clzll(us);
+    return (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+}
+
+// lowest RTT in bucket i
+static inline uint64_t rtt_bucket_floor(int i) {
+    return i < 8 ? (uint64_t)i : (uint64_t)(8 + i % 8) << (i / 8 - 1);
+}
+
+static inline void metrics_rtt(uint64_t us) {
+    metrics_add(&metrics.rtt[rtt_bucket(us)], 1);
+    metrics_add(&metrics.rtt_count, 1);
+    metrics_add(&metrics.rtt_sum, us);
+}
+
+// The RTT below which a fraction q of the samples fall: its bucket's midpoint
+static inline uint64_t metrics_rtt_quantile(const uint64_t *hist, uint64_t count, double q) {
+    uint64_t seen = 0, want = count * q;
+    for(int i = 0; i < RTT_BUCKETS; i++) {
+        seen += hist[i];
+        if(seen > want) return (rtt_bucket_floor(i) + rtt_bucket_floor(i + 1)) / 2;
+    }
+    return 0;
+}
+
+// Kernel drops for a local UDP port, summed over its sockets
+static inline uint64_t socket_drops(int port) {
+    FILE *fp = fopen("/proc/net/udp", "r");
+    if(!fp) return 0;
+    char line[512];
+    uint64_t drops = 0;
+    unsigned local_port;
+    unsigned long d;
+    while(fgets(line, sizeof(line), fp)) {
+        // sl local_address rem_address st tx:rx tr:when retrnsmt uid timeout inode ref pointer drops
+        if(sscanf(line, " %*d: %*x:%x %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %lu", &local_port, &d) == 2 && (int)local_port == port) drops += d;
+    }
+    fclose(fp);
+    return drops;
+}
+
+static void metrics_write(void) {
+    static Metrics m;
+    pthread_mutex_lock(&metrics_lock);
+    memcpy(&m, &metrics, sizeof(m)); // torn across fields at worst, each field is whole
+    double secs = (now_us() - metrics_started) / 1e6;
+    uint64_t drops = 0;
+    for(int i = 0; i < METRICS_FLOWS; i++) if(m.flow[i].port) drops += socket_drops(m.flow[i].port);
+    uint64_t p50 = metrics_rtt_quantile(m.rtt, m.rtt_count, 0.5), p90 = metrics_rtt_quantile(m.rtt, m.rtt_count, 0.9),
+             p99 = metrics_rtt_quantile(m.rtt, m.rtt_count, 0.99);
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+    FILE *fp = fopen(tmp, "w");
+    if(!fp) {
+        pthread_mutex_unlock(&metrics_lock);
+        return;
+    }
+    const char *r = metrics_role;
+    size_t len = strlen(metrics_path);
+    if(len > 5 && strcmp(metrics_path + len - 5, ".json") == 0) {
+        fprintf(fp, "{\"role\":\"%s\",\"uptime_s\":%.3f,\"bytes\":%lu,\"goodput_mbit\":%.3f,\"packets\":%lu,\"retransmits\":%lu,"
+                "\"timeouts\":%lu,\"duplicates\":%lu,\"acks\":%lu,\"bad\":%lu,\"socket_drops\":%lu,"
+                "\"rtt_us\":{\"count\":%lu,\"mean\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu},\"flows\":[",
+                r, secs, m.bytes, secs > 0 ? m.bytes * 8 / secs / 1e6 : 0.0, m.packets, m.retransmits, m.timeouts, m.duplicates,
+                m.acks, m.bad, drops, m.rtt_count, m.rtt_count ? m.rtt_sum / m.rtt_count : 0, p50, p90, p99);
+        for(int i = 0, first = 1; i < METRICS_FLOWS; i++) {
+            if(!m.flow[i].active) continue;
+            fprintf(fp, "%s{\"flow\":%d,\"cwnd\":%.1f,\"in_flight\":%lu,\"srtt_us\":%lu,\"rto_us\":%lu,\"pacing_rate\":%lu}", first ? "" : ",",
+                    i, m.flow[i].cwnd, m.flow[i].in_flight, m.flow[i].srtt, m.flow[i].rto, m.flow[i].pacing_rate);
+            first = 0;
+        }
+        fprintf(fp, "]}\n");
+    } else {
+        fprintf(fp, "# TYPE %s_bytes_total counter\n%s_bytes_total %lu\n", r, r, m.bytes);
+        fprintf(fp, "# TYPE %s_goodput_mbit gauge\n%s_goodput_mbit %.3f\n", r, r, secs > 0 ? m.bytes * 8 / secs / 1e6 : 0.0);
+        fprintf(fp, "# TYPE %s_packets_total counter\n%s_packets_total %lu\n", r, r, m.packets);
+        fprintf(fp, "# TYPE %s_retransmits_total counter\n%s_retransmits_total %lu\n", r, r, m.retransmits);
+        fprintf(fp, "# TYPE %s_timeouts_total counter\n%s_timeouts_total %lu\n", r, r, m.timeouts);
+        fprintf(fp, "# TYPE %s_duplicates_total counter\n%s_duplicates_total %lu\n", r, r, m.duplicates);
+        fprintf(fp, "# TYPE %s_acks_total counter\n%s_acks_total %lu\n", r, r, m.acks);
+        fprintf(fp, "# TYPE %s_bad_total counter\n%s_bad_total %lu\n", r, r, m.bad);
+        fprintf(fp, "# TYPE %s_socket_drops_total counter\n%s_socket_drops_total %lu\n", r, r, drops);
+        fprintf(fp, "# TYPE %s_rtt_us summary\n%s_rtt_us{quantile=\"0.5\"} %lu\n%s_rtt_us{quantile=\"0.9\"} %lu\n%s_rtt_us{quantile=\"0.99\"} %lu\n"
+                "%s_rtt_us_sum %lu\n%s_rtt_us_count %lu\n", r, r, p50, r, p90, r, p99, r, m.rtt_sum, r, m.rtt_count);
+        const char *gauges[] = { "cwnd", "in_flight", "srtt_us", "rto_us", "pacing_rate" };
+        for(int g = 0; g < 5; g++) {
+            fprintf(fp, "# TYPE %s_%s gauge\n", r, gauges[g]);
+            for(int i = 0; i < METRICS_FLOWS; i++) {
+                if(!m.flow[i].active) continue;
+                double v[] = { m.flow[i].cwnd, m.flow[i].in_flight, m.flow[i].srtt, m.flow[i].rto, m.flow[i].pacing_rate };
+                fprintf(fp, "%s_%s{flow=\"%d\"} %.1f\n", r, gauges[g], i, v[g]);
+            }
+        }
+    }
+    if(fclose(fp) == 0) rename(tmp, metrics_path);
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void *metrics_main(void *arg) {
+    (void)arg;
+    while(1) {
+        usleep(METRICS_INTERVAL_US);
+        metrics_write();
+    }
+    return NULL;
+}
+
+static void metrics_final(void) {
+    metrics_write();
+}
+
+// role prefixes every metric ("sender", "receiver"). Returns 0, or -1 if
+// the writer thread can't start. The file is written once more at exit.
+static inline int metrics_start(const char *path, const char *role) {
+    metrics_started = now_us();
+    if(!path) return 0;
+    metrics_path = path;
+    metrics_role = role;
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, metrics_main, NULL) != 0) return -1;
+    pthread_detach(thread);
+    atexit(metrics_final);
+    return 0;
+}
+
+// A flow's socket, for its drops
+static inline void metrics_watch_port(int flow, int port) {
+    if(flow < METRICS_FLOWS) metrics.flow[flow].port = port;
+}
+
+// Whether the progress bar is due for a redraw: at 100%, or
+// PROGRESS_INTERVAL_US after the last one. Flows race for it.
+static inline int progress_due(long done, long total) {
+    uint64_t now = now_us(), last = __atomic_load_n(&progress_drawn, __ATOMIC_RELAXED);
+    if(done != total && now - last < PROGRESS_INTERVAL_US) return 0;
+    return __atomic_compare_exchange_n(&progress_drawn, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) || done == total;
+}
+
+#endif
@@ -1,19 +1,353 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "checksum.h"
+
 #define MAX_DATA_SIZE 1000 // why 1000, not 1024? To avoid fragmentation issues.
+#define MAX_WINDOW 256 // sender window slots; also caps the receive batch
+#define DEFAULT_WINDOW 32
+#define DEFAULT_BATCH 32 // datagrams per sendmmsg/recvmmsg
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024) // room for a full window; capped by rmem_max
+
+#define FIRST_DATA_SEQ 1 // 0 is the INIT
 
 // types
 #define TYPE_DATA 1
 #define TYPE_ACK 2
 #define TYPE_EOT 3
+#define TYPE_NACK 4 // NACK mode: holes the receiver still wants, see nack_put_range
+#define TYPE_DATA_LZ 5 // DATA compressed with lz.h (sender -z), see below
+#define TYPE_RESUME 6 // chunks the receiver kept from an earlier attempt, see below
+#define TYPE_DATA_REF 7 // delta mode (sender -d): chunks to copy from the receiver's old copy, see below
+#define TYPE_SIG 8 // delta mode: block signatures of the receiver's old copy, see below
+#define TYPE_INIT 9 // opens a flow: modes, byte range and name in one frame, see below
+#define TYPE_ACCEPT 10 // the receiver's answer to INIT
+
+// A TYPE_DATA_LZ payload inflates to ackNum bytes: up to LZ_GROUP whole
+// consecutive chunks from seqNum on, the last one short only at the end of
+// the range. The sender packs as many as compress into one datagram and
+// never uses the seqNums of the chunks after the first. The final empty
+// chunk always goes as plain DATA.
+#define LZ_GROUP 8
+
+// A TYPE_DATA_REF payload stands for ackNum bytes, REF_GROUP whole chunks
+// at most, from seqNum on, to be copied from the receiver's old copy of
+// the file (the basis): a list of (basis offset, length) segments,
+// big-endian, that fill them in order. Like a compressed group, the
+// seqNums after the first go unused.
+#define REF_GROUP 64
+#define REF_MAX_SEGMENTS (MAX_DATA_SIZE / 12)
 
 typedef struct {
     int type;
     int seqNum;
     int ackNum;
     int length;
+    uint32_t session; // picked by the sender, echoed in every ACK
     char data[MAX_DATA_SIZE];
 } Packet;
 
+// Wire format (version 3), all fields big-endian, no padding:
+//   [0] version [1] type [2..3] length [4..7] seqNum [8..11] ackNum [12..15] session [16..19] crc
+// followed by exactly `length` bytes of payload. An ACK is just the header.
+// The session ID lets one receiver tell concurrent transfers apart. crc is
+// the CRC32C of bytes 0..15 and the payload; a datagram that fails it is
+// dropped on arrival, so the usual loss repair resends it.
+//
+// seqNum and ackNum carry the low 32 bits of 64-bit sequence numbers, so
+// past 2^32 chunks (4 TB per flow) they wrap. Both ends recover the full
+// number with seq_unwrap against one they know is near: the sender's
+// window base, the receiver's lowest missing chunk.
+#define PROTO_VERSION 3
+#define HEADER_SIZE 20
+#define MAX_PACKET_SIZE (HEADER_SIZE + MAX_DATA_SIZE)
+
+static inline uint32_t packet_crc(const unsigned char *buf, int length) {
+    return crc32c(crc32c(0, buf, 16), buf + HEADER_SIZE, length);
+}
+
+// Stamps the crc of an encoded datagram, once its payload is in place
+static inline void seal_packet(unsigned char *buf, int length) {
+    uint32_t crc = htonl(packet_crc(buf, length));
+    memcpy(buf + 16, &crc, 4);
+}
+
+// Writes the header for pkt into buf; the payload is expected at buf +
+// HEADER_SIZE, and seal_packet has to run once it is there.
+static inline void encode_header(const Packet *pkt, unsigned char *buf) {
+    uint16_t length = htons((uint16_t)pkt->length);
+    uint32_t seq = htonl((uint32_t)pkt->seqNum);
+    uint32_t ack = htonl((uint32_t)pkt->ackNum);
+    uint32_t session = htonl(pkt->session);
+
+    buf[0] = PROTO_VERSION;
+    buf[1] = (unsigned char)pkt->type;
+    memcpy(buf + 2, &length, 2);
+    memcpy(buf + 4, &seq, 4);
+    memcpy(buf + 8, &ack, 4);
+    memcpy(buf + 12, &session, 4);
+}
+
+// Serializes pkt into buf (at least HEADER_SIZE + pkt->length bytes). Returns the wire size.
+static inline int encode_packet(const Packet *pkt, unsigned char *buf) {
+    encode_header(pkt, buf);
+    memcpy(buf + HEADER_SIZE, pkt->data, pkt->length);
+    seal_packet(buf, pkt->length);
+    return HEADER_SIZE + pkt->length;
+}
+
+// The sequence number whose low 32 bits are wire, closest to ref
+static inline long seq_unwrap(int wire, long ref) {
+    return ref + (int32_t)((uint32_t)wire - (uint32_t)ref);
+}
+
+// Parses and validates the header of an n-byte datagram and checks its crc
+// without copying the payload, which stays at buf + HEADER_SIZE. Returns 0,
+// or -1 for a short, truncated, corrupt or foreign datagram.
+static inline int decode_header(const unsigned char *buf, int n, Packet *pkt) {
+    uint16_t length;
+    uint32_t seq, ack, session, crc;
+
+    if(n < HEADER_SIZE || buf[0] != PROTO_VERSION) return -1;
+    memcpy(&length, buf + 2, 2);
+    memcpy(&seq, buf + 4, 4);
+    memcpy(&ack, buf + 8, 4);
+    memcpy(&session, buf + 12, 4);
+    memcpy(&crc, buf + 16, 4);
+
+    pkt->type = buf[1];
+    pkt->length = ntohs(length);
+    pkt->seqNum = (int)ntohl(seq);
+    pkt->ackNum = (int)ntohl(ack);
+    pkt->session = ntohl(session);
+    if(pkt->length > MAX_DATA_SIZE || HEADER_SIZE + pkt->length > n) return -1;
+    return ntohl(crc) == packet_crc(buf, pkt->length) ? 0 : -1;
+}
+
+// decode_header plus a copy of the payload, NUL-terminated when there is
+// room so string payloads work with strcmp. Returns 0 or -1.
+static inline int decode_packet(const unsigned char *buf, int n, Packet *pkt) {
+    if(decode_header(buf, n, pkt) < 0) return -1;
+    memcpy(pkt->data, buf + HEADER_SIZE, pkt->length);
+    if(pkt->length < MAX_DATA_SIZE) pkt->data[pkt->length] = '\0';
+    return 0;
+}
+
+static inline void put_u64(char *buf, uint64_t v) {
+    uint32_t h[2] = { htonl(v >> 32), htonl((uint32_t)v) };
+    memcpy(buf, h, 8);
+}
+
+static inline uint64_t get_u64(const char *buf) {
+    uint32_t h[2];
+    memcpy(h, buf, 8);
+    return (uint64_t)ntohl(h[0]) << 32 | ntohl(h[1]);
+}
+
+// Byte range of an INIT, big-endian: the file size, the byte range
+// of the file this flow carries (offset, length; the whole file for a
+// single flow), and the file's mtime in ns. seqNums count chunks from the
+// start of the range. Size and mtime tell the receiver whether a partial
+// copy it kept belongs to this file.
+//
+// A stream (sender input from a pipe) has no size until it ends: f_size
+// and length are STREAM_SIZE, the offset 0, and its EOT gives the length.
+typedef struct {
+    uint64_t f_size;
+    uint64_t offset, length;
+    uint64_t mtime;
+} FileRange;
+
+#define RANGE_SIZE 32
+#define STREAM_SIZE UINT64_MAX
+
+// Fills buf (at least RANGE_SIZE bytes) and returns the payload length.
+static inline int encode_range(const FileRange *r, char *buf) {
+    put_u64(buf, r->f_size);
+    put_u64(buf + 8, r->offset);
+    put_u64(buf + 16, r->length);
+    put_u64(buf + 24, r->mtime);
+    return RANGE_SIZE;
+}
+
+// Returns 0, or -1 if the payload is malformed or the range leaves the file.
+static inline int decode_range(const char *buf, int len, FileRange *r) {
+    if(len != RANGE_SIZE) return -1;
+    r->f_size = get_u64(buf);
+    r->offset = get_u64(buf + 8);
+    r->length = get_u64(buf + 16);
+    r->mtime = get_u64(buf + 24);
+    if(r->f_size == STREAM_SIZE) return r->offset == 0 && r->length == STREAM_SIZE ? 0 : -1;
+    return r->f_size > INT64_MAX || r->offset > r->f_size || r->length > r->f_size - r->offset ? -1 : 0;
+}
+
+// TYPE_INIT (seqNum 0) payload: mode flags (4 bytes, big-endian), the
+// FileRange, then the name, all the setup a flow needs in one frame. The
+// sender resends it with backoff until the ACCEPT for its session comes
+// back (an ACK of its data will do too), and the receiver answers every
+// copy. An ACCEPT with a payload refuses the flow, the payload saying why.
+#define INIT_NACK 1 // sender -m nack
+#define INIT_DELTA 2 // sender -d
+#define INIT_TREE 4 // a directory, see tree.h
+#define INIT_STREAM 8 // piped input, length at EOT
+#define INIT_HEADER (4 + RANGE_SIZE)
+
+// Returns -1 if the name doesn't fit
+static inline int encode_init(uint32_t flags, const FileRange *r, const char *name, Packet *pkt) {
+    size_t n = strlen(name);
+    uint32_t f = htonl(flags);
+    if(n == 0 || n > MAX_DATA_SIZE - INIT_HEADER) return -1;
+    memcpy(pkt->data, &f, 4);
+    encode_range(r, pkt->data + 4);
+    memcpy(pkt->data + INIT_HEADER, name, n);
+    pkt->length = INIT_HEADER + n;
+    return 0;
+}
+
+// name needs MAX_DATA_SIZE - INIT_HEADER + 1 bytes. Returns 0, or -1 if
+// the payload is malformed.
+static inline int decode_init(const char *buf, int len, uint32_t *flags, FileRange *r, char *name) {
+    uint32_t f;
+    int n = len - INIT_HEADER;
+    if(n <= 0 || decode_range(buf + 4, RANGE_SIZE, r) < 0 || memchr(buf + INIT_HEADER, '\0', n)) return -1;
+    memcpy(&f, buf, 4);
+    *flags = ntohl(f);
+    memcpy(name, buf + INIT_HEADER, n);
+    name[n] = '\0';
+    return 0;
+}
+
+// EOT payload: XXH64 digest of the flow's byte range and its length,
+// big-endian, for the receiver to check against what it wrote. A stream's
+// length is only known here. Once the data is all in, the receiver
+// answers with an empty EOT if its copy checks out, or refuses it with an
+// ACCEPT carrying the reason; the sender repeats EOT until it hears either.
+// It repeats at least every EOT_REPEAT_US, and the receiver keeps answering
+// until it has heard nothing for EOT_LINGER_US, so it is still there for
+// the repeat when its answer gets lost.
+#define EOT_REPEAT_US 200000
+#define EOT_LINGER_US (5 * EOT_REPEAT_US)
+#define EOT_SIZE 16
+
+static inline int encode_eot(uint64_t digest, uint64_t length, char *buf) {
+    put_u64(buf, digest);
+    put_u64(buf + 8, length);
+    return EOT_SIZE;
+}
+
+// Returns 0, or -1 if the payload is not an EOT's
+static inline int decode_eot(const char *buf, int len, uint64_t *digest, uint64_t *length) {
+    if(len != EOT_SIZE) return -1;
+    *digest = get_u64(buf);
+    *length = get_u64(buf + 8);
+    return *length > INT64_MAX ? -1 : 0;
+}
+
+// NACK payload: up to NACK_MAX_RANGES inclusive [first, last] seqNum
+// pairs, big-endian, wrapping like the header's. The header's ackNum is
+// the first seqNum not yet received (past the last chunk: transfer
+// complete), seqNum the highest received.
+#define NACK_MAX_RANGES (MAX_DATA_SIZE / 8)
+
+// A TYPE_RESUME payload is the same list of ranges, of whole chunks the
+// receiver already has on disk; the sender skips them. It goes right after
+// setup, again if skipped chunks keep arriving, and is only a hint: a lost
+// one just means those chunks are sent once more. It never reaches past
+// seqNum 2^31, so the values need no unwrapping.
+
+// Appends a range; returns -1 if the packet is full
+static inline int nack_put_range(Packet *pkt, int first, int last) {
+    if(pkt->length + 8 > MAX_DATA_SIZE) return -1;
+    uint32_t r[2] = { htonl((uint32_t)first), htonl((uint32_t)last) };
+    memcpy(pkt->data + pkt->length, r, 8);
+    pkt->length += 8;
+    return 0;
+}
+
+static inline void nack_get_range(const unsigned char *payload, int i, int *first, int *last) {
+    uint32_t r[2];
+    memcpy(r, payload + i * 8, 8);
+    *first = (int)ntohl(r[0]);
+    *last = (int)ntohl(r[1]);
+}
+
+// Appends a segment (8-byte basis offset, 4-byte length) to a DATA_REF
+// payload; returns -1 if the packet is full
+static inline int ref_put_segment(Packet *pkt, uint64_t offset, uint32_t length) {
+    if(pkt->length + 12 > MAX_DATA_SIZE) return -1;
+    uint32_t l = htonl(length);
+    put_u64(pkt->data + pkt->length, offset);
+    memcpy(pkt->data + pkt->length + 8, &l, 4);
+    pkt->length += 12;
+    return 0;
+}
+
+static inline void ref_get_segment(const unsigned char *payload, int i, uint64_t *offset, uint32_t *length) {
+    uint32_t l;
+    *offset = get_u64((const char *)payload + i * 12);
+    memcpy(&l, payload + i * 12 + 8, 4);
+    *length = ntohl(l);
+}
+
+// TYPE_SIG payload: the block size, then up to SIG_PER_PACKET (weak,
+// strong) signatures of consecutive whole blocks of the basis, starting
+// with block seqNum, big-endian. ackNum is the total number of blocks, 0
+// when there is no basis. Like RESUME it is only a hint: a block whose
+// signature got lost is simply never matched.
+#define SIG_PER_PACKET ((MAX_DATA_SIZE - 4) / 12)
+
+// Signature i of the payload
+static inline void sig_put(char *payload, int i, uint32_t weak, uint64_t strong) {
+    uint32_t f[3] = { htonl(weak), htonl(strong >> 32), htonl((uint32_t)strong) };
+    memcpy(payload + 4 + i * 12, f, 12);
+}
+
+static inline void sig_get(const unsigned char *payload, int i, uint32_t *weak, uint64_t *strong) {
+    uint32_t f[3];
+    memcpy(f, payload + 4 + i * 12, 12);
+    *weak = ntohl(f[0]);
+    *strong = (uint64_t)ntohl(f[1]) << 32 | ntohl(f[2]);
+}
+
+// sendto() of the encoded packet; only HEADER_SIZE + length bytes go on the wire.
+static inline ssize_t send_packet(int sockfd, const Packet *pkt, const struct sockaddr_in *addr, socklen_t addrlen) {
+    unsigned char buf[MAX_PACKET_SIZE];
+    int n = encode_packet(pkt, buf);
+    return sendto(sockfd, buf, n, 0, (const struct sockaddr *)addr, addrlen);
+}
+
+// sendmmsg() until all n messages are out (needs _GNU_SOURCE). Returns how
+// many were sent, or -1 if nothing could be sent.
+static inline int send_batch(int sockfd, struct mmsghdr *msgs, int n) {
+    int done = 0;
+    while(done < n) {
+        int r = sendmmsg(sockfd, msgs + done, n - done, 0);
+        if(r < 0) {
+            if(errno == EINTR) continue;
+            return done ? done : -1;
+        }
+        done += r;
+    }
+    return done;
+}
+
+// recvfrom() + decode. Returns the datagram size, or -1 with errno set
+// (EBADMSG if the datagram didn't decode).
+static inline ssize_t recv_packet(int sockfd, Packet *pkt, struct sockaddr_in *addr, socklen_t *addrlen) {
+    unsigned char buf[MAX_PACKET_SIZE];
+    ssize_t n = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)addr, addrlen);
+    if(n < 0) return -1;
+    if(decode_packet(buf, n, pkt) < 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return n;
+}
+
 #endif
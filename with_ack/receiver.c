@@ -1,18 +1,141 @@
+#define _GNU_SOURCE // recvmmsg/sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
 #include "packet.h"
+#include "timer.h"
+#include "uring.h"
+#include "lz.h"
+#include "delta.h"
+#include "tree.h"
+#include "evlog.h"
+#include "metrics.h"
 
-FILE *log_fp;
+// uring engine: fixed file indices and user_data op kinds
+enum { FILE_SOCK, FILE_OUTPUT };
+enum { OP_RECV, OP_WRITE, OP_SEND };
 
-void print_progress_bar(int received_bytes, int total_bytes) {
+#define MAX_STREAMS 16
+#define NACK_INTERVAL_US 10000 // NACK mode: report holes this often
+#define CHECKPOINT_US 500000 // rewrite recv_<name>.part this often while data comes in
+#define RESUME_REPEAT_US 100000 // resend the RESUME list at most this often
+#define RESUME_MAX_PACKETS 64 // a more scattered map than this just gets some chunks twice
+#define SIG_REPEAT_US 100000 // delta mode: resend the signatures at most this often
+
+// With -n, one thread per flow of a parallel transfer, each on its own
+// port (receiver_port + i) with its own session. Flows carry disjoint byte
+// ranges of the same file and all write through one shared descriptor.
+typedef struct {
+    pthread_t thread;
+    int index, port;
+} Flow;
+
+int log_sample = 1; // -l: keep every nth event in udp_logs.bin, 0 for none
+const char *metrics_file; // -M
+int batch = DEFAULT_BATCH, want_uring;
+float drop_prob;
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+int output_fd = -1; // opened by whichever flow gets its setup done first
+char output_name[128];
+int corrupt; // some flow's range failed its digest check
+long f_size, received_all; // whole file, across flows; f_size is -1 for a stream
+int streaming; // sender input from a pipe: its length comes with EOT
+
+// Resume checkpoint: recv_<name>.part, next to the output, says which whole
+// chunks of the file are on disk and which file they came from (size and
+// mtime from the INIT). It is rewritten every CHECKPOINT_US while
+// data comes in and removed once the output is complete, so after a crash
+// or kill the next transfer of the same file keeps the output, marks those
+// chunks received and sends the sender a TYPE_RESUME list to skip.
+typedef struct {
+    char magic[8];
+    uint64_t f_size, mtime;
+    uint32_t crc; // CRC32C of the fields above and the bitmap
+} Checkpoint;
+
+#define CHECKPOINT_MAGIC "UDPRSM01"
+
+char part_name[136];
+int part_fd = -1;
+uint64_t f_mtime;
+unsigned char *file_map, *file_map_copy; // one bit per whole chunk of the file; the copy is what gets written
+long file_chunks; // f_size / MAX_DATA_SIZE
+pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t checkpoint_at;
+
+// Delta mode (sender -d): the existing recv_<name> is moved aside to
+// recv_<name>.basis, signed block by block for the sender, and DATA_REF
+// chunks are copied out of it. It is removed once the new copy checks
+// out, and put back if it doesn't.
+char basis_name[136];
+int basis_fd = -1;
+long basis_size;
+BlockSig *basis_sigs;
+int n_sigs;
+
+// Directory transfers (INIT_TREE): recv_<name> is a directory
+// and the stream is tree.h's manifest followed by the files. Nothing past
+// the manifest can be placed until all of it is in, so such chunks go
+// unacked and come again; flows whose range starts past it wait for it
+// before reading anything, and their first window waits in the socket
+// buffer instead. No checkpoint, no basis.
+int tree_mode;
+Tree tree;
+unsigned char *manifest_map; // one bit per manifest chunk
+int manifest_chunks, manifest_have, tree_ready;
+pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tree_cond = PTHREAD_COND_INITIALIZER;
+__thread TreeCursor cursor = { -1, -1 };
+
+// Chunks are written at their file offset as they arrive, in any order;
+// this bitmap (one bit per MAX_DATA_SIZE chunk of the flow's range) is all that tracks them.
+__thread unsigned char *chunk_map;
+__thread long n_chunks; // including the final short (possibly empty) one; a stream's map grows
+__thread long first_missing; // lowest chunk not yet received, to unwrap seqNums against
+__thread uint64_t eot_digest, eot_length; // sender's digest of the range and its length, from EOT
+__thread int have_digest;
+__thread long chunk_base = -1; // file chunk of the range's first chunk; -1 if the range isn't chunk-aligned
+__thread long full_chunks; // whole chunks in the range
+__thread int resumed; // chunks were kept from an earlier attempt
+__thread uint64_t resume_at;
+__thread uint64_t sigs_at;
+
+// batched receive of data and send of ACKs, one slot per datagram
+__thread unsigned char rx_buf[MAX_WINDOW][MAX_PACKET_SIZE];
+__thread struct sockaddr_in rx_addr[MAX_WINDOW];
+__thread struct iovec rx_iov[MAX_WINDOW];
+__thread struct mmsghdr rx_msgs[MAX_WINDOW];
+__thread unsigned char ack_buf[MAX_WINDOW][HEADER_SIZE];
+__thread struct iovec ack_iov[MAX_WINDOW];
+__thread struct mmsghdr ack_msgs[MAX_WINDOW];
+__thread unsigned char lz_out[LZ_GROUP * MAX_DATA_SIZE]; // sync engine: one inflated payload
+
+// uring engine: ops still using rx_buf[i]/ack_buf[i], receive included
+__thread Uring ring;
+__thread int refs[MAX_WINDOW];
+__thread int write_len[MAX_WINDOW];
+__thread long write_chunk[MAX_WINDOW];
+
+void print_progress_bar(long received_bytes, long total_bytes) {
     const int bar_width = 50;
+    if(!progress_due(received_bytes, total_bytes)) return;
+    if(total_bytes < 0) { // a stream: nothing to measure against
+        printf("\r%ld bytes", received_bytes);
+        fflush(stdout);
+        return;
+    }
     float percentage = (float)received_bytes*1.0 / total_bytes;
     int pos = (int)(bar_width * percentage);
 
+    flockfile(stdout); // flows report from their own threads
     printf("\r[");
     for(int i = 0; i < bar_width; ++i) {
         if(i < pos) printf("#");
@@ -20,97 +143,915 @@ void print_progress_bar(int received_bytes, int total_bytes) {
     }
     printf("] %3d%%", (int)(percentage * 100));
     fflush(stdout);
+    funlockfile(stdout);
 }
 
 void log_event(const char *event, Packet *pkt) {
-    time_t now = time(NULL);
-    fprintf(log_fp, "[%ld] %s - type: %d, seqNum: %d, ackNum: %d, len: %d\n",
-            now, event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
-    fflush(log_fp);
+    evlog(event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
 }
 
 int drop(float prob) {
     return ((float)rand() / RAND_MAX) < prob;
 }
 
-int main(int argc, char *argv[]) {
-    if(argc != 3) {
-        fprintf(stderr, "Usage: %s <receiver_port> <drop_prob>\n", argv[0]);
+int chunk_received(long chunk) {
+    return chunk_map[chunk / 8] >> (chunk % 8) & 1;
+}
+
+void mark_chunk(long chunk) {
+    chunk_map[chunk / 8] |= 1 << (chunk % 8);
+    while(first_missing < n_chunks && chunk_received(first_missing)) first_missing++;
+}
+
+// every chunk that len bytes from `chunk` on cover; one for an empty chunk
+void mark_chunks(long chunk, int len) {
+    do mark_chunk(chunk++); while((len -= MAX_DATA_SIZE) > 0);
+}
+
+// The whole chunks len bytes from `chunk` on cover are on disk: the next
+// checkpoint may count them
+void mark_on_disk(long chunk, int len) {
+    if(chunk_base < 0) return;
+    for(; len >= MAX_DATA_SIZE && chunk < full_chunks; chunk++, len -= MAX_DATA_SIZE) {
+        long k = chunk_base + chunk;
+        __atomic_fetch_or(&file_map[k / 8], 1 << (k % 8), __ATOMIC_RELAXED);
+    }
+}
+
+// File bytes in a DATA, DATA_LZ or DATA_REF packet
+int raw_length(const Packet *pkt) {
+    return pkt->type == TYPE_DATA_LZ || pkt->type == TYPE_DATA_REF ? pkt->ackNum : pkt->length;
+}
+
+// A stream's chunk map, grown to hold chunk `need`. The sender's window
+// keeps what arrives within two windows of the lowest missing chunk, so
+// anything further out is refused rather than let grow the map.
+int grow_chunk_map(long need) {
+    if(need < n_chunks) return 0;
+    if(need >= first_missing + 2 * MAX_WINDOW + LZ_GROUP) return -1;
+    long n = 2 * n_chunks > need + 1 ? 2 * n_chunks : need + 1;
+    unsigned char *more = realloc(chunk_map, (n + 7) / 8);
+    if(!more) {
+        perror("Out of memory");
         exit(1);
     }
+    memset(more + (n_chunks + 7) / 8, 0, (n + 7) / 8 - (n_chunks + 7) / 8);
+    chunk_map = more;
+    n_chunks = n;
+    return 0;
+}
 
-    int receiver_port = atoi(argv[1]);
-    int total_received = 0, f_size;
-    float drop_prob = atof(argv[2]);
-    srand(time(NULL));
+// Chunk index for a DATA packet, or -1 if it doesn't fit inside the flow's range
+long chunk_of(const Packet *pkt, const FileRange *range) {
+    long chunk = seq_unwrap(pkt->seqNum, FIRST_DATA_SEQ + first_missing) - FIRST_DATA_SEQ;
+    int len = raw_length(pkt);
+    if(len < 0 || len > (pkt->type == TYPE_DATA_REF ? REF_GROUP : LZ_GROUP) * MAX_DATA_SIZE) return -1;
+    if(streaming && chunk >= 0 && grow_chunk_map(chunk + len / MAX_DATA_SIZE) < 0) return -1;
+    if(chunk < 0 || chunk >= n_chunks) return -1;
+    if((uint64_t)chunk * MAX_DATA_SIZE + len > range->length) return -1;
+    return chunk;
+}
 
-    log_fp = fopen("udp_logs", "a");
-    if (!log_fp) {
-        perror("Failed to open log file");
+// Points *data at the packet's file bytes, inflating a DATA_LZ payload
+// into out (LZ_GROUP chunks of room). Returns their length, or -1 if the
+// payload doesn't inflate to what the header says.
+int unpack(const Packet *pkt, const unsigned char **data, unsigned char *out) {
+    if(pkt->type != TYPE_DATA_LZ) return pkt->length;
+    if(lz_decompress(*data, pkt->length, out, LZ_GROUP * MAX_DATA_SIZE) != pkt->ackNum) return -1;
+    *data = out;
+    return pkt->ackNum;
+}
+
+// Tree mode: puts len stream bytes from off in place, the manifest's share
+// in memory and the rest in the files. Returns 1 if the chunk has to wait
+// for the rest of the manifest (the manifest's share is kept meanwhile).
+int store_tree(const unsigned char *data, int len, long off) {
+    pthread_mutex_lock(&tree_lock);
+    if(!tree.manifest && off == 0) {
+        long m = tree_manifest_length(data, len);
+        if(m < 0 || m > f_size) {
+            fprintf(stderr, "Invalid manifest\n");
+            exit(1);
+        }
+        manifest_chunks = (m + MAX_DATA_SIZE - 1) / MAX_DATA_SIZE;
+        tree.manifest = malloc(m);
+        manifest_map = calloc(manifest_chunks / 8 + 1, 1);
+        if(!tree.manifest || !manifest_map) {
+            perror("Out of memory");
+            exit(1);
+        }
+        tree.manifest_len = m;
+        pthread_cond_broadcast(&tree_cond);
+    }
+    long m = tree.manifest_len;
+    if(tree.manifest && !tree_ready && off < m) {
+        memcpy(tree.manifest + off, data, len < m - off ? len : m - off);
+        for(long k = off / MAX_DATA_SIZE; k * MAX_DATA_SIZE < off + len && k < manifest_chunks; k++) {
+            if(manifest_map[k / 8] >> (k % 8) & 1) continue;
+            manifest_map[k / 8] |= 1 << (k % 8);
+            manifest_have++;
+        }
+        if(manifest_have == manifest_chunks) {
+            if(tree_parse(&tree, output_name, f_size) < 0) {
+                fprintf(stderr, "Invalid manifest\n");
+                exit(1);
+            }
+            if(tree_create(&tree, output_name) < 0) {
+                perror("Failed to create the tree");
+                exit(1);
+            }
+            printf("%s: %d entries\n", output_name, tree.n);
+            tree_ready = 1;
+            pthread_cond_broadcast(&tree_cond);
+        }
+    }
+    int ready = tree_ready;
+    pthread_mutex_unlock(&tree_lock);
+    if(off + len <= m) return 0;
+    if(!ready) return 1;
+    long skip = off < m ? m - off : 0;
+    if(tree_io(&tree, &cursor, (unsigned char *)data + skip, len - skip, off + skip, 1) < 0) {
+        perror("Write failed");
         exit(1);
     }
+    return 0;
+}
 
+// Writes len bytes at stream offset off: in place in the output, or in
+// tree mode through the manifest. Returns 1 if it can't be placed yet.
+int store(int fd, const unsigned char *data, int len, long off) {
+    if(tree_mode) return store_tree(data, len, off);
+    if(pwrite(fd, data, len, off) != len) {
+        perror("Write failed");
+        exit(1);
+    }
+    return 0;
+}
+
+// Tree mode: a flow whose range starts past the manifest waits for all of it
+void wait_for_manifest(const FileRange *range) {
+    pthread_mutex_lock(&tree_lock);
+    while(range->offset > 0 && !tree_ready && (!tree.manifest || (tree.manifest_len >= 0 && range->offset >= (uint64_t)tree.manifest_len))) pthread_cond_wait(&tree_cond, &tree_lock);
+    pthread_mutex_unlock(&tree_lock);
+}
+
+// Creates recv_<name> at its final size up front, so offset writes never
+// extend it piecemeal. fallocate reserves the blocks; filesystems that
+// can't do that just get a sparse file of the right length. A resumed
+// output is kept as it is.
+int open_output(const char *filename, long f_size, int keep) {
+    int fd = open(filename, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644); // read back for the digest check
+    if(fd < 0) return -1;
+    if(f_size > 0 && fallocate(fd, 0, 0, f_size) < 0 && ftruncate(fd, f_size) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Loads file_map from the checkpoint if it is intact, describes this same
+// file (size and mtime) and the output is still there. Returns 1 if so.
+int load_checkpoint(void) {
+    Checkpoint cp;
+    struct stat st;
+    long len = (file_chunks + 7) / 8;
+    int ok = 0;
+    int fd = open(part_name, O_RDONLY);
+    if(fd < 0) return 0;
+    if(f_mtime && pread(fd, &cp, sizeof(cp), 0) == sizeof(cp) && memcmp(cp.magic, CHECKPOINT_MAGIC, 8) == 0 &&
+       cp.f_size == (uint64_t)f_size && cp.mtime == f_mtime && pread(fd, file_map, len, sizeof(cp)) == len &&
+       crc32c(crc32c(0, &cp, offsetof(Checkpoint, crc)), file_map, len) == cp.crc &&
+       stat(output_name, &st) == 0 && st.st_size == f_size) {
+        ok = 1;
+    } else {
+        memset(file_map, 0, len);
+    }
+    close(fd);
+    return ok;
+}
+
+// Rewrites the checkpoint if CHECKPOINT_US have passed; any flow may call
+// it. The map is copied first and the output synced before the copy is
+// written, so the checkpoint never claims data a crash could still lose.
+void checkpoint(void) {
+    uint64_t now = now_us();
+    if(part_fd < 0 || now - __atomic_load_n(&checkpoint_at, __ATOMIC_RELAXED) < CHECKPOINT_US) return;
+    if(pthread_mutex_trylock(&checkpoint_lock) != 0) return; // another flow is on it
+    __atomic_store_n(&checkpoint_at, now, __ATOMIC_RELAXED);
+    long len = (file_chunks + 7) / 8;
+    for(long i = 0; i < len; i++) file_map_copy[i] = __atomic_load_n(&file_map[i], __ATOMIC_RELAXED);
+    Checkpoint cp = { .f_size = f_size, .mtime = f_mtime };
+    memcpy(cp.magic, CHECKPOINT_MAGIC, 8);
+    cp.crc = crc32c(crc32c(0, &cp, offsetof(Checkpoint, crc)), file_map_copy, len);
+    if(fdatasync(output_fd) < 0 || pwrite(part_fd, &cp, sizeof(cp), 0) != sizeof(cp) ||
+       pwrite(part_fd, file_map_copy, len, sizeof(cp)) != len) {
+        perror("Checkpoint failed");
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+}
+
+// Marks the flow's chunks that the checkpoint had as received. Returns how many.
+long preload_chunks(void) {
+    long held = 0;
+    for(long c = 0; chunk_base >= 0 && c < full_chunks; c++) {
+        long k = chunk_base + c;
+        if(!(file_map[k / 8] >> (k % 8) & 1)) continue;
+        mark_chunk(c);
+        held++;
+    }
+    return held;
+}
+
+// Tells the sender which of the flow's whole chunks are already here, as
+// NACK-style seqNum ranges over as many packets as it takes (up to
+// RESUME_MAX_PACKETS). Right after setup, and again, at most every
+// RESUME_REPEAT_US, whenever a chunk that was kept arrives anyway. Only
+// the first 2^31 seqNums are listed: later kept chunks just come again.
+void send_resume(int sockfd, struct sockaddr_in *sender_addr, uint32_t session) {
+    uint64_t now = now_us();
+    if(now - resume_at < RESUME_REPEAT_US) return;
+    resume_at = now;
+    Packet res = { .type = TYPE_RESUME, .session = session };
+    int packets = 0;
+    long end = full_chunks < INT32_MAX - FIRST_DATA_SEQ ? full_chunks : INT32_MAX - FIRST_DATA_SEQ;
+    for(long c = 0; c < end && packets < RESUME_MAX_PACKETS; ) {
+        if(!chunk_received(c)) {
+            c++;
+            continue;
+        }
+        long first = c;
+        while(c < end && chunk_received(c)) c++;
+        if(nack_put_range(&res, FIRST_DATA_SEQ + first, FIRST_DATA_SEQ + c - 1) == 0) continue;
+        send_packet(sockfd, &res, sender_addr, sizeof(*sender_addr));
+        log_event("SEND RESUME", &res);
+        packets++;
+        res.length = 0;
+        nack_put_range(&res, FIRST_DATA_SEQ + first, FIRST_DATA_SEQ + c - 1);
+    }
+    if(res.length > 0 && packets < RESUME_MAX_PACKETS) {
+        send_packet(sockfd, &res, sender_addr, sizeof(*sender_addr));
+        log_event("SEND RESUME", &res);
+    }
+}
+
+// Delta mode, once per transfer: the old output becomes the basis (a
+// resumed transfer finds it moved already) and every whole block of it
+// gets signed. Without one there are no signatures, and the sender sends
+// everything.
+void open_basis(int keep) {
+    static unsigned char buf[64 * DELTA_BLOCK];
+    struct stat st;
+    if(!keep && stat(output_name, &st) == 0 && st.st_size > 0 && rename(output_name, basis_name) < 0) perror("Can't move the old copy aside");
+    if((basis_fd = open(basis_name, O_RDONLY)) < 0) return;
+    long blocks = fstat(basis_fd, &st) < 0 ? -1 : st.st_size / DELTA_BLOCK;
+    if(blocks > DELTA_MAX_BLOCKS) blocks = DELTA_MAX_BLOCKS; // the rest of a huge basis isn't offered
+    if(blocks < 0 || !(basis_sigs = malloc((blocks + 1) * sizeof(*basis_sigs)))) {
+        close(basis_fd);
+        basis_fd = -1;
+        return;
+    }
+    basis_size = st.st_size;
+    for(long off = 0; off + DELTA_BLOCK <= basis_size && n_sigs < blocks; ) {
+        ssize_t n = pread(basis_fd, buf, sizeof(buf), off);
+        if(n < DELTA_BLOCK) break;
+        for(int i = 0; i + DELTA_BLOCK <= n && n_sigs < blocks; i += DELTA_BLOCK) delta_sign(buf + i, DELTA_BLOCK, &basis_sigs[n_sigs++]);
+        off += n / DELTA_BLOCK * DELTA_BLOCK;
+    }
+    printf("Delta: %s, %d blocks signed\n", basis_name, n_sigs);
+}
+
+// Answers an INIT: accepted, or refused with the reason (one line, no
+// newline) for the sender to print
+void send_accept(int sockfd, struct sockaddr_in *sender_addr, uint32_t session, const char *refusal) {
+    Packet acc = { .type = TYPE_ACCEPT, .session = session };
+    if(refusal) {
+        acc.length = strlen(refusal);
+        memcpy(acc.data, refusal, acc.length);
+    }
+    send_packet(sockfd, &acc, sender_addr, sizeof(*sender_addr));
+    log_event("SEND ACCEPT", &acc);
+}
+
+// Delta mode: all the basis signatures, right after setup and again (at
+// most every SIG_REPEAT_US) while the sender repeats its INIT waiting for
+// them. One empty packet says there is no basis.
+void send_signatures(int sockfd, struct sockaddr_in *sender_addr, uint32_t session) {
+    uint64_t now = now_us();
+    if(now - sigs_at < SIG_REPEAT_US) return;
+    sigs_at = now;
+    Packet sig = { .type = TYPE_SIG, .ackNum = n_sigs, .session = session };
+    uint32_t block = htonl(DELTA_BLOCK);
+    int k = 0;
+    do {
+        int n = n_sigs - k < SIG_PER_PACKET ? n_sigs - k : SIG_PER_PACKET;
+        sig.seqNum = k;
+        memcpy(sig.data, &block, 4);
+        for(int i = 0; i < n; i++) sig_put(sig.data, i, basis_sigs[k + i].weak, basis_sigs[k + i].strong);
+        sig.length = 4 + 12 * n;
+        send_packet(sockfd, &sig, sender_addr, sizeof(*sender_addr));
+        k += n;
+    } while(k < n_sigs);
+    log_event("SEND SIGNATURES", &sig);
+}
+
+// len bytes from one file to another, in the kernel where it can
+int copy_range(int from, off_t in, int to, off_t out, long len) {
+    while(len > 0) {
+        ssize_t n = copy_file_range(from, &in, to, &out, len, 0);
+        if(n <= 0) { // not on this filesystem pair: by hand
+            unsigned char buf[LZ_GROUP * MAX_DATA_SIZE];
+            n = pread(from, buf, len < (long)sizeof(buf) ? len : (long)sizeof(buf), in);
+            if(n <= 0 || pwrite(to, buf, n, out) != n) return -1;
+            in += n;
+            out += n;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// Delta mode: fills the chunks of a DATA_REF from the basis. Returns the
+// bytes covered, or -1 if the segments don't add up to them or leave the
+// basis.
+int copy_ref(int fd, const Packet *pkt, const unsigned char *payload, const FileRange *range, long chunk) {
+    long total = 0;
+    if(basis_fd < 0 || pkt->length % 12) return -1;
+    for(int i = 0; i < pkt->length / 12; i++) {
+        uint64_t offset;
+        uint32_t length;
+        ref_get_segment(payload, i, &offset, &length);
+        if(offset > (uint64_t)basis_size || length > basis_size - offset) return -1;
+        total += length;
+    }
+    if(total != pkt->ackNum || total % MAX_DATA_SIZE) return -1;
+    off_t out = range->offset + (off_t)chunk * MAX_DATA_SIZE;
+    for(int i = 0; i < pkt->length / 12; i++) {
+        uint64_t offset;
+        uint32_t length;
+        ref_get_segment(payload, i, &offset, &length);
+        if(copy_range(basis_fd, offset, fd, out, length) < 0) {
+            perror("Copy from the basis failed");
+            exit(1);
+        }
+        out += length;
+    }
+    return total;
+}
+
+void note_eot(Packet *pkt, const unsigned char *payload) {
+    log_event("RECV EOT", pkt);
+    if(decode_eot((const char *)payload, pkt->length, &eot_digest, &eot_length) == 0) have_digest = 1;
+}
+
+// Reads the flow's range back and compares it with the sender's digest.
+// Datagrams were already CRC-checked; this catches anything after that.
+// A stream's length is the one EOT gave, and what is past it goes.
+// Only called once an EOT came in, so one without a usable digest is a
+// protocol error. Returns -1 on a mismatch or no digest, else 0.
+int verify_range(int fd, FileRange *range) {
+    uint64_t digest;
+    if(!have_digest) {
+        fprintf(stderr, "\nNo digest for bytes %lu-%lu: malformed EOT\n", range->offset, range->offset + range->length);
+        __atomic_store_n(&corrupt, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if(streaming) {
+        range->length = f_size = eot_length;
+        if(ftruncate(fd, f_size) < 0) perror("ftruncate failed");
+    }
+    int err = tree_mode ? tree_digest(&tree, &cursor, range->offset, range->length, &digest) : digest_file(fd, range->offset, range->length, &digest);
+    if(err < 0 || digest != eot_digest) {
+        fprintf(stderr, "\nDigest mismatch in bytes %lu-%lu\n", range->offset, range->offset + range->length);
+        __atomic_store_n(&corrupt, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+// ACK mode: the sender repeats EOT until it is answered, with an empty EOT
+// if the range checked out or a refusal if not. Answers again every EOT
+// until the sender has gone quiet.
+void confirm_eot(int sockfd, struct sockaddr_in *sender_addr, uint32_t session, int ok) {
+    uint64_t last_heard = now_us();
+    int answer = 1;
+    while(now_us() - last_heard < EOT_LINGER_US) {
+        if(answer && !ok) {
+            send_accept(sockfd, sender_addr, session, "digest mismatch");
+        } else if(answer && !drop(drop_prob)) {
+            Packet echo = { .type = TYPE_EOT, .session = session };
+            send_packet(sockfd, &echo, sender_addr, sizeof(*sender_addr));
+            log_event("SEND EOT", &echo);
+        }
+        answer = 0;
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if(poll(&pfd, 1, EOT_LINGER_US / 1000) <= 0) continue;
+        Packet pkt;
+        socklen_t len = sizeof(*sender_addr);
+        if(recv_packet(sockfd, &pkt, sender_addr, &len) < 0 || pkt.session != session) continue;
+        last_heard = now_us();
+        answer = pkt.type == TYPE_EOT;
+    }
+}
+
+void post_recv(int i) {
+    if(!uring_prep(&ring, IORING_OP_RECV, FILE_SOCK, rx_buf[i], MAX_PACKET_SIZE, 0, URING_DATA(OP_RECV, i))) {
+        perror("io_uring submit failed");
+        exit(1);
+    }
+    refs[i] = 1;
+}
+
+// io_uring engine: `batch` receives stay posted into registered buffers and
+// each new chunk is written straight from its buffer at its file offset,
+// so disk writes overlap the next receives. A buffer is re-posted once its write and ACK have both
+// completed. Returns -1 before receiving anything if io_uring can't be set up.
+int receive_uring(int sockfd, int fd, struct sockaddr_in *sender_addr, uint32_t session, const FileRange *range) {
+    int files[] = { [FILE_SOCK] = sockfd, [FILE_OUTPUT] = fd };
+    // a compressed chunk is written from its inflated copy, one per buffer
+    unsigned char (*inflated)[LZ_GROUP * MAX_DATA_SIZE] = malloc(batch * sizeof(*inflated));
+    if(!inflated) return -1;
+    struct iovec bufs[MAX_WINDOW];
+    for(int i = 0; i < batch; i++) {
+        bufs[i].iov_base = rx_buf[i];
+        bufs[i].iov_len = MAX_PACKET_SIZE;
+    }
+    if(uring_init(&ring, URING_ENTRIES) < 0) {
+        free(inflated);
+        return -1;
+    }
+    if(uring_register_files(&ring, files, 2) < 0 || uring_register_buffers(&ring, bufs, batch) < 0) {
+        uring_exit(&ring);
+        free(inflated);
+        return -1;
+    }
+    // ACKs go out without an address from here on
+    connect(sockfd, (struct sockaddr *)sender_addr, sizeof(*sender_addr));
+    for(int i = 0; i < batch; i++) post_recv(i);
+
+    int writes = 0, done = 0;
+    while(!done || writes > 0) {
+        if(uring_submit(&ring, 1) < 0) {
+            perror("io_uring_enter failed");
+            exit(1);
+        }
+        int progress = 0;
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek(&ring))) {
+            int op = URING_OP(cqe->user_data), i = URING_IDX(cqe->user_data), res = cqe->res;
+            uring_cqe_seen(&ring);
+
+            Packet pkt;
+            int ok = op == OP_RECV && res > 0 && !done && decode_header(rx_buf[i], res, &pkt) == 0;
+            if(op == OP_RECV && res > 0 && !done && !ok) metrics_add(&metrics.bad, 1);
+            if(ok && pkt.session == session) {
+                if(pkt.type == TYPE_DATA || pkt.type == TYPE_DATA_LZ) {
+                    long chunk = chunk_of(&pkt, range);
+                    const unsigned char *data = rx_buf[i] + HEADER_SIZE;
+                    int fresh = chunk >= 0 && !chunk_received(chunk);
+                    int len = fresh ? unpack(&pkt, &data, inflated[i]) : 0;
+                    metrics_add(fresh ? &metrics.packets : &metrics.duplicates, 1);
+                    if(fresh && len >= 0) {
+                        mark_chunks(chunk, len);
+                        if(len > 0) {
+                            // straight from the registered buffer unless it had to be inflated
+                            struct io_uring_sqe *sqe = uring_prep(&ring, data == inflated[i] ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED, FILE_OUTPUT,
+                                                                  (void *)data, len, range->offset + (uint64_t)chunk * MAX_DATA_SIZE, URING_DATA(OP_WRITE, i));
+                            if(!sqe) {
+                                perror("io_uring submit failed");
+                                exit(1);
+                            }
+                            sqe->buf_index = data == inflated[i] ? 0 : i;
+                            write_len[i] = len;
+                            write_chunk[i] = chunk;
+                            refs[i]++;
+                            writes++;
+                        }
+                        __atomic_add_fetch(&received_all, len, __ATOMIC_RELAXED);
+                        metrics_add(&metrics.bytes, len);
+                        progress = 1;
+                    } else if(chunk >= 0 && resumed) {
+                        send_resume(sockfd, sender_addr, session);
+                    }
+                    if(len >= 0 && !drop(drop_prob)) { // one that won't inflate isn't acked, so it comes again
+                        Packet ack = { .type = TYPE_ACK, .ackNum = pkt.seqNum, .session = session };
+                        encode_packet(&ack, ack_buf[i]);
+                        if(!uring_prep(&ring, IORING_OP_SEND, FILE_SOCK, ack_buf[i], HEADER_SIZE, 0, URING_DATA(OP_SEND, i))) {
+                            perror("io_uring submit failed");
+                            exit(1);
+                        }
+                        refs[i]++;
+                        log_event("SEND ACK", &ack);
+                        metrics_add(&metrics.acks, 1);
+                    }
+                } else if(pkt.type == TYPE_EOT) {
+                    note_eot(&pkt, rx_buf[i] + HEADER_SIZE);
+                    done = 1;
+                } else if(pkt.type == TYPE_INIT) {
+                    send_accept(sockfd, sender_addr, session, NULL); // ours got lost
+                }
+            } else if(op == OP_WRITE) {
+                if(res != write_len[i]) {
+                    fprintf(stderr, "Write failed: %s\n", res < 0 ? strerror(-res) : "short write");
+                    exit(1);
+                }
+                mark_on_disk(write_chunk[i], write_len[i]);
+                writes--;
+            }
+            if(--refs[i] == 0 && !done) post_recv(i);
+        }
+        if(progress) {
+            print_progress_bar(__atomic_load_n(&received_all, __ATOMIC_RELAXED), f_size);
+            checkpoint();
+        }
+    }
+    uring_exit(&ring);
+    free(inflated);
+    return 0;
+}
+
+void init_msgs(void) {
+    for(int i = 0; i < batch; i++) {
+        rx_iov[i].iov_base = rx_buf[i];
+        rx_iov[i].iov_len = MAX_PACKET_SIZE;
+        rx_msgs[i].msg_hdr.msg_name = &rx_addr[i];
+        rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        ack_iov[i].iov_base = ack_buf[i];
+        ack_iov[i].iov_len = HEADER_SIZE;
+        ack_msgs[i].msg_hdr.msg_iov = &ack_iov[i];
+        ack_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+// Holes from `cum` on: below the highest chunk seen, and past it too once
+// EOT said everything was sent. ackNum = cum, so a NACK past last_seq
+// with no ranges confirms the transfer.
+void send_nack(int sockfd, struct sockaddr_in *sender_addr, uint32_t session, long cum, long highest, long end) {
+    Packet nack = { .type = TYPE_NACK, .seqNum = highest, .ackNum = cum, .session = session };
+    if(end > cum + INT32_MAX) end = cum + INT32_MAX; // past that the sender couldn't unwrap them
+    for(long seq = cum; seq <= end; ) {
+        if(chunk_received(seq - FIRST_DATA_SEQ)) {
+            seq++;
+            continue;
+        }
+        long first = seq;
+        while(seq <= end && !chunk_received(seq - FIRST_DATA_SEQ)) seq++;
+        if(nack_put_range(&nack, first, seq - 1) < 0) break; // the rest goes in a later NACK
+    }
+    if(drop(drop_prob)) return;
+    send_packet(sockfd, &nack, sender_addr, sizeof(*sender_addr));
+    log_event("SEND NACK", &nack);
+    metrics_add(&metrics.acks, 1);
+}
+
+// NACK mode: no ACK per chunk. Holes go back every NACK_INTERVAL_US while
+// there are any or new data came in, and at once on EOT. Returns once
+// everything and the EOT are in, for confirm_eot to answer it.
+void receive_nack(int sockfd, int fd, struct sockaddr_in *sender_addr, uint32_t session, const FileRange *range) {
+    long last_seq = FIRST_DATA_SEQ + n_chunks - 1;
+    long cum = FIRST_DATA_SEQ, highest = FIRST_DATA_SEQ - 1;
+    int eot = 0, fresh = 0;
+    uint64_t next_nack = now_us() + NACK_INTERVAL_US;
+    while(cum <= last_seq && chunk_received(cum - FIRST_DATA_SEQ)) cum++; // kept from an earlier attempt
+    init_msgs();
+    while(cum <= last_seq || !eot) {
+        uint64_t now = now_us();
+        if(now >= next_nack) {
+            if(fresh || (cum <= last_seq && (cum <= highest || eot))) {
+                send_nack(sockfd, sender_addr, session, cum, highest, eot ? last_seq : highest);
+                print_progress_bar(__atomic_load_n(&received_all, __ATOMIC_RELAXED), f_size);
+                checkpoint();
+            }
+            fresh = 0;
+            next_nack = now + NACK_INTERVAL_US;
+        }
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if(poll(&pfd, 1, (next_nack - now) / 1000 + 1) <= 0) continue;
+        for(int i = 0; i < batch; i++) rx_msgs[i].msg_hdr.msg_namelen = sizeof(rx_addr[i]);
+        int n = recvmmsg(sockfd, rx_msgs, batch, MSG_DONTWAIT, NULL);
+        for(int i = 0; i < n; i++) {
+            Packet pkt;
+            if(decode_header(rx_buf[i], rx_msgs[i].msg_len, &pkt) < 0) {
+                metrics_add(&metrics.bad, 1);
+                continue;
+            }
+            if(pkt.session != session) continue;
+            *sender_addr = rx_addr[i];
+            if(pkt.type == TYPE_DATA) {
+                long chunk = chunk_of(&pkt, range);
+                if(chunk < 0) continue;
+                metrics_add(chunk_received(chunk) ? &metrics.duplicates : &metrics.packets, 1);
+                if(!chunk_received(chunk)) {
+                    if(store(fd, rx_buf[i] + HEADER_SIZE, pkt.length, range->offset + (off_t)chunk * MAX_DATA_SIZE)) continue; // reported missing until it fits
+                    mark_chunk(chunk);
+                    mark_on_disk(chunk, pkt.length);
+                    __atomic_add_fetch(&received_all, pkt.length, __ATOMIC_RELAXED);
+                    metrics_add(&metrics.bytes, pkt.length);
+                    while(cum <= last_seq && chunk_received(cum - FIRST_DATA_SEQ)) cum++;
+                    if(cum > last_seq) next_nack = 0; // complete: say so right away
+                } else if(resumed) {
+                    send_resume(sockfd, sender_addr, session);
+                }
+                if(chunk + FIRST_DATA_SEQ > highest) highest = chunk + FIRST_DATA_SEQ;
+                fresh = 1;
+            } else if(pkt.type == TYPE_EOT) {
+                note_eot(&pkt, rx_buf[i] + HEADER_SIZE);
+                eot = 1;
+                fresh = 1;
+                next_nack = 0; // the repairs go at once; if there are none, confirm_eot answers
+            } else if(pkt.type == TYPE_INIT) {
+                send_accept(sockfd, sender_addr, session, NULL); // ours got lost
+            }
+        }
+    }
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b batch] [-e sync|uring] [-n streams] [-l n] [-M metrics] <receiver_port> <drop_prob>\n", prog);
+    exit(1);
+}
+
+// Output for the transfer, shared by its flows: the first one to learn the
+// name and size creates the file, or picks up the one its checkpoint
+// describes, and the rest write through the same fd.
+int claim_output(const char *name, const FileRange *range, int delta) {
+    pthread_mutex_lock(&output_lock);
+    if(output_fd < 0 && tree_mode) { // the directory stands in for the output; its contents come with the manifest
+        snprintf(output_name, sizeof(output_name), "recv_%s", name);
+        f_size = range->f_size;
+        file_chunks = f_size / MAX_DATA_SIZE;
+        file_map = calloc(file_chunks / 8 + 1, 1);
+        if(!file_map) {
+            perror("Out of memory");
+            exit(1);
+        }
+        if(mkdir(output_name, 0755) == 0 || errno == EEXIST) output_fd = open(output_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    } else if(output_fd < 0) {
+        snprintf(output_name, sizeof(output_name), "recv_%s", name);
+        snprintf(part_name, sizeof(part_name), "%s.part", output_name);
+        snprintf(basis_name, sizeof(basis_name), "%s.basis", output_name);
+        f_size = streaming ? -1 : (long)range->f_size;
+        f_mtime = range->mtime; // 0 for a stream, which never resumes
+        file_chunks = streaming ? 0 : f_size / MAX_DATA_SIZE;
+        file_map = calloc(file_chunks / 8 + 1, 1);
+        file_map_copy = malloc(file_chunks / 8 + 1);
+        if(!file_map || !file_map_copy) {
+            perror("Out of memory");
+            exit(1);
+        }
+        int keep = load_checkpoint();
+        if(delta) open_basis(keep);
+        if(keep) {
+            long held = 0;
+            for(long i = 0; i < file_chunks / 8 + 1; i++) held += __builtin_popcount(file_map[i]);
+            printf("Resuming %s: %ld of %ld chunks already here\n", output_name, held, file_chunks);
+        }
+        output_fd = open_output(output_name, f_size, keep);
+        if(output_fd >= 0 && !streaming) part_fd = open(part_name, O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+    }
+    int fd = output_fd;
+    pthread_mutex_unlock(&output_lock);
+    return fd;
+}
+
+// One flow, INIT to EOT, on its own port
+void *receive_flow(void *arg) {
+    Flow *flow = arg;
+    int use_uring = want_uring;
+    metrics_watch_port(flow->index, flow->port);
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sockfd < 0) {
+        perror("Socket creation failed");
+        exit(1);
+    }
     struct sockaddr_in receiver_addr = {
         .sin_family = AF_INET,
-        .sin_port = htons(receiver_port),
+        .sin_port = htons(flow->port),
         .sin_addr.s_addr = INADDR_ANY
     };
-    bind(sockfd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr));
+    if(bind(sockfd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) < 0) {
+        perror("bind failed");
+        exit(1);
+    }
+    int rcvbuf = SOCKET_BUFFER_SIZE;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
     struct sockaddr_in sender_addr;
     socklen_t addlen = sizeof(sender_addr);
 
-    Packet greet_pkt = {0};
-    recvfrom(sockfd, &greet_pkt, sizeof(greet_pkt), 0, (struct sockaddr *)&sender_addr, &addlen);
-    if(greet_pkt.type != TYPE_DATA || strcmp(greet_pkt.data, "Greeting") != 0) {
-        fprintf(stderr, "Invalid greeting\n");
+    // the sender resends its INIT until it is answered; anything else
+    // before it (data riding along behind a lost one) comes again
+    Packet init;
+    while(recv_packet(sockfd, &init, &sender_addr, &addlen) < 0 || init.type != TYPE_INIT);
+    // everything else from this flow carries the sender's session ID
+    uint32_t session = init.session;
+    uint32_t flags;
+    FileRange range;
+    char name[MAX_DATA_SIZE - INIT_HEADER + 1];
+    if(decode_init(init.data, init.length, &flags, &range, name) < 0) {
+        send_accept(sockfd, &sender_addr, session, "invalid INIT");
+        fprintf(stderr, "Invalid INIT\n");
         exit(1);
     }
+    int nack_mode = flags & INIT_NACK; // sender -m nack
+    int delta = flags & INIT_DELTA; // sender -d: sync engine only
+    tree_mode = flags & INIT_TREE; // a directory: sync or NACK engine
+    if(delta || tree_mode) use_uring = 0;
 
-    Packet ok = { .type = TYPE_ACK };
-    strcpy(ok.data, "OK");
-    sendto(sockfd, &ok, sizeof(ok), 0, (struct sockaddr *)&sender_addr, addlen);
-
-    Packet fname = {0};
-    recvfrom(sockfd, &fname, sizeof(fname), 0, (struct sockaddr *)&sender_addr, &addlen);
-    recvfrom(sockfd, &f_size, sizeof(int), 0, (struct sockaddr *)&sender_addr, &addlen);
-
-    char filename[128];
-    snprintf(filename, sizeof(filename), "recv_%s", fname.data);
-    FILE *fp = fopen(filename, "wb");
-    if(!fp) {
+    // a stream (INIT_STREAM, sender input from a pipe) is a single flow;
+    // its map grows as chunks come, and nothing is kept for a resume
+    streaming = range.f_size == STREAM_SIZE;
+    if(streaming != !!(flags & INIT_STREAM) || (streaming && (tree_mode || delta || nack_mode || range.offset != 0))) {
+        send_accept(sockfd, &sender_addr, session, "invalid stream");
+        fprintf(stderr, "Invalid stream\n");
+        exit(1);
+    }
+    int fd = claim_output(name, &range, delta);
+    n_chunks = streaming ? 8 * 1024 : (long)(range.length / MAX_DATA_SIZE + 1);
+    chunk_map = calloc((n_chunks + 7) / 8, 1);
+    if(fd < 0 || !chunk_map) {
         perror("Failed to open output file.");
+        send_accept(sockfd, &sender_addr, session, "can't open the output");
         exit(1);
     }
+    send_accept(sockfd, &sender_addr, session, NULL);
+    if(range.offset % MAX_DATA_SIZE == 0 && !streaming) chunk_base = range.offset / MAX_DATA_SIZE;
+    full_chunks = streaming ? 0 : range.length / MAX_DATA_SIZE;
+    long held = preload_chunks();
+    if(held > 0) {
+        resumed = 1;
+        __atomic_add_fetch(&received_all, held * MAX_DATA_SIZE, __ATOMIC_RELAXED);
+        send_resume(sockfd, &sender_addr, session);
+    }
+    if(delta) send_signatures(sockfd, &sender_addr, session);
+    if(tree_mode) wait_for_manifest(&range);
 
-    int expected_seq = 3;
-    while(1) {
-        Packet pkt = {0};
-        ssize_t len = recvfrom(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&sender_addr, &addlen);
+    if(nack_mode) {
+        receive_nack(sockfd, fd, &sender_addr, session, &range);
+        confirm_eot(sockfd, &sender_addr, session, verify_range(fd, &range) == 0);
+        tree_cursor_close(&cursor);
+        free(chunk_map);
+        close(sockfd);
+        return NULL;
+    }
 
-        if(len < 0) continue;
+    if(use_uring) {
+        if(receive_uring(sockfd, fd, &sender_addr, session, &range) == 0) {
+            confirm_eot(sockfd, &sender_addr, session, verify_range(fd, &range) == 0);
+            free(chunk_map);
+            close(sockfd);
+            return NULL;
+        }
+        perror("io_uring unavailable, using the sync engine");
+    }
+
+    init_msgs();
+
+    int done = 0;
+    while(!done) {
+        for(int i = 0; i < batch; i++) rx_msgs[i].msg_hdr.msg_namelen = sizeof(rx_addr[i]);
+        // wait for one datagram, then take everything else already queued
+        int n = recvmmsg(sockfd, rx_msgs, batch, MSG_WAITFORONE, NULL);
+        if(n < 0) continue;
 
-        if(pkt.type == TYPE_DATA) {
-            if(pkt.seqNum == expected_seq) {
-                fwrite(pkt.data, 1, pkt.length, fp);
-                total_received += pkt.length;
-                expected_seq++;
+        int n_acks = 0;
+        for(int i = 0; i < n && !done; i++) {
+            Packet pkt;
+            if(decode_header(rx_buf[i], rx_msgs[i].msg_len, &pkt) < 0) {
+                metrics_add(&metrics.bad, 1);
+                continue;
             }
-            if(drop(drop_prob)) continue;
-            Packet ack = { .type = TYPE_ACK, .ackNum = pkt.seqNum };
-            sendto(sockfd, &ack, sizeof(ack), 0, (struct sockaddr *)&sender_addr, addlen);
-            log_event("SEND ACK", &ack);
-            print_progress_bar(total_received, f_size);
-        } else if(pkt.type == TYPE_EOT) {
-            log_event("RECV EOT", &pkt);
-            break;
-        }
-    }
-    fclose(fp);
-    fclose(log_fp);
+            if(pkt.session != session) continue; // not our transfer
+            sender_addr = rx_addr[i];
+
+            if(pkt.type == TYPE_INIT) {
+                send_accept(sockfd, &rx_addr[i], session, NULL); // ours got lost
+                if(delta) send_signatures(sockfd, &rx_addr[i], session); // the sender is still waiting for them
+            } else if(pkt.type == TYPE_DATA || pkt.type == TYPE_DATA_LZ || pkt.type == TYPE_DATA_REF) {
+                // write the payload in place at its offset, whatever the arrival order
+                long chunk = chunk_of(&pkt, &range);
+                const unsigned char *data = rx_buf[i] + HEADER_SIZE;
+                int fresh = chunk >= 0 && !chunk_received(chunk);
+                int len = !fresh ? 0 : pkt.type == TYPE_DATA_REF ? copy_ref(fd, &pkt, data, &range, chunk) : unpack(&pkt, &data, lz_out);
+                metrics_add(fresh ? &metrics.packets : &metrics.duplicates, 1);
+                if(len < 0) continue; // won't inflate or copy: no ACK, so it comes again
+                if(fresh) {
+                    if(pkt.type != TYPE_DATA_REF && store(fd, data, len, range.offset + (off_t)chunk * MAX_DATA_SIZE)) continue; // waits for the manifest, unacked
+                    mark_chunks(chunk, len);
+                    mark_on_disk(chunk, len);
+                    __atomic_add_fetch(&received_all, len, __ATOMIC_RELAXED);
+                    metrics_add(&metrics.bytes, len);
+                } else if(chunk >= 0 && resumed) {
+                    send_resume(sockfd, &rx_addr[i], session);
+                }
+                if(drop(drop_prob)) continue;
+                // header-only frame, so only the header fields need setting
+                Packet ack;
+                ack.type = TYPE_ACK;
+                ack.seqNum = 0;
+                ack.ackNum = pkt.seqNum;
+                ack.length = 0;
+                ack.session = session;
+                encode_packet(&ack, ack_buf[n_acks]);
+                ack_msgs[n_acks].msg_hdr.msg_name = &rx_addr[i];
+                ack_msgs[n_acks].msg_hdr.msg_namelen = sizeof(rx_addr[i]);
+                n_acks++;
+                log_event("SEND ACK", &ack);
+                metrics_add(&metrics.acks, 1);
+            } else if(pkt.type == TYPE_EOT) {
+                note_eot(&pkt, rx_buf[i] + HEADER_SIZE);
+                done = 1;
+            }
+        }
+        if(n_acks > 0) {
+            send_batch(sockfd, ack_msgs, n_acks);
+            print_progress_bar(__atomic_load_n(&received_all, __ATOMIC_RELAXED), f_size);
+            checkpoint();
+        }
+    }
+    confirm_eot(sockfd, &sender_addr, session, verify_range(fd, &range) == 0);
+    tree_cursor_close(&cursor);
+    free(chunk_map);
     close(sockfd);
+    return NULL;
+}
 
+int main(int argc, char *argv[]) {
+    int streams = 1;
+    int opt;
+    while((opt = getopt(argc, argv, "b:e:n:l:M:")) != -1) {
+        switch(opt) {
+            case 'b': batch = atoi(optarg); break;
+            case 'e':
+                if(strcmp(optarg, "uring") == 0) want_uring = 1;
+                else if(strcmp(optarg, "sync") != 0) usage(argv[0]);
+                break;
+            case 'n': streams = atoi(optarg); break;
+            case 'l': log_sample = atoi(optarg); break;
+            case 'M': metrics_file = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(argc - optind != 2) usage(argv[0]);
+    if(batch < 1 || batch > MAX_WINDOW) {
+        fprintf(stderr, "Batch size must be between 1 and %d\n", MAX_WINDOW);
+        exit(1);
+    }
+    if(streams < 1 || streams > MAX_STREAMS) {
+        fprintf(stderr, "Streams must be between 1 and %d\n", MAX_STREAMS);
+        exit(1);
+    }
+    argv += optind - 1;
+
+    int receiver_port = atoi(argv[1]);
+    drop_prob = atof(argv[2]);
+    srand(time(NULL));
+
+    if(evlog_open("udp_logs.bin", log_sample) < 0) {
+        perror("Failed to open log file");
+        exit(1);
+    }
+    if(metrics_start(metrics_file, "receiver") < 0) {
+        perror("Failed to start metrics");
+        exit(1);
+    }
+
+    Flow flows[MAX_STREAMS];
+    for(int i = 0; i < streams; i++) {
+        flows[i].index = i;
+        flows[i].port = receiver_port + i;
+        if(pthread_create(&flows[i].thread, NULL, receive_flow, &flows[i]) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < streams; i++) pthread_join(flows[i].thread, NULL);
+    close(output_fd);
+    close(part_fd);
+    unlink(part_name); // complete, or rejected below: nothing left to resume
+
+    if(f_size < 0) printf("\r%ld bytes", received_all); // the last count may not have been drawn
     printf("\n");
+    if(corrupt && tree_mode) { // set the bad copy aside rather than deleting a whole tree
+        char rejected[144];
+        snprintf(rejected, sizeof(rejected), "%s.rejected", output_name);
+        fprintf(stderr, "%s rejected, moved to %s\n", output_name, rejected);
+        rename(output_name, rejected);
+        return 1;
+    }
+    if(corrupt) { // don't leave a bad copy that looks complete
+        fprintf(stderr, "%s rejected\n", output_name);
+        unlink(output_name);
+        if(basis_fd >= 0) rename(basis_name, output_name); // the old copy is still good
+        return 1;
+    }
+    if(basis_fd >= 0) {
+        close(basis_fd);
+        unlink(basis_name);
+    }
+    if(tree_mode && tree_apply_modes(&tree) < 0) {
+        perror("Failed to set modes");
+        return 1;
+    }
 
     return 0;
 }
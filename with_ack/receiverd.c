@@ -0,0 +1,455 @@
+#define _GNU_SOURCE // recvmmsg/sendmmsg, fallocate, pthread_setaffinity_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <time.h>
+#include "packet.h"
+#include "timer.h"
+#include "lz.h"
+
+// Long-running receiver for any number of concurrent transfers, told apart
+// by the session ID in every header. Each of N workers binds its own socket
+// to the port with SO_REUSEPORT and is pinned to a core; the kernel hashes
+// a sender's address to one socket of the group, so a session lives on a
+// single worker and workers share nothing but the list of output names.
+//
+//   gcc -O2 -pthread receiverd.c -o receiverd
+//   ./receiverd [-t threads] [-b batch] <receiver_port> <drop_prob>
+
+#define MAX_WORKERS 64
+#define SESSION_TABLE 1024 // per worker, power of two
+#define MAX_ACTIVE_NAMES (MAX_WORKERS * SESSION_TABLE / 2)
+#define SESSION_IDLE_US 10000000ULL // a session silent this long is closed
+#define NAME_LEN 256
+#define CLOSED_IDS 256 // per worker: sessions just closed, whose late INITs are ignored
+
+typedef struct {
+    uint32_t id; // 0 marks a free entry
+    char name[NAME_LEN]; // output file, from the INIT
+    long f_size;
+    int fd;
+    long n_chunks, total_received;
+    long first_missing; // lowest chunk not yet on disk, to unwrap seqNums against
+    unsigned char *chunk_map; // one bit per chunk on disk
+    uint64_t started, last_seen;
+} Session;
+
+typedef struct {
+    int index;
+    int sockfd;
+    int batch;
+    float drop_prob;
+    unsigned seed;
+    int n_sessions;
+    Session sessions[SESSION_TABLE]; // open addressing, keyed by session ID
+    uint32_t closed[CLOSED_IDS]; // ring of recently closed session IDs
+    const char *closed_why[CLOSED_IDS]; // and how each ended, to answer its repeated EOTs
+    int n_closed;
+    unsigned char rx_buf[MAX_WINDOW][MAX_PACKET_SIZE];
+    struct sockaddr_in rx_addr[MAX_WINDOW];
+    struct iovec rx_iov[MAX_WINDOW];
+    struct mmsghdr rx_msgs[MAX_WINDOW];
+    unsigned char ack_buf[MAX_WINDOW][HEADER_SIZE];
+    struct iovec ack_iov[MAX_WINDOW];
+    struct mmsghdr ack_msgs[MAX_WINDOW];
+} Worker;
+
+FILE *log_fp;
+
+// output names in use by open sessions, across all workers
+pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+char *active_names[MAX_ACTIVE_NAMES];
+
+void log_session(const char *event, const Session *s) {
+    fprintf(log_fp, "[%ld] %s - session: %08x, file: %s, size: %ld\n", time(NULL), event, s->id, s->name, s->f_size);
+    fflush(log_fp);
+}
+
+int drop(unsigned *seed, float prob) {
+    return ((float)rand_r(seed) / RAND_MAX) < prob;
+}
+
+Session *session_find(Worker *w, uint32_t id) {
+    for(unsigned i = id & (SESSION_TABLE - 1); w->sessions[i].id; i = (i + 1) & (SESSION_TABLE - 1)) {
+        if(w->sessions[i].id == id) return &w->sessions[i];
+    }
+    return NULL;
+}
+
+// New entry for id, or NULL once the table is 3/4 full
+Session *session_open(Worker *w, uint32_t id) {
+    if(w->n_sessions >= SESSION_TABLE * 3 / 4) return NULL;
+    unsigned i = id & (SESSION_TABLE - 1);
+    while(w->sessions[i].id) i = (i + 1) & (SESSION_TABLE - 1);
+    Session *s = &w->sessions[i];
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->f_size = -1;
+    s->fd = -1;
+    s->started = s->last_seen = now_us();
+    w->n_sessions++;
+    return s;
+}
+
+// Backward-shift delete, so lookups never need tombstones
+void session_remove(Worker *w, Session *s) {
+    unsigned i = s - w->sessions, j = i;
+    w->sessions[i].id = 0;
+    while(1) {
+        j = (j + 1) & (SESSION_TABLE - 1);
+        if(!w->sessions[j].id) break;
+        unsigned home = w->sessions[j].id & (SESSION_TABLE - 1);
+        // entry j may move into the hole at i unless its home lies cyclically in (i, j]
+        int stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+        if(!stays) {
+            w->sessions[i] = w->sessions[j];
+            w->sessions[j].id = 0;
+            i = j;
+        }
+    }
+    w->n_sessions--;
+}
+
+// Claims recv_<basename> for this session. Another open session already
+// writing that name gets the session ID appended instead of a shared file.
+// Returns 0, or -1 with errno set: ENOMEM, or EBUSY when every name slot
+// is in use (an unregistered name could be handed out twice).
+int claim_name(Session *s, const char *fname) {
+    const char *base = strrchr(fname, '/');
+    base = base ? base + 1 : fname;
+    snprintf(s->name, sizeof(s->name), "recv_%s", base);
+
+    pthread_mutex_lock(&names_lock);
+    int free_slot = -1, taken = 0;
+    for(int i = 0; i < MAX_ACTIVE_NAMES; i++) {
+        if(!active_names[i]) {
+            if(free_slot < 0) free_slot = i;
+        } else if(strcmp(active_names[i], s->name) == 0) {
+            taken = 1;
+        }
+    }
+    if(taken) {
+        size_t len = strlen(s->name);
+        if(len > sizeof(s->name) - 10) len = sizeof(s->name) - 10;
+        snprintf(s->name + len, sizeof(s->name) - len, ".%08x", s->id);
+    }
+    int err = 0;
+    if(free_slot < 0) errno = EBUSY;
+    if(free_slot < 0 || !(active_names[free_slot] = strdup(s->name))) { // sessions move around the table, so keep a copy
+        s->name[0] = '\0'; // not ours to release
+        err = -1;
+    }
+    pthread_mutex_unlock(&names_lock);
+    return err;
+}
+
+void release_name(Session *s) {
+    pthread_mutex_lock(&names_lock);
+    for(int i = 0; i < MAX_ACTIVE_NAMES; i++) {
+        if(active_names[i] && strcmp(active_names[i], s->name) == 0) {
+            free(active_names[i]);
+            active_names[i] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&names_lock);
+}
+
+// Preallocates the file and the chunk bitmap
+int session_start(Session *s) {
+    s->fd = open(s->name, O_RDWR | O_CREAT | O_TRUNC, 0644); // read back for the digest check
+    if(s->fd < 0) return -1;
+    if(s->f_size > 0 && fallocate(s->fd, 0, 0, s->f_size) < 0 && ftruncate(s->fd, s->f_size) < 0) return -1;
+    s->n_chunks = s->f_size / MAX_DATA_SIZE + 1;
+    s->chunk_map = calloc((s->n_chunks + 7) / 8, 1);
+    if(!s->chunk_map) return -1;
+    log_session("START", s);
+    return 0;
+}
+
+void session_close(Worker *w, Session *s, const char *why) {
+    double secs = (now_us() - s->started) / 1e6;
+    printf("[worker %d] session %08x %s: %s, %ld/%ld bytes in %.3f s (%.1f Mbit/s)\n", w->index, s->id, why,
+           s->name[0] ? s->name : "-", s->total_received, s->f_size, secs, secs > 0 ? s->total_received * 8 / secs / 1e6 : 0.0);
+    fflush(stdout);
+    log_session(why, s);
+    if(s->fd >= 0) close(s->fd);
+    free(s->chunk_map);
+    if(s->name[0]) release_name(s);
+    w->closed_why[w->n_closed % CLOSED_IDS] = why;
+    w->closed[w->n_closed++ % CLOSED_IDS] = s->id;
+    session_remove(w, s);
+}
+
+// How a recently closed session ended, or NULL. A duplicate INIT that
+// arrives after its session closed must not open it again and truncate
+// the finished file, and a repeated EOT gets the same answer as the first.
+const char *closed_why(const Worker *w, uint32_t id) {
+    for(int i = 0; i < CLOSED_IDS; i++) {
+        if(w->closed[i] == id) return w->closed_why[i];
+    }
+    return NULL;
+}
+
+// Answers an INIT: accepted, or refused with the reason
+void send_accept(Worker *w, int i, uint32_t session, const char *refusal) {
+    Packet acc = { .type = TYPE_ACCEPT, .session = session };
+    if(refusal) acc.length = snprintf(acc.data, sizeof(acc.data), "%s", refusal);
+    send_packet(w->sockfd, &acc, &w->rx_addr[i], sizeof(w->rx_addr[i]));
+}
+
+// The sender repeats EOT until it is answered: echoed if the copy is
+// complete and checked out, else refused with how the session ended
+void answer_eot(Worker *w, int i, uint32_t session, const char *why) {
+    if(strcmp(why, "complete") != 0) {
+        send_accept(w, i, session, why);
+    } else if(!drop(&w->seed, w->drop_prob)) {
+        Packet echo = { .type = TYPE_EOT, .session = session };
+        send_packet(w->sockfd, &echo, &w->rx_addr[i], sizeof(w->rx_addr[i]));
+    }
+}
+
+// An INIT for a session this worker doesn't have: opens it, or refuses
+// what needs receiver's own loops
+void session_init(Worker *w, int i, const Packet *pkt) {
+    uint32_t flags;
+    FileRange range;
+    char fname[MAX_DATA_SIZE - INIT_HEADER + 1], why[64];
+    if(closed_why(w, pkt->session)) return;
+    if(decode_init((const char *)w->rx_buf[i] + HEADER_SIZE, pkt->length, &flags, &range, fname) < 0) {
+        send_accept(w, i, pkt->session, "invalid INIT");
+        return;
+    }
+    if(flags) { // NACK, delta, tree and stream
+        snprintf(why, sizeof(why), "%s%s%s%smode unsupported", flags & INIT_NACK ? "NACK " : "", flags & INIT_DELTA ? "DELTA " : "",
+                 flags & INIT_TREE ? "TREE " : "", flags & INIT_STREAM ? "STREAM " : "");
+        send_accept(w, i, pkt->session, why);
+        return;
+    }
+    if(range.length != range.f_size) { // one flow of a split transfer: that needs receiver -n
+        send_accept(w, i, pkt->session, "parallel flow unsupported");
+        return;
+    }
+    Session *s = session_open(w, pkt->session);
+    if(!s) {
+        send_accept(w, i, pkt->session, "too many sessions");
+        return;
+    }
+    log_session("OPEN", s);
+    if(claim_name(s, fname) < 0) {
+        int full = errno == EBUSY;
+        perror("Failed to claim the output name");
+        send_accept(w, i, pkt->session, full ? "too many open transfers" : "out of memory");
+        session_close(w, s, "failed");
+        return;
+    }
+    s->f_size = range.f_size;
+    if(session_start(s) < 0) {
+        perror("Failed to open output file");
+        send_accept(w, i, pkt->session, "can't open the output");
+        session_close(w, s, "failed");
+        return;
+    }
+    send_accept(w, i, pkt->session, NULL);
+}
+
+// One datagram; returns 1 if an ACK for it was queued at ack_msgs[n_acks]
+int handle_datagram(Worker *w, int i, int n_acks, uint64_t now) {
+    Packet pkt;
+    if(decode_header(w->rx_buf[i], w->rx_msgs[i].msg_len, &pkt) < 0 || pkt.session == 0) return 0;
+
+    Session *s = session_find(w, pkt.session);
+    if(!s) {
+        const char *why = closed_why(w, pkt.session);
+        if(pkt.type == TYPE_INIT) session_init(w, i, &pkt); // only an INIT opens a session
+        else if(pkt.type == TYPE_EOT && why) answer_eot(w, i, pkt.session, why); // our answer got lost
+        return 0;
+    }
+    s->last_seen = now;
+
+    const unsigned char *payload = w->rx_buf[i] + HEADER_SIZE;
+    if(pkt.type == TYPE_EOT) {
+        // all bytes in: read them back against the sender's digest, and drop
+        // a bad, unverifiable or partial copy; either way the sender is refused
+        uint64_t digest, length, ours;
+        const char *why = "complete";
+        if(s->total_received != s->f_size) {
+            why = "incomplete";
+            unlink(s->name);
+        } else if(decode_eot((const char *)payload, pkt.length, &digest, &length) < 0 ||
+                  digest_file(s->fd, 0, s->f_size, &ours) < 0 || ours != digest) {
+            why = "corrupt";
+            unlink(s->name);
+        }
+        session_close(w, s, why);
+        answer_eot(w, i, pkt.session, why);
+        return 0;
+    }
+    if(pkt.type == TYPE_INIT) { // ours got lost
+        send_accept(w, i, s->id, NULL);
+        return 0;
+    }
+    if(pkt.type != TYPE_DATA && pkt.type != TYPE_DATA_LZ) return 0;
+
+    Packet ack = { .type = TYPE_ACK, .ackNum = pkt.seqNum, .session = s->id };
+    long chunk = seq_unwrap(pkt.seqNum, FIRST_DATA_SEQ + s->first_missing) - FIRST_DATA_SEQ;
+    long offset = chunk * MAX_DATA_SIZE;
+    // a compressed payload covers ackNum bytes, several chunks (sender -z)
+    int len = pkt.type == TYPE_DATA_LZ ? pkt.ackNum : pkt.length;
+    if(chunk >= 0 && chunk < s->n_chunks && len >= 0 && len <= LZ_GROUP * MAX_DATA_SIZE && offset + len <= s->f_size &&
+       !(s->chunk_map[chunk / 8] >> (chunk % 8) & 1)) {
+        unsigned char inflated[LZ_GROUP * MAX_DATA_SIZE];
+        if(pkt.type == TYPE_DATA_LZ) {
+            if(lz_decompress(payload, pkt.length, inflated, sizeof(inflated)) != len) return 0; // no ACK: it comes again
+            payload = inflated;
+        }
+        if(pwrite(s->fd, payload, len, offset) != len) {
+            perror("Write failed");
+            session_close(w, s, "failed");
+            return 0;
+        }
+        int covered = len ? (len + MAX_DATA_SIZE - 1) / MAX_DATA_SIZE : 1;
+        for(long c = chunk; c < chunk + covered; c++) s->chunk_map[c / 8] |= 1 << (c % 8);
+        while(s->first_missing < s->n_chunks && s->chunk_map[s->first_missing / 8] >> (s->first_missing % 8) & 1) s->first_missing++;
+        s->total_received += len;
+    }
+    if(drop(&w->seed, w->drop_prob)) return 0;
+
+    encode_packet(&ack, w->ack_buf[n_acks]);
+    w->ack_msgs[n_acks].msg_hdr.msg_name = &w->rx_addr[i];
+    w->ack_msgs[n_acks].msg_hdr.msg_namelen = sizeof(w->rx_addr[i]);
+    return 1;
+}
+
+void *worker_main(void *arg) {
+    Worker *w = arg;
+    for(int i = 0; i < w->batch; i++) {
+        w->rx_iov[i].iov_base = w->rx_buf[i];
+        w->rx_iov[i].iov_len = MAX_PACKET_SIZE;
+        w->rx_msgs[i].msg_hdr.msg_name = &w->rx_addr[i];
+        w->rx_msgs[i].msg_hdr.msg_iov = &w->rx_iov[i];
+        w->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        w->ack_iov[i].iov_base = w->ack_buf[i];
+        w->ack_iov[i].iov_len = HEADER_SIZE;
+        w->ack_msgs[i].msg_hdr.msg_iov = &w->ack_iov[i];
+        w->ack_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t last_sweep = now_us();
+    while(1) {
+        for(int i = 0; i < w->batch; i++) w->rx_msgs[i].msg_hdr.msg_namelen = sizeof(w->rx_addr[i]);
+        // SO_RCVTIMEO bounds the wait, so idle sessions get swept on a quiet socket too
+        int n = recvmmsg(w->sockfd, w->rx_msgs, w->batch, MSG_WAITFORONE, NULL);
+        uint64_t now = now_us();
+
+        int n_acks = 0;
+        for(int i = 0; i < n; i++) n_acks += handle_datagram(w, i, n_acks, now);
+        if(n_acks > 0) send_batch(w->sockfd, w->ack_msgs, n_acks);
+
+        if(now - last_sweep > SESSION_IDLE_US / 10) {
+            last_sweep = now;
+            for(int i = 0; i < SESSION_TABLE; i++) {
+                Session *s = &w->sessions[i];
+                if(s->id && now - s->last_seen > SESSION_IDLE_US) {
+                    if(s->total_received != s->f_size) unlink(s->name); // not to pass for the whole file
+                    session_close(w, s, s->total_received == s->f_size ? "complete (no EOT)" : "expired");
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t threads] [-b batch] <receiver_port> <drop_prob>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_workers = n_cpus, batch = DEFAULT_BATCH;
+    int opt;
+    while((opt = getopt(argc, argv, "t:b:")) != -1) {
+        switch(opt) {
+            case 't': n_workers = atoi(optarg); break;
+            case 'b': batch = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if(argc - optind != 2) usage(argv[0]);
+    if(n_workers < 1 || n_workers > MAX_WORKERS) {
+        fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_WORKERS);
+        exit(1);
+    }
+    if(batch < 1 || batch > MAX_WINDOW) {
+        fprintf(stderr, "Batch size must be between 1 and %d\n", MAX_WINDOW);
+        exit(1);
+    }
+    argv += optind - 1;
+
+    int receiver_port = atoi(argv[1]);
+    float drop_prob = atof(argv[2]);
+
+    log_fp = fopen("udp_logs", "a");
+    if(!log_fp) {
+        perror("Failed to open log file");
+        exit(1);
+    }
+
+    // bind the whole SO_REUSEPORT group before any worker runs, so the
+    // kernel's hash spreads senders over every socket from the start
+    Worker *workers = calloc(n_workers, sizeof(Worker));
+    if(!workers) {
+        perror("calloc failed");
+        exit(1);
+    }
+    struct sockaddr_in receiver_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(receiver_port),
+        .sin_addr.s_addr = INADDR_ANY
+    };
+    for(int i = 0; i < n_workers; i++) {
+        Worker *w = &workers[i];
+        w->index = i;
+        w->batch = batch;
+        w->drop_prob = drop_prob;
+        w->seed = time(NULL) ^ (i * 2654435761u);
+        w->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        int one = 1, rcvbuf = SOCKET_BUFFER_SIZE;
+        struct timeval tv = { .tv_sec = 1 };
+        setsockopt(w->sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        setsockopt(w->sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        setsockopt(w->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if(bind(w->sockfd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) < 0) {
+            perror("bind failed");
+            exit(1);
+        }
+    }
+
+    for(int i = 0; i < n_workers; i++) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % n_cpus, &cpus);
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        if(pthread_create(&thread, &attr, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start worker %d\n", i);
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    printf("Listening on port %d with %d worker(s)\n", receiver_port, n_workers);
+    fflush(stdout);
+
+    pause(); // workers run until the process is killed
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -6,24 +7,141 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
+#include <poll.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "packet.h"
+#include "timer.h"
+#include "uring.h"
+#include "cc.h"
+#include "lz.h"
+#include "delta.h"
+#include "tree.h"
+#include "evlog.h"
+#include "metrics.h"
 
-#define TIMEOUT_INTERVAL 3
+#define ACK_RECVS 32 // receives kept posted for ACKs (uring engine)
+#define PACE_TIMER MAX_WINDOW // timer id for "the pacer allows the next send"
+#define INIT_TIMER (MAX_WINDOW + 1) // timer id for "resend the INIT"
+#define INIT_TRIES 8
+#define INIT_RIDE 4 // ACK mode: data chunks sent behind the INIT before its ACCEPT
+#define MAX_STREAMS 16
+#define NACK_DEFAULT_RATE 200 // Mbit/s
+#define EOT_TRIES 10 // EOT resends before giving up on the receiver
+#define VERIFY_BYTES_PER_US 50 // and not before it could have read its copy back at 50 MB/s
+#define LZ_BYPASS 32 // -z: chunks sent raw without trying after one that didn't shrink
+#define LZ_STAGE (64 * 1024) // -z read-ahead
+#define READ_AHEAD (64 * 1024) // sync engine, without -z
 
-int waiting_ack = 0;
-int sockfd;
-struct sockaddr_in receiver_addr;
-socklen_t addrlen = sizeof(receiver_addr);
-Packet last_packet;
-FILE *log_fp;
+// uring engine: fixed file indices and user_data op kinds
+enum { FILE_SOCK, FILE_INPUT, FILE_TIMER };
+enum { OP_READ, OP_SEND, OP_RECV, OP_TIMER };
 
-void print_progress_bar(int sent_bytes, int total_bytes) {
+// per-packet retransmit state, indexed by seqNum % MAX_WINDOW
+typedef struct {
+    Packet pkt;
+    unsigned char wire[MAX_PACKET_SIZE]; // encoded once, reused for retransmits
+    int wire_len;
+    int raw_len; // file bytes carried, more than pkt.length when compressed
+    int acked;
+    int retries;
+    uint64_t sent_at; // us, for RTT samples
+    int inflight; // uring ops still reading into or sending from wire
+    uint64_t delivered, delivered_at; // delivery counters when first sent, for rate samples
+} Slot;
+
+// A file can go out as up to MAX_STREAMS parallel flows, one thread each,
+// every flow a complete transfer of its own byte range: own ports, own
+// session and sequence space, own window, timers and congestion state.
+// Everything per flow is therefore thread-local.
+typedef struct {
+    pthread_t thread;
+    int index, sender_port, receiver_port;
+    FileRange range;
+} Flow;
+
+__thread int sockfd;
+__thread struct sockaddr_in receiver_addr;
+__thread socklen_t addrlen = sizeof(receiver_addr);
+__thread Slot window[MAX_WINDOW];
+__thread struct mmsghdr tx_msgs[MAX_WINDOW];
+__thread struct iovec tx_iov[MAX_WINDOW];
+__thread TimerQueue timers; // one retransmit timer per slot, keyed by slot index
+__thread RttEstimator rtt;
+__thread uint32_t session; // random per flow, carried in every packet
+__thread Packet init_pkt; // resent until accepted
+__thread int accepted, init_tries;
+__thread uint64_t init_sent_at, init_due;
+
+// congestion control: cc.cwnd and cc.pacing_rate gate new packets
+__thread CcState cc;
+__thread Pacer pacer;
+__thread int in_flight; // sent and not yet acked
+__thread int flow_index; // slot in metrics.flow
+__thread uint64_t delivered, delivered_at; // wire bytes acked so far, and when the last were
+__thread uint64_t round_end; // `delivered` value that closes the current round trip
+
+// -z: file bytes read ahead of the window, lz_stage[lz_head..lz_tail), to be packed into datagrams
+__thread unsigned char lz_stage[LZ_STAGE];
+__thread int lz_head, lz_tail, lz_bypass;
+
+// whole chunks of the range the receiver kept from an earlier attempt (TYPE_RESUME), never sent
+__thread unsigned char *held;
+__thread long full_chunks; // range length / MAX_DATA_SIZE; the final short chunk always goes
+
+// sync engine: the next unread byte, and READ_AHEAD bytes of the stream from ahead_at
+__thread TreeCursor cursor = { -1, -1 };
+__thread long read_at, range_end;
+__thread unsigned char ahead[READ_AHEAD];
+__thread long ahead_at, ahead_len;
+
+// a stream: read as it comes (stream_fill), digested on the way in
+__thread int input_eof;
+__thread Digest stream_digest;
+
+// -d: stretches of the range the receiver's old copy already has, sorted; run_at is the first not yet behind next_seq
+__thread DeltaRun *runs;
+__thread int n_runs, run_at;
+
+__thread Uring ring;
+__thread unsigned char ack_rx[ACK_RECVS][MAX_PACKET_SIZE];
+__thread uint64_t expirations;
+
+// shared by all flows
+int log_sample = 1; // -l: keep every nth event in udp_logs.bin, 0 for none
+const char *metrics_file; // -M
+long total_sent, f_size; // total_sent is summed atomically across flows; f_size is -1 for a stream
+uint64_t f_mtime; // ns, goes out with the size so the receiver can tell a resume from a new file
+Tree source; // what the flows read: the file, or a directory's manifest and files (tree.h)
+int tree_mode;
+int streaming, input_fd = -1, input_flags; // input from a pipe or stdin ("-"), length unknown until it ends
+double ack_drop_prob, timeout;
+const char *filename, *receiver_ip;
+int window_size = DEFAULT_WINDOW, batch = DEFAULT_BATCH;
+const CcOps *cc_ops;
+int nack_mode, compress, delta;
+uint64_t max_rate = NACK_DEFAULT_RATE * 125000ULL; // NACK mode ceiling, bytes/s
+int want_uring;
+__thread int use_uring; // per flow: one may fall back to sync on its own
+
+void print_progress_bar(long sent_bytes, long total_bytes) {
     const int bar_width = 50;
+    if(!progress_due(sent_bytes, total_bytes)) return;
+    if(total_bytes < 0) { // a stream: nothing to measure against
+        printf("\r%ld bytes", sent_bytes);
+        fflush(stdout);
+        return;
+    }
     float percentage = (float)sent_bytes*1.0 / total_bytes;
     int pos = (int)(bar_width * percentage);
 
+    flockfile(stdout); // flows report from their own threads
     printf("\r[");
     for(int i = 0; i < bar_width; ++i) {
         if(i < pos) printf("#");
@@ -31,22 +149,111 @@ void print_progress_bar(int sent_bytes, int total_bytes) {
     }
     printf("] %3d%%", (int)(percentage * 100));
     fflush(stdout);
+    funlockfile(stdout);
 }
 
 void log_event(const char* event, Packet *pkt) {
-    time_t now = time(NULL);
-    fprintf(log_fp, "[%ld] %s - type: %d, seqNum: %d, ackNum: %d, len: %d\n",
-            now, event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
-    fflush(log_fp);
+    evlog(event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
+}
+
+// hand slot->wire to the ring; the slot can't be refilled until the send completes
+void queue_send(Slot *slot, int id) {
+    if(!uring_prep(&ring, IORING_OP_SEND, FILE_SOCK, slot->wire, slot->wire_len, 0, URING_DATA(OP_SEND, id))) {
+        perror("io_uring submit failed");
+        exit(1);
+    }
+    slot->inflight++;
 }
 
-void handle_timeout(int sig) {
-    if(waiting_ack) {
-        fprintf(log_fp, "Timeout occurred. Retransmitting packet %d...\n", last_packet.seqNum);
-        fflush(log_fp);
-        sendto(sockfd, &last_packet, sizeof(last_packet), 0, (struct sockaddr *)&receiver_addr, addrlen);
-        log_event("RETRANSMIT", &last_packet);
-        alarm(TIMEOUT_INTERVAL);
+void post_recv(int op, int idx, void *buf, unsigned len) {
+    int file = op == OP_TIMER ? FILE_TIMER : FILE_SOCK;
+    if(!uring_prep(&ring, op == OP_TIMER ? IORING_OP_READ : IORING_OP_RECV, file, buf, len, 0, URING_DATA(op, idx))) {
+        perror("io_uring submit failed");
+        exit(1);
+    }
+}
+
+// room for one more new packet: a free slot, congestion window and pacer
+// all allow it, and until the ACCEPT only the first few chunks go
+int can_send(long base, long next_seq, int window_size, uint64_t now) {
+    return (accepted || next_seq < FIRST_DATA_SEQ + INIT_RIDE) && next_seq < base + window_size && in_flight < cc.cwnd && pacer_ready(&pacer, cc.pacing_rate, now);
+}
+
+// bookkeeping for a packet going out for the first time
+void on_send(Slot *slot, uint64_t now) {
+    if(!delivered_at) delivered_at = now;
+    slot->delivered = delivered;
+    slot->delivered_at = delivered_at;
+    in_flight++;
+    metrics_add(&metrics.packets, 1);
+    pacer_sent(&pacer, cc.pacing_rate, now, slot->wire_len);
+}
+
+// (Re)sends the INIT, the next try due a backed-off RTO later; gives up
+// after INIT_TRIES
+void send_init(void) {
+    if(init_tries == INIT_TRIES) {
+        fprintf(stderr, "No answer from receiver. Aborting.\n");
+        exit(1);
+    }
+    if(send_packet(sockfd, &init_pkt, &receiver_addr, addrlen) < 0) {
+        perror("Sendto failed.");
+        exit(1);
+    }
+    log_event("SEND INIT", &init_pkt);
+    init_sent_at = now_us();
+    init_due = init_sent_at + rtt_backoff(&rtt, init_tries++);
+    timer_set(&timers, INIT_TIMER, init_due);
+}
+
+// TYPE_ACCEPT: the receiver took the INIT, or refused it with a reason
+void handle_accept(const Packet *pkt, const unsigned char *payload) {
+    if(pkt->session != session) return;
+    if(pkt->length > 0) {
+        fprintf(stderr, "Receiver refused: %.*s\n", pkt->length, payload);
+        exit(1);
+    }
+    if(accepted) return;
+    log_event("RECV ACCEPT", (Packet *)pkt);
+    accepted = 1;
+    timer_cancel(&timers, INIT_TIMER);
+    if(init_tries == 1) { // Karn
+        rtt_sample(&rtt, now_us() - init_sent_at);
+        metrics_rtt(now_us() - init_sent_at);
+    }
+}
+
+// this flow's congestion state, for -M
+void update_gauges(void) {
+    metrics.flow[flow_index].cwnd = cc.cwnd;
+    metrics.flow[flow_index].in_flight = in_flight;
+    metrics.flow[flow_index].srtt = rtt.srtt;
+    metrics.flow[flow_index].rto = rtt.rto;
+    metrics.flow[flow_index].pacing_rate = cc.pacing_rate;
+}
+
+// resend every packet whose deadline has passed
+void retransmit_expired(void) {
+    uint64_t now = now_us();
+    int id;
+    while((id = timer_pop_expired(&timers, now)) >= 0) {
+        if(id == PACE_TIMER) continue; // just wakes the fill loop
+        if(id == INIT_TIMER) {
+            send_init();
+            continue;
+        }
+        Slot *slot = &window[id];
+        cc_ops->on_loss(&cc, now, slot->sent_at);
+        log_event("TIMEOUT", &slot->pkt);
+        if(use_uring) queue_send(slot, id);
+        else sendto(sockfd, slot->wire, slot->wire_len, 0, (struct sockaddr *)&receiver_addr, addrlen);
+        log_event("RETRANSMIT", &slot->pkt);
+        metrics_add(&metrics.timeouts, 1);
+        metrics_add(&metrics.retransmits, 1);
+        pacer_sent(&pacer, cc.pacing_rate, now, slot->wire_len);
+        slot->retries++;
+        slot->sent_at = now;
+        timer_set(&timers, id, now + rtt_backoff(&rtt, slot->retries));
     }
 }
 
@@ -54,27 +261,569 @@ int drop(float prob) {
     return ((float)rand() / RAND_MAX) < prob;
 }
 
-int main(int argc, char *argv[]) {
-    if(argc != 7) {
-        fprintf(stderr, "Usage: %s <sender_port> <receiver_ip> <receiver_port> <timeout> <filename> <prob>\n", argv[0]);
+// mark one ACK and slide the window; shared by both engines
+void handle_ack(Packet *ack, long *base, long next_seq) {
+    if(ack->type != TYPE_ACK || ack->session != session) return;
+    if(!accepted) { // its ACCEPT got lost, but the INIT did arrive
+        accepted = 1;
+        timer_cancel(&timers, INIT_TIMER);
+    }
+    long seq = seq_unwrap(ack->ackNum, *base);
+    if(seq < *base || seq >= next_seq) return;
+    if(drop(ack_drop_prob)) {
+        log_event("DROP ACK", ack);
+        return;
+    }
+
+    Slot *slot = &window[seq % MAX_WINDOW];
+    if(slot->acked) {
+        metrics_add(&metrics.duplicates, 1);
+        return;
+    }
+    log_event("RECV ACK", ack);
+    slot->acked = 1;
+    timer_cancel(&timers, seq % MAX_WINDOW);
+
+    uint64_t now = now_us();
+    CcSample sample = { .now = now };
+    if(slot->retries == 0) { // Karn: skip retransmitted packets
+        sample.rtt = now - slot->sent_at;
+        rtt_sample(&rtt, sample.rtt);
+        metrics_rtt(sample.rtt);
+    }
+    sample.srtt = rtt.has_sample ? rtt.srtt : 0;
+    delivered += slot->wire_len;
+    delivered_at = now;
+    if(now > slot->delivered_at) sample.delivery_rate = (delivered - slot->delivered) * 1000000ULL / (now - slot->delivered_at);
+    if(slot->delivered >= round_end) { // sent after the previous round closed
+        sample.round_start = 1;
+        round_end = delivered;
+    }
+    sample.in_flight = --in_flight;
+    cc_ops->on_ack(&cc, &sample);
+    update_gauges();
+
+    metrics_add(&metrics.bytes, slot->raw_len);
+    print_progress_bar(__atomic_add_fetch(&total_sent, slot->raw_len, __ATOMIC_RELAXED), f_size);
+
+    while(*base < next_seq && window[*base % MAX_WINDOW].acked) (*base)++;
+}
+
+int is_held(long seq) {
+    long c = seq - FIRST_DATA_SEQ;
+    return c >= 0 && c < full_chunks && held[c / 8] >> (c % 8) & 1;
+}
+
+// TYPE_RESUME: remember what not to send. Chunks already sent just get
+// their ACKs or NACK confirmation like any other.
+void apply_resume(const Packet *pkt, const unsigned char *payload) {
+    if(pkt->session != session) return;
+    log_event("RECV RESUME", (Packet *)pkt);
+    for(int i = 0; i < pkt->length / 8; i++) {
+        int first, last;
+        nack_get_range(payload, i, &first, &last);
+        for(long seq = first < FIRST_DATA_SEQ ? FIRST_DATA_SEQ : first; seq <= last && seq - FIRST_DATA_SEQ < full_chunks; seq++) {
+            long c = seq - FIRST_DATA_SEQ;
+            held[c / 8] |= 1 << (c % 8);
+        }
+    }
+}
+
+// NACK mode and -d: nothing goes until the ACCEPT is in
+void handshake(void) {
+    while(!accepted) {
+        uint64_t now = now_us();
+        if(now >= init_due) {
+            send_init();
+            continue;
+        }
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if(poll(&pfd, 1, (init_due - now) / 1000 + 1) <= 0) continue;
+        Packet pkt;
+        if(recv_packet(sockfd, &pkt, &receiver_addr, &addrlen) < 0) continue;
+        if(pkt.type == TYPE_ACCEPT) handle_accept(&pkt, (unsigned char *)pkt.data);
+        else if(pkt.type == TYPE_RESUME) apply_resume(&pkt, (unsigned char *)pkt.data);
+    }
+}
+
+// len bytes of the stream at off, or exit. A piped input's are in the
+// read-ahead buffer already.
+void read_source(unsigned char *buf, long len, long off) {
+    if(streaming) {
+        memcpy(buf, ahead + (off - ahead_at), len);
+        return;
+    }
+    if(tree_io(&source, &cursor, buf, len, off, 0) < 0) {
+        fprintf(stderr, "Failed to read %s: %s\n", cursor.idx >= 0 ? source.entries[cursor.idx].path : filename,
+                errno == EIO ? "file changed" : strerror(errno));
         exit(1);
     }
+}
 
-    int sender_port = atoi(argv[1]);
-    char *receiver_ip = argv[2];
-    int receiver_port = atoi(argv[3]);
-    int timeout = atoi(argv[4]);
-    char *filename = argv[5];
-    double ack_drop_prob = atof(argv[6]);
+// sync engine: the next len bytes of the range (at most a chunk), through
+// the read-ahead buffer, so a run of small files is one pass over them
+void read_chunk(unsigned char *buf, long len) {
+    if(!streaming && (read_at < ahead_at || read_at + len > ahead_at + ahead_len)) {
+        ahead_at = read_at;
+        ahead_len = range_end - read_at < READ_AHEAD ? range_end - read_at : READ_AHEAD;
+        read_source(ahead, ahead_len, ahead_at);
+    }
+    memcpy(buf, ahead + (read_at - ahead_at), len);
+    read_at += len;
+}
+
+// Piped input: whatever the producer has written so far, read without
+// blocking into the read-ahead buffer behind what is still unread
+void stream_fill(void) {
+    if(input_eof) return;
+    if(read_at > ahead_at) {
+        memmove(ahead, ahead + (read_at - ahead_at), ahead_at + ahead_len - read_at);
+        ahead_len -= read_at - ahead_at;
+        ahead_at = read_at;
+    }
+    while(ahead_len < READ_AHEAD) {
+        ssize_t n = read(input_fd, ahead + ahead_len, READ_AHEAD - ahead_len);
+        if(n > 0) {
+            digest_update(&stream_digest, ahead + ahead_len, n);
+            ahead_len += n;
+        } else if(n == 0) {
+            input_eof = 1;
+            break;
+        } else if(errno == EAGAIN) {
+            break;
+        } else if(errno != EINTR) {
+            perror("Failed to read input");
+            exit(1);
+        }
+    }
+}
 
-    int total_sent = 0, f_size;
+// sync engine: whether the next chunk can be read. A file's always can;
+// piped input needs a whole chunk buffered or its end, and *unread becomes
+// what is buffered.
+int input_ready(long *unread) {
+    if(!streaming) return 1;
+    stream_fill();
+    *unread = ahead_at + ahead_len - read_at;
+    return input_eof || *unread + lz_tail - lz_head >= MAX_DATA_SIZE;
+}
 
-    signal(SIGALRM, handle_timeout);
-    srand(time(NULL));
+// sync engine: steps past a held chunk, out of the -z stage first
+void skip_chunk(long *unread) {
+    int staged = lz_tail - lz_head < MAX_DATA_SIZE ? lz_tail - lz_head : MAX_DATA_SIZE;
+    lz_head += staged;
+    read_at += MAX_DATA_SIZE - staged;
+    *unread -= MAX_DATA_SIZE - staged;
+}
 
-    log_fp = fopen("udp_logs", "a");
-    if(!log_fp) {
-        perror("Failed to open log file");
+// -d: collects the receiver's block signatures (TYPE_SIG) and matches the
+// range against them. Once some have come, the rest get an RTO; with none
+// at all the INIT is resent a few times before everything goes as data.
+void match_basis(const FileRange *range) {
+    BlockSig *sigs = NULL;
+    unsigned char *valid = NULL;
+    int total = -1, got = 0;
+    for(int tries = 0; total < 0 || got < total; ) {
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if(poll(&pfd, 1, (total < 0 ? rtt_backoff(&rtt, tries) : rtt.rto) / 1000 + 1) <= 0) {
+            if(total >= 0) break;
+            if(++tries == INIT_TRIES) {
+                fprintf(stderr, "No signatures from the receiver, sending everything\n");
+                return;
+            }
+            send_packet(sockfd, &init_pkt, &receiver_addr, addrlen); // the receiver answers it with the signatures
+            continue;
+        }
+        Packet pkt;
+        if(recv_packet(sockfd, &pkt, &receiver_addr, &addrlen) < 0 || pkt.session != session) continue;
+        if(pkt.type == TYPE_RESUME) apply_resume(&pkt, (unsigned char *)pkt.data);
+        if(pkt.type != TYPE_SIG || pkt.length < 4) continue;
+        uint32_t block;
+        memcpy(&block, pkt.data, 4);
+        if(ntohl(block) != DELTA_BLOCK) {
+            fprintf(stderr, "Receiver signs %u-byte blocks, not %d: sending everything\n", ntohl(block), DELTA_BLOCK);
+            break;
+        }
+        if(total < 0) {
+            if(pkt.ackNum < 0 || pkt.ackNum > DELTA_MAX_BLOCKS) {
+                fprintf(stderr, "Receiver claims %d block signatures: sending everything\n", pkt.ackNum);
+                break;
+            }
+            total = pkt.ackNum;
+            sigs = malloc((total + 1) * sizeof(*sigs));
+            valid = calloc(total + 1, 1);
+            if(!sigs || !valid) {
+                perror("Out of memory");
+                exit(1);
+            }
+        }
+        for(int i = 0; i < (pkt.length - 4) / 12; i++) {
+            long k = (long)pkt.seqNum + i;
+            if(k < 0 || k >= total || valid[k]) continue;
+            sig_get((unsigned char *)pkt.data, i, &sigs[k].weak, &sigs[k].strong);
+            valid[k] = 1;
+            got++;
+        }
+    }
+
+    if(got > 0 && range->length > 0) {
+        DeltaIndex ix;
+        long page = sysconf(_SC_PAGESIZE), map_off = range->offset / page * page;
+        int fd = open(filename, O_RDONLY);
+        unsigned char *map = fd < 0 ? MAP_FAILED : mmap(NULL, range->offset - map_off + range->length, PROT_READ, MAP_PRIVATE, fd, map_off);
+        if(fd >= 0) close(fd);
+        if(map == MAP_FAILED || delta_index_init(&ix, sigs, valid, total) < 0) {
+            perror("Delta matching failed, sending everything");
+        } else {
+            madvise(map, range->offset - map_off + range->length, MADV_SEQUENTIAL);
+            n_runs = delta_match(&ix, map + (range->offset - map_off), range->length, &runs);
+            if(n_runs < 0) n_runs = 0;
+            long reused = 0;
+            for(int r = 0; r < n_runs; r++) reused += runs[r].length;
+            printf("Delta: %ld of %ld bytes already at the receiver (%d of %d block signatures)\n", reused, (long)range->length, got, total);
+            delta_index_free(&ix);
+        }
+        if(map != MAP_FAILED) munmap(map, range->offset - map_off + range->length);
+    }
+    free(sigs);
+    free(valid);
+}
+
+// -d: if the chunk at seq is made up entirely of basis bytes, fills pkt
+// with a DATA_REF for it and the whole chunks after it that are too (at
+// most max_chunks, and the segments one payload holds). Returns the chunks
+// covered, 0 if it has to go as data.
+int next_payload_ref(Packet *pkt, long seq, int max_chunks) {
+    long c = seq - FIRST_DATA_SEQ;
+    if(max_chunks > full_chunks - c) max_chunks = full_chunks - c;
+    long start = (long)c * MAX_DATA_SIZE, end = start, limit = start + (long)max_chunks * MAX_DATA_SIZE;
+    while(run_at < n_runs && runs[run_at].target + runs[run_at].length <= start) run_at++;
+    // gapless cover from start: each run has to begin where the last one ended
+    for(int r = run_at; r < n_runs && r - run_at < REF_MAX_SEGMENTS && runs[r].target <= end && end < limit; r++) {
+        end = runs[r].target + runs[r].length;
+    }
+    int chunks = ((end < limit ? end : limit) - start) / MAX_DATA_SIZE;
+    if(chunks <= 0) return 0;
+    end = start + (long)chunks * MAX_DATA_SIZE;
+    pkt->type = TYPE_DATA_REF;
+    pkt->ackNum = end - start;
+    pkt->length = 0;
+    for(int r = run_at; start < end; r++) {
+        long seg_end = runs[r].target + runs[r].length < end ? runs[r].target + runs[r].length : end;
+        ref_put_segment(pkt, runs[r].basis + (start - runs[r].target), seg_end - start);
+        start = seg_end;
+    }
+    return chunks;
+}
+
+// -z: fills pkt from the staged file bytes, packing as many whole chunks
+// (at most max_chunks) as compress into one payload. A chunk that doesn't
+// shrink goes out raw, and the next LZ_BYPASS chunks skip the attempt, so
+// media costs little more than without -z. Returns the chunks covered.
+int next_payload_lz(Packet *pkt, long *unread, int max_chunks) {
+    // top up once less than a full group is left; the move is at most a group
+    if(lz_tail - lz_head < LZ_GROUP * MAX_DATA_SIZE && *unread > 0) {
+        memmove(lz_stage, lz_stage + lz_head, lz_tail - lz_head);
+        lz_tail -= lz_head;
+        lz_head = 0;
+        long n = LZ_STAGE - lz_tail < *unread ? LZ_STAGE - lz_tail : *unread;
+        read_source(lz_stage + lz_tail, n, read_at);
+        read_at += n;
+        lz_tail += n;
+        *unread -= n;
+    }
+    // the short chunk that ends the input only once nothing more is to come
+    int lz_have = lz_tail - lz_head, more = *unread > 0 || (streaming && !input_eof);
+    int staged = (lz_have + (more ? 0 : MAX_DATA_SIZE - 1)) / MAX_DATA_SIZE;
+    int chunks = staged < max_chunks ? staged : max_chunks, raw = 0;
+    if(lz_bypass > 0) {
+        lz_bypass--;
+        chunks = 0;
+    }
+    while(chunks > 0) {
+        int consumed;
+        raw = chunks * MAX_DATA_SIZE < lz_have ? chunks * MAX_DATA_SIZE : lz_have;
+        pkt->length = lz_compress(lz_stage + lz_head, raw, (unsigned char *)pkt->data, MAX_DATA_SIZE, &consumed);
+        if(pkt->length > 0 && pkt->length < raw) break;
+        // retry with the chunks that got encoded before the payload filled up
+        int fit = consumed / MAX_DATA_SIZE;
+        chunks = fit < chunks - 1 ? fit : chunks - 1;
+        if(chunks == 0) lz_bypass = LZ_BYPASS;
+    }
+    if(chunks > 0) {
+        pkt->type = TYPE_DATA_LZ;
+        pkt->ackNum = raw;
+    } else {
+        raw = lz_have < MAX_DATA_SIZE ? lz_have : MAX_DATA_SIZE; // 0 only for the final empty chunk
+        pkt->type = TYPE_DATA;
+        pkt->ackNum = 0;
+        pkt->length = raw;
+        memcpy(pkt->data, lz_stage + lz_head, raw);
+        chunks = 1;
+    }
+    lz_head += raw;
+    return chunks;
+}
+
+// io_uring engine: the socket, the input file and the timerfd become fixed
+// files and every slot's wire buffer a registered buffer, so file chunks
+// are read straight into the frame behind an already written header.
+// Returns -1 (and the caller keeps the sync engine) if the kernel refuses.
+int setup_uring(int filefd, int tfd) {
+    if(uring_init(&ring, URING_ENTRIES) < 0) return -1;
+    int files[] = { [FILE_SOCK] = sockfd, [FILE_INPUT] = filefd, [FILE_TIMER] = tfd };
+    struct iovec bufs[MAX_WINDOW];
+    for(int i = 0; i < MAX_WINDOW; i++) {
+        bufs[i].iov_base = window[i].wire;
+        bufs[i].iov_len = MAX_PACKET_SIZE;
+    }
+    if(uring_register_files(&ring, files, 3) < 0 || uring_register_buffers(&ring, bufs, MAX_WINDOW) < 0) {
+        uring_exit(&ring);
+        return -1;
+    }
+    // sends go out without an address from here on
+    connect(sockfd, (struct sockaddr *)&receiver_addr, addrlen);
+    for(int i = 0; i < ACK_RECVS; i++) post_recv(OP_RECV, i, ack_rx[i], MAX_PACKET_SIZE);
+    post_recv(OP_TIMER, 0, &expirations, sizeof(expirations));
+    return 0;
+}
+
+// Backoff for an unanswered EOT, capped so the receiver still lingers
+// when the repeat comes
+uint64_t eot_backoff(int tries) {
+    uint64_t wait = rtt_backoff(&rtt, tries);
+    return wait < EOT_REPEAT_US ? wait : EOT_REPEAT_US;
+}
+
+// When to stop repeating an EOT first sent now: after EOT_TRIES, and not
+// while the receiver may still be reading length bytes back
+uint64_t eot_deadline(uint64_t length) {
+    return now_us() + EOT_LINGER_US + length / VERIFY_BYTES_PER_US;
+}
+
+// Every chunk is in by now, so EOT only waits on the receiver's digest
+// check. It goes again, backing off, until the receiver echoes it back;
+// a refusal exits through handle_accept.
+void confirm_eot(const Packet *eot, uint64_t length) {
+    uint64_t give_up = eot_deadline(length);
+    for(int tries = 0; tries < EOT_TRIES || now_us() < give_up; tries++) {
+        send_packet(sockfd, eot, &receiver_addr, addrlen);
+        log_event("SEND EOT", (Packet *)eot);
+        uint64_t until = now_us() + eot_backoff(tries);
+        for(uint64_t now = now_us(); now < until; now = now_us()) {
+            struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+            if(poll(&pfd, 1, (until - now) / 1000 + 1) <= 0) continue;
+            Packet pkt;
+            if(recv_packet(sockfd, &pkt, &receiver_addr, &addrlen) < 0 || pkt.session != session) continue;
+            if(pkt.type == TYPE_ACCEPT) handle_accept(&pkt, (unsigned char *)pkt.data);
+            if(pkt.type != TYPE_EOT) continue;
+            if(drop(ack_drop_prob)) {
+                log_event("DROP EOT", &pkt);
+                continue;
+            }
+            log_event("RECV EOT", &pkt);
+            return;
+        }
+    }
+    fprintf(stderr, "Receiver never confirmed the transfer. Aborting.\n");
+    exit(1);
+}
+
+// NACK mode (-m nack): no per-packet ACKs. New chunks stream out at a paced
+// rate, the receiver reports holes every few ms, and a hole is resent at
+// most once per RTO, ahead of new data. The rate drops by 1/8 on newly
+// reported loss, at most once per RTT, and creeps back towards -r while
+// NACKs come back clean. EOT is repeated until the receiver's NACK says
+// it has everything, then until it answers as in ACK mode; an answer to
+// an EOT whose final NACK got lost ends the transfer just the same.
+void send_nack(int tfd, const FileRange *range, uint64_t digest) {
+    long last_seq = FIRST_DATA_SEQ + range->length / MAX_DATA_SIZE;
+    long n = last_seq - FIRST_DATA_SEQ + 1;
+    uint64_t *sent_at = calloc(n, sizeof(*sent_at)); // per chunk, last send
+    unsigned char *resent = calloc(n, 1), *queued = calloc(n, 1);
+    long *repair = malloc(n * sizeof(*repair)); // ring of seqNums to resend; each is queued at most once
+    if(!sent_at || !resent || !queued || !repair) {
+        perror("Out of memory");
+        exit(1);
+    }
+    long rq_head = 0, rq_len = 0;
+    long next_seq = FIRST_DATA_SEQ, acked = FIRST_DATA_SEQ, highest = FIRST_DATA_SEQ - 1, highest_loss = 0;
+    int eot_tries = 0;
+    uint64_t rate = max_rate, eot_at = 0, eot_give_up = 0, last_cut = 0, armed = 0;
+    long reported = 0; // bytes already counted in total_sent
+    int confirmed = 0;
+    Packet eot = { .type = TYPE_EOT, .seqNum = last_seq, .session = session };
+    eot.length = encode_eot(digest, range->length, eot.data);
+
+    while(acked <= last_seq && !confirmed) {
+        uint64_t now = now_us();
+        int cnt = 0;
+        while(cnt < batch && (rq_len > 0 || next_seq <= last_seq) && pacer_ready(&pacer, rate, now)) {
+            long seq;
+            if(rq_len > 0) {
+                seq = repair[rq_head];
+                rq_head = (rq_head + 1) % n;
+                rq_len--;
+                queued[seq - FIRST_DATA_SEQ] = 0;
+                if(seq < acked) continue;
+                resent[seq - FIRST_DATA_SEQ] = 1;
+            } else {
+                while(is_held(next_seq)) next_seq++; // never the last chunk, so next_seq stays <= last_seq
+                seq = next_seq++;
+            }
+            Slot *slot = &window[cnt]; // staging only: sendmmsg copies before the slot is reused
+            long off = (long)(seq - FIRST_DATA_SEQ) * MAX_DATA_SIZE;
+            slot->pkt = (Packet){ .type = TYPE_DATA, .seqNum = seq, .session = session };
+            slot->pkt.length = range->length - off < MAX_DATA_SIZE ? range->length - off : MAX_DATA_SIZE;
+            encode_header(&slot->pkt, slot->wire);
+            read_source(slot->wire + HEADER_SIZE, slot->pkt.length, range->offset + off);
+            seal_packet(slot->wire, slot->pkt.length);
+            slot->wire_len = HEADER_SIZE + slot->pkt.length;
+            tx_iov[cnt].iov_base = slot->wire;
+            tx_iov[cnt].iov_len = slot->wire_len;
+            tx_msgs[cnt].msg_hdr.msg_name = &receiver_addr;
+            tx_msgs[cnt].msg_hdr.msg_namelen = addrlen;
+            tx_msgs[cnt].msg_hdr.msg_iov = &tx_iov[cnt];
+            tx_msgs[cnt].msg_hdr.msg_iovlen = 1;
+            cnt++;
+            sent_at[seq - FIRST_DATA_SEQ] = now;
+            pacer_sent(&pacer, rate, now, slot->wire_len);
+            log_event(resent[seq - FIRST_DATA_SEQ] ? "RETRANSMIT" : "SEND DATA", &slot->pkt);
+            metrics_add(resent[seq - FIRST_DATA_SEQ] ? &metrics.retransmits : &metrics.packets, 1);
+        }
+        if(cnt > 0) send_batch(sockfd, tx_msgs, cnt);
+
+        // everything sent once and no repairs pending: (re)send EOT until the receiver has it all
+        if(next_seq > last_seq && rq_len == 0 && now >= eot_at) {
+            if(eot_tries == 0) eot_give_up = eot_deadline(range->length);
+            if(eot_tries >= EOT_TRIES && now >= eot_give_up) {
+                fprintf(stderr, "Receiver never confirmed the transfer. Aborting.\n");
+                exit(1);
+            }
+            send_packet(sockfd, &eot, &receiver_addr, addrlen);
+            log_event("SEND EOT", &eot);
+            eot_at = now + eot_backoff(eot_tries++);
+        }
+
+        // wake for the pacer if there is more to send, else for the EOT timer
+        uint64_t deadline = rq_len > 0 || next_seq <= last_seq ? pacer.next_send : eot_at;
+        if(deadline <= now) deadline = now + 1;
+        if(deadline != armed) {
+            armed = deadline;
+            timer_arm_fd(tfd, armed);
+        }
+        struct pollfd fds[2] = {
+            { .fd = sockfd, .events = POLLIN },
+            { .fd = tfd, .events = POLLIN }
+        };
+        if(poll(fds, 2, -1) < 0) continue;
+        if(fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            read(tfd, &expirations, sizeof(expirations));
+            armed = 0;
+        }
+        if(!(fds[0].revents & POLLIN)) continue;
+
+        Packet nack;
+        if(recv_packet(sockfd, &nack, &receiver_addr, &addrlen) < 0) {
+            if(errno == EBADMSG) metrics_add(&metrics.bad, 1);
+            continue;
+        }
+        if(nack.session != session) continue;
+        if(nack.type == TYPE_RESUME) apply_resume(&nack, (unsigned char *)nack.data);
+        if(nack.type == TYPE_ACCEPT) handle_accept(&nack, (unsigned char *)nack.data); // a refusal exits
+        if(nack.type == TYPE_EOT && !drop(ack_drop_prob)) {
+            log_event("RECV EOT", &nack);
+            confirmed = 1;
+        }
+        if(nack.type != TYPE_NACK) continue;
+        if(drop(ack_drop_prob)) {
+            log_event("DROP NACK", &nack);
+            continue;
+        }
+        log_event("RECV NACK", &nack);
+        now = now_us();
+        // a new highest seqNum dates the report (an old one only ages
+        // with every periodic NACK); Karn as usual
+        long top = seq_unwrap(nack.seqNum, acked), cum = seq_unwrap(nack.ackNum, acked), h = top - FIRST_DATA_SEQ;
+        if(top > highest && h >= 0 && h < n && sent_at[h] && !resent[h]) {
+            rtt_sample(&rtt, now - sent_at[h]);
+            metrics_rtt(now - sent_at[h]);
+        }
+        if(top > highest) highest = top;
+        if(cum > acked) {
+            acked = cum;
+            long bytes = (long)(acked - FIRST_DATA_SEQ) * MAX_DATA_SIZE;
+            if(bytes < 0 || (uint64_t)bytes > range->length) bytes = range->length;
+            metrics_add(&metrics.bytes, bytes - reported);
+            print_progress_bar(__atomic_add_fetch(&total_sent, bytes - reported, __ATOMIC_RELAXED), f_size);
+            reported = bytes;
+            eot_tries = 0;
+        }
+
+        int new_loss = 0;
+        for(int i = 0; i < nack.length / 8; i++) {
+            int wire_first, wire_last;
+            nack_get_range((unsigned char *)nack.data, i, &wire_first, &wire_last);
+            long first = seq_unwrap(wire_first, acked), last = seq_unwrap(wire_last, acked);
+            if(first < acked) first = acked;
+            if(last >= next_seq) last = next_seq - 1;
+            if(last > highest_loss) {
+                new_loss = 1;
+                highest_loss = last;
+            }
+            for(long seq = first; seq <= last; seq++) {
+                long c = seq - FIRST_DATA_SEQ;
+                if(queued[c] || now - sent_at[c] < rtt.rto) continue; // a repair may still be on its way
+                queued[c] = 1;
+                repair[(rq_head + rq_len++) % n] = seq;
+            }
+        }
+        if(new_loss && now - last_cut > rtt.srtt) {
+            rate -= rate / 8;
+            if(rate < max_rate / 64) rate = max_rate / 64;
+            last_cut = now;
+        } else if(nack.length == 0) {
+            rate += max_rate / 32;
+            if(rate > max_rate) rate = max_rate;
+        }
+        // no window here: what the receiver hasn't confirmed, and the rate
+        metrics.flow[flow_index].in_flight = next_seq - acked;
+        metrics.flow[flow_index].srtt = rtt.srtt;
+        metrics.flow[flow_index].rto = rtt.rto;
+        metrics.flow[flow_index].pacing_rate = rate;
+    }
+    if(reported < (long)range->length) { // confirmed by the EOT answer, not a NACK
+        metrics_add(&metrics.bytes, range->length - reported);
+        print_progress_bar(__atomic_add_fetch(&total_sent, range->length - reported, __ATOMIC_RELAXED), f_size);
+    }
+    if(!confirmed) confirm_eot(&eot, range->length);
+    free(sent_at);
+    free(resent);
+    free(queued);
+    free(repair);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w window] [-b batch] [-e sync|uring] [-c fixed|cubic|bbr] [-n streams] [-m ack|nack] [-r mbit] [-z] [-d] [-l n] [-M metrics] <sender_port> <receiver_ip> <receiver_port> <timeout> <file|dir|-> <prob>\n", prog);
+    exit(1);
+}
+
+// One flow, start to EOT: sender_port -> receiver_port, carrying flow->range
+void *send_flow(void *arg) {
+    Flow *flow = arg;
+    FileRange *range = &flow->range;
+    flow_index = flow->index;
+    metrics_watch_port(flow_index, flow->sender_port);
+    metrics.flow[flow_index].active = 1;
+    use_uring = want_uring && !nack_mode && !compress && !delta && !tree_mode && !streaming; // NACK mode has its own sync loop, -z stages reads, -d skips them, a tree's chunks span files, a pipe has no offsets
+    while(!session) getrandom(&session, sizeof(session), 0);
+    rtt_init(&rtt, timeout * 1000000);
+    timer_init(&timers);
+    cc_ops->init(&cc);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, use_uring ? 0 : TFD_NONBLOCK); // io_uring would return EAGAIN on a non-blocking read
+    if(tfd < 0) {
+        perror("timerfd_create failed");
         exit(1);
     }
 
@@ -84,11 +833,15 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // a full window of ACKs can land at once
+    int rcvbuf = SOCKET_BUFFER_SIZE;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
     struct sockaddr_in sender_addr;
     memset(&sender_addr, 0, sizeof(sender_addr));
     sender_addr.sin_family = AF_INET;
     sender_addr.sin_addr.s_addr = INADDR_ANY;
-    sender_addr.sin_port = htons(sender_port);
+    sender_addr.sin_port = htons(flow->sender_port);
 
     if(bind(sockfd, (struct sockaddr *)&sender_addr, sizeof(sender_addr)) < 0) {
         perror("bind failed");
@@ -97,89 +850,401 @@ int main(int argc, char *argv[]) {
 
     memset(&receiver_addr, 0, sizeof(receiver_addr));
     receiver_addr.sin_family = AF_INET;
-    receiver_addr.sin_port = htons(receiver_port);
+    receiver_addr.sin_port = htons(flow->receiver_port);
 
     if(inet_pton(AF_INET, receiver_ip, &receiver_addr.sin_addr) <= 0) {
         perror("Invalid receiver IP");
         exit(1);
     }
 
-    Packet greet_pkt = {0};
-    greet_pkt.type = TYPE_DATA;
-    greet_pkt.seqNum = 0;
-    strcpy(greet_pkt.data, "Greeting");
-    int sent = sendto(sockfd, &greet_pkt, sizeof(greet_pkt), 0, (struct sockaddr *)&receiver_addr, addrlen);
-    if(sent < 0) {
-        perror("Sendto failed.");
+    // each flow reads through its own cursor, starting at its range
+    read_at = range->offset;
+    range_end = range->offset + range->length;
+    // goes out with EOT, for the receiver to check its copy of the range
+    // against; piped input is digested as it is read
+    uint64_t digest = 0;
+    digest_init(&stream_digest);
+    if(!streaming && tree_digest(&source, &cursor, range->offset, range->length, &digest) < 0) {
+        perror("Failed to read input file");
         exit(1);
     }
 
-    Packet ack_pkt = {0};
-    int recv_len = recvfrom(sockfd, &ack_pkt, sizeof(ack_pkt), 0, (struct sockaddr *)&receiver_addr, &addrlen);
-    if(recv_len < 0) {
-        perror("Recvfrom failed");
+    // everything the receiver needs to set up, in one frame it answers with an ACCEPT
+    char name[MAX_DATA_SIZE];
+    if(tree_mode) { // the directory's own name
+        const char *end = filename + strlen(filename), *base;
+        while(end > filename + 1 && end[-1] == '/') end--;
+        for(base = end; base > filename && base[-1] != '/'; base--);
+        snprintf(name, sizeof(name), "%.*s", (int)(end - base), base);
+    } else {
+        snprintf(name, sizeof(name), "%s", strcmp(filename, "-") == 0 ? "stdin" : filename);
+    }
+    uint32_t flags = (nack_mode ? INIT_NACK : 0) | (delta ? INIT_DELTA : 0) | (tree_mode ? INIT_TREE : 0) | (streaming ? INIT_STREAM : 0);
+    init_pkt = (Packet){ .type = TYPE_INIT, .seqNum = 0, .session = session };
+    if(encode_init(flags, range, name, &init_pkt) < 0) {
+        fprintf(stderr, "Name too long: %s\n", name);
         exit(1);
     }
-    if(ack_pkt.type != TYPE_ACK || strcmp(ack_pkt.data, "OK") != 0) {
-        fprintf(stderr, "Unexpected response. Aborting.\n");
+    full_chunks = streaming ? 0 : range->length / MAX_DATA_SIZE;
+    held = calloc(full_chunks / 8 + 1, 1);
+    if(!held) {
+        perror("Out of memory");
         exit(1);
     }
+    // in ACK mode the first chunks ride along behind the INIT, so a small
+    // file is done in one round trip; the other modes wait for the ACCEPT
+    send_init();
+    if(nack_mode || delta) handshake();
+    if(delta) match_basis(range);
 
-    Packet fname_pkt = {0};
-    fname_pkt.type = TYPE_DATA;
-    fname_pkt.seqNum = 1;
-    strncpy(fname_pkt.data, filename, MAX_DATA_SIZE);
-    sendto(sockfd, &fname_pkt, sizeof(fname_pkt), 0, (struct sockaddr *)&receiver_addr, addrlen);
+    if(nack_mode) {
+        send_nack(tfd, range, digest);
+        free(held);
+        tree_cursor_close(&cursor);
+        close(tfd);
+        close(sockfd);
+        return NULL;
+    }
 
-    FILE *fp = fopen(filename, "rb");
-    if(!fp) {
-        perror("fopen failed");
-        exit(1);
+    int filefd = use_uring ? open(filename, O_RDONLY) : -1;
+    if(use_uring && (filefd < 0 || setup_uring(filefd, tfd) < 0)) {
+        perror("io_uring unavailable, using the sync engine");
+        use_uring = 0;
     }
-    fseek(fp, 0L, SEEK_END);
-    f_size = ftell(fp);
-    rewind(fp);
-    sendto(sockfd, &f_size, sizeof(int), 0, (struct sockaddr *)&receiver_addr, addrlen);
 
-    int seq = 3;
-    while(1) {
-        Packet pkt = {0};
-        pkt.type = TYPE_DATA;
-        pkt.seqNum = seq;
-        pkt.length = fread(pkt.data, 1, MAX_DATA_SIZE, fp);
-        last_packet = pkt;
+    // selective repeat: keep up to window_size packets in flight, each with its own deadline
+    long base = FIRST_DATA_SEQ, next_seq = FIRST_DATA_SEQ, last_seq = -1;
+    long unread = streaming ? 0 : range->length; // sync engine: bytes of the range not yet read (piped: read and buffered)
+    int starved = 0; // sync engine: piped input ran dry, wait for it
+    if(use_uring) last_seq = FIRST_DATA_SEQ + range->length / MAX_DATA_SIZE; // chunks are read by offset, so the end is known up front
+    uint64_t armed = 0;
+    while(last_seq < 0 || base <= last_seq) {
+        uint64_t now = now_us();
+        // uring: header first, then a fixed-buffer read of the chunk; the
+        // send follows its completion, once the crc can be stamped
+        while(use_uring && next_seq <= last_seq && can_send(base, next_seq, window_size, now) && window[next_seq % MAX_WINDOW].inflight == 0) {
+            int id = next_seq % MAX_WINDOW;
+            Slot *slot = &window[id];
+            if(is_held(next_seq)) { // the receiver has it: the slot counts as acked
+                slot->acked = 1;
+                __atomic_add_fetch(&total_sent, MAX_DATA_SIZE, __ATOMIC_RELAXED);
+                next_seq++;
+                while(base < next_seq && window[base % MAX_WINDOW].acked) base++;
+                continue;
+            }
+            long off = (next_seq - FIRST_DATA_SEQ) * MAX_DATA_SIZE; // within the range
+            slot->pkt.type = TYPE_DATA;
+            slot->pkt.seqNum = next_seq;
+            slot->pkt.ackNum = 0;
+            slot->pkt.session = session;
+            slot->pkt.length = range->length - off < MAX_DATA_SIZE ? range->length - off : MAX_DATA_SIZE;
+            encode_header(&slot->pkt, slot->wire);
+            slot->wire_len = HEADER_SIZE + slot->pkt.length;
+            slot->raw_len = slot->pkt.length;
+            slot->acked = 0;
+            slot->retries = 0;
+            slot->sent_at = now;
+            timer_set(&timers, id, now + rtt.rto);
+
+            if(slot->pkt.length > 0) {
+                struct io_uring_sqe *sqe = uring_prep(&ring, IORING_OP_READ_FIXED, FILE_INPUT, slot->wire + HEADER_SIZE,
+                                                      slot->pkt.length, range->offset + off, URING_DATA(OP_READ, id));
+                if(!sqe) {
+                    perror("io_uring submit failed");
+                    exit(1);
+                }
+                sqe->buf_index = id;
+                slot->inflight++;
+            } else {
+                seal_packet(slot->wire, 0);
+                queue_send(slot, id);
+            }
+            on_send(slot, now);
+            log_event("SEND DATA", &slot->pkt);
+            next_seq++;
+        }
+
+        // sync: read and encode every free slot, then push them out batch at a time
+        int n = 0;
+        starved = 0;
+        while(!use_uring && last_seq < 0 && can_send(base, next_seq, window_size, now)) {
+            if(!input_ready(&unread)) {
+                starved = 1;
+                break;
+            }
+            Slot *slot = &window[next_seq % MAX_WINDOW];
+            if(is_held(next_seq)) {
+                skip_chunk(&unread);
+                slot->acked = 1;
+                __atomic_add_fetch(&total_sent, MAX_DATA_SIZE, __ATOMIC_RELAXED);
+                next_seq++;
+                while(base < next_seq && window[base % MAX_WINDOW].acked) base++;
+                continue;
+            }
+            int covers = 1, room = 1; // chunks in this datagram, and how many it may cover
+            slot->pkt.type = TYPE_DATA;
+            slot->pkt.seqNum = next_seq;
+            slot->pkt.ackNum = 0;
+            slot->pkt.session = session;
+            // a group stops short of held chunks and of slots still in use; its
+            // later seqNums never go out, so it may reach past the window
+            while((compress || n_runs) && room < base + MAX_WINDOW - next_seq && room < REF_GROUP && !is_held(next_seq + room)) room++;
+            if(n_runs && (covers = next_payload_ref(&slot->pkt, next_seq, room)) > 0) {
+                for(int c = 0; c < covers; c++) skip_chunk(&unread);
+                slot->raw_len = slot->pkt.ackNum;
+            } else if(compress) {
+                covers = next_payload_lz(&slot->pkt, &unread, room < LZ_GROUP ? room : LZ_GROUP);
+                slot->raw_len = slot->pkt.type == TYPE_DATA_LZ ? slot->pkt.ackNum : slot->pkt.length;
+            } else {
+                covers = 1;
+                slot->pkt.length = unread < MAX_DATA_SIZE ? unread : MAX_DATA_SIZE;
+                read_chunk((unsigned char *)slot->pkt.data, slot->pkt.length);
+                unread -= slot->pkt.length;
+                slot->raw_len = slot->pkt.length;
+            }
+            slot->wire_len = encode_packet(&slot->pkt, slot->wire);
+            slot->acked = 0;
+            slot->retries = 0;
+            slot->sent_at = now;
+            timer_set(&timers, next_seq % MAX_WINDOW, now + rtt.rto);
 
-        sendto(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&receiver_addr, addrlen);
-        waiting_ack = 1;
-        alarm(timeout);
+            tx_iov[n].iov_base = slot->wire;
+            tx_iov[n].iov_len = slot->wire_len;
+            tx_msgs[n].msg_hdr.msg_name = &receiver_addr;
+            tx_msgs[n].msg_hdr.msg_namelen = addrlen;
+            tx_msgs[n].msg_hdr.msg_iov = &tx_iov[n];
+            tx_msgs[n].msg_hdr.msg_iovlen = 1;
+            n++;
+            on_send(slot, now);
+            log_event("SEND DATA", &slot->pkt);
+
+            // ends on a short chunk; the seqNums of the rest of a compressed group
+            // count as acked from the start, so the window slides past them
+            if(slot->raw_len % MAX_DATA_SIZE || slot->raw_len == 0) last_seq = next_seq + covers - 1;
+            for(int c = 1; c < covers; c++) window[(next_seq + c) % MAX_WINDOW].acked = 1;
+            next_seq += covers;
+            if(n == batch) {
+                send_batch(sockfd, tx_msgs, n);
+                n = 0;
+            }
+        }
+        if(n > 0) send_batch(sockfd, tx_msgs, n);
 
-        while(waiting_ack) {
-            Packet ack;
-            recv_len = recvfrom(sockfd, &ack, sizeof(ack), 0, (struct sockaddr *)&receiver_addr, &addrlen);
-            if(recv_len > 0 && ack.type == TYPE_ACK && ack.ackNum == seq) {
-                if(drop(ack_drop_prob)) {
-                    fprintf(log_fp, "ACK %d dropped intentionally\n", ack.ackNum);
-                    fflush(log_fp);
-                    continue;
+        // held back only by the pacer: wake up when it allows the next packet
+        if(!starved && (last_seq < 0 || next_seq <= last_seq) && next_seq < base + window_size && in_flight < cc.cwnd &&
+           !pacer_ready(&pacer, cc.pacing_rate, now)) {
+            timer_set(&timers, PACE_TIMER, pacer.next_send);
+        }
+
+        // sleep until an ACK arrives or the earliest deadline passes
+        if(timer_next(&timers) != armed) {
+            armed = timer_next(&timers);
+            timer_arm_fd(tfd, armed);
+        }
+        if(use_uring) {
+            if(uring_submit(&ring, 1) < 0) {
+                perror("io_uring_enter failed");
+                exit(1);
+            }
+            struct io_uring_cqe *cqe;
+            while((cqe = uring_peek(&ring))) {
+                int op = URING_OP(cqe->user_data), id = URING_IDX(cqe->user_data), res = cqe->res;
+                uring_cqe_seen(&ring);
+                if(op == OP_RECV) {
+                    Packet ack;
+                    if(res > 0 && decode_header(ack_rx[id], res, &ack) == 0) {
+                        if(ack.type == TYPE_RESUME) apply_resume(&ack, ack_rx[id] + HEADER_SIZE);
+                        else if(ack.type == TYPE_ACCEPT) handle_accept(&ack, ack_rx[id] + HEADER_SIZE);
+                        else handle_ack(&ack, &base, next_seq);
+                    } else if(res > 0) {
+                        metrics_add(&metrics.bad, 1);
+                    }
+                    post_recv(OP_RECV, id, ack_rx[id], MAX_PACKET_SIZE);
+                } else if(op == OP_TIMER) {
+                    armed = 0;
+                    retransmit_expired();
+                    post_recv(OP_TIMER, 0, &expirations, sizeof(expirations));
+                } else {
+                    if(op == OP_READ && res != window[id].pkt.length) {
+                        fprintf(stderr, "Short read of %s: %s\n", filename, res < 0 ? strerror(-res) : "file changed");
+                        exit(1);
+                    }
+                    if(op == OP_READ) {
+                        seal_packet(window[id].wire, res);
+                        queue_send(&window[id], id);
+                    }
+                    window[id].inflight--;
                 }
-                log_event("RECV ACK", &ack);
-                alarm(0);
-                waiting_ack = 0;
             }
+            continue;
+        }
+        struct pollfd fds[3] = {
+            { .fd = sockfd, .events = POLLIN },
+            { .fd = tfd, .events = POLLIN },
+            { .fd = starved ? input_fd : -1, .events = POLLIN } // more input
+        };
+        if(poll(fds, 3, -1) < 0) continue;
+        if(fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            read(tfd, &expirations, sizeof(expirations));
+            armed = 0;
+            retransmit_expired();
         }
-        total_sent += pkt.length;
-        print_progress_bar(total_sent, f_size);
+        if(!(fds[0].revents & POLLIN)) continue;
 
-        if(pkt.length < MAX_DATA_SIZE) break;
-        seq++;
+        Packet ack;
+        if(recv_packet(sockfd, &ack, &receiver_addr, &addrlen) < 0) {
+            if(errno == EBADMSG) metrics_add(&metrics.bad, 1);
+            continue;
+        }
+        if(ack.type == TYPE_RESUME) apply_resume(&ack, (unsigned char *)ack.data);
+        else if(ack.type == TYPE_ACCEPT) handle_accept(&ack, (unsigned char *)ack.data);
+        else handle_ack(&ack, &base, next_seq);
     }
 
-    Packet eot = { .type = TYPE_EOT, .seqNum = seq };
-    sendto(sockfd, &eot, sizeof(eot), 0, (struct sockaddr *)&receiver_addr, addrlen);
-    log_event("SEND EOT", &eot);
-    fclose(fp);
-    fclose(log_fp);
+    Packet eot = { .type = TYPE_EOT, .seqNum = last_seq, .session = session };
+    if(streaming) digest = digest_final(&stream_digest);
+    eot.length = encode_eot(digest, streaming ? read_at : (long)range->length, eot.data);
+    if(use_uring) uring_exit(&ring); // its receives would take the answer
+    confirm_eot(&eot, streaming ? read_at : (long)range->length);
+    free(held);
+    free(runs);
+    tree_cursor_close(&cursor);
+    if(filefd >= 0) close(filefd);
+    close(tfd);
     close(sockfd);
+    return NULL;
+}
+
+// stdin is shared with the shell: leave it blocking again
+void restore_input(void) {
+    fcntl(input_fd, F_SETFL, input_flags);
+}
+
+int main(int argc, char *argv[]) {
+    int streams = 1;
+    int opt;
+    cc_ops = cc_find("fixed");
+    while((opt = getopt(argc, argv, "w:b:e:c:n:m:r:zdl:M:")) != -1) {
+        switch(opt) {
+            case 'w': window_size = atoi(optarg); break;
+            case 'b': batch = atoi(optarg); break;
+            case 'e':
+                if(strcmp(optarg, "uring") == 0) want_uring = 1;
+                else if(strcmp(optarg, "sync") != 0) usage(argv[0]);
+                break;
+            case 'c':
+                if(!(cc_ops = cc_find(optarg))) usage(argv[0]);
+                break;
+            case 'n': streams = atoi(optarg); break;
+            case 'm':
+                if(strcmp(optarg, "nack") == 0) nack_mode = 1;
+                else if(strcmp(optarg, "ack") != 0) usage(argv[0]);
+                break;
+            case 'r': max_rate = atof(optarg) * 125000; break;
+            case 'z': compress = 1; break;
+            case 'd': delta = 1; break;
+            case 'l': log_sample = atoi(optarg); break;
+            case 'M': metrics_file = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(argc - optind != 6) usage(argv[0]);
+    if(window_size < 1 || window_size > MAX_WINDOW) {
+        fprintf(stderr, "Window size must be between 1 and %d\n", MAX_WINDOW);
+        exit(1);
+    }
+    if(streams < 1 || streams > MAX_STREAMS) {
+        fprintf(stderr, "Streams must be between 1 and %d\n", MAX_STREAMS);
+        exit(1);
+    }
+    if((compress || delta) && nack_mode) {
+        fprintf(stderr, "-z and -d need ACK mode\n");
+        exit(1);
+    }
+    if(batch < 1) batch = 1;
+    if(batch > MAX_WINDOW) batch = MAX_WINDOW;
+    if(max_rate < 125000) max_rate = 125000;
+    argv += optind - 1;
+
+    int sender_port = atoi(argv[1]);
+    receiver_ip = argv[2];
+    int receiver_port = atoi(argv[3]);
+    timeout = atof(argv[4]); // initial RTO in seconds, until the first RTT sample
+    filename = argv[5];
+    ack_drop_prob = atof(argv[6]);
+
+    srand(time(NULL));
+    if(evlog_open("udp_logs.bin", log_sample) < 0) {
+        perror("Failed to open log file");
+        exit(1);
+    }
+    if(metrics_start(metrics_file, "sender") < 0) {
+        perror("Failed to start metrics");
+        exit(1);
+    }
+
+    // "-", a pipe or the like is sent as it is read, its length only known at the end
+    struct stat st;
+    if(strcmp(filename, "-") == 0) {
+        input_fd = STDIN_FILENO;
+    } else if(stat(filename, &st) < 0) {
+        perror("stat failed");
+        exit(1);
+    } else if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) && (input_fd = open(filename, O_RDONLY)) < 0) {
+        perror("Failed to open input");
+        exit(1);
+    }
+    streaming = input_fd >= 0;
+    if(streaming) {
+        if(streams > 1 || nack_mode || delta) {
+            fprintf(stderr, "Piped input needs a single ACK-mode flow without -d\n");
+            exit(1);
+        }
+        input_flags = fcntl(input_fd, F_GETFL);
+        if(input_flags < 0 || fcntl(input_fd, F_SETFL, input_flags | O_NONBLOCK) < 0) {
+            perror("fcntl failed");
+            exit(1);
+        }
+        atexit(restore_input);
+        f_size = -1;
+        Flow flow = { .sender_port = sender_port, .receiver_port = receiver_port,
+                      .range = { .f_size = STREAM_SIZE, .offset = 0, .length = STREAM_SIZE } };
+        send_flow(&flow);
+        printf("\r%ld bytes\n", total_sent); // the last count may not have been drawn
+        return 0;
+    }
+    f_mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    // a directory goes as one stream: its manifest, then every file in it back to back
+    tree_mode = S_ISDIR(st.st_mode);
+    if(tree_mode && delta) {
+        fprintf(stderr, "-d needs a single file\n");
+        exit(1);
+    }
+    if(tree_mode ? tree_walk(&source, filename, "") < 0 || tree_encode(&source) < 0 : tree_add(&source, NULL, filename, st.st_mode, st.st_size) < 0) {
+        perror("Failed to read input");
+        exit(1);
+    }
+    if(!tree_mode) source.size = st.st_size;
+    f_size = source.size;
+    if(tree_mode) printf("%s: %d entries, %ld bytes with a %ld-byte manifest\n", filename, source.n, f_size, source.manifest_len);
+
+    // whole chunks per flow, so only the last flow ends on a short one;
+    // flow i goes from sender_port + i to receiver_port + i
+    long per_flow = (f_size / MAX_DATA_SIZE / streams + 1) * MAX_DATA_SIZE;
+    Flow flows[MAX_STREAMS];
+    for(int i = 0; i < streams; i++) {
+        long off = i * per_flow < f_size ? i * per_flow : f_size;
+        flows[i].index = i;
+        flows[i].sender_port = sender_port + i;
+        flows[i].receiver_port = receiver_port + i;
+        flows[i].range = (FileRange){ .f_size = f_size, .offset = off, .length = off + per_flow < f_size ? per_flow : f_size - off, .mtime = f_mtime };
+        if(pthread_create(&flows[i].thread, NULL, send_flow, &flows[i]) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < streams; i++) pthread_join(flows[i].thread, NULL);
 
     printf("\n");
 
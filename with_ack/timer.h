@@ -0,0 +1,141 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+// Retransmission timing: RTT estimation (RFC 6298) and a min-heap of
+// per-packet deadlines that drives a single timerfd. All times are
+// CLOCK_MONOTONIC microseconds.
+
+#define RTO_MIN_US 2000ULL          // loopback RTTs are tens of us, 1 s (RFC) is far too coarse
+#define RTO_MAX_US 60000000ULL
+#define MAX_TIMERS 1024
+
+static inline uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+typedef struct {
+    uint64_t srtt;
+    uint64_t rttvar;
+    uint64_t rto;
+    int has_sample;
+} RttEstimator;
+
+static inline void rtt_init(RttEstimator *est, uint64_t initial_rto) {
+    est->srtt = 0;
+    est->rttvar = 0;
+    est->has_sample = 0;
+    est->rto = initial_rto < RTO_MIN_US ? RTO_MIN_US : initial_rto;
+}
+
+// Feed one RTT measurement. Per Karn's rule, only call this for packets
+// that were never retransmitted.
+static inline void rtt_sample(RttEstimator *est, uint64_t rtt) {
+    if(!est->has_sample) {
+        est->srtt = rtt;
+        est->rttvar = rtt / 2;
+        est->has_sample = 1;
+    } else {
+        uint64_t err = est->srtt > rtt ? est->srtt - rtt : rtt - est->srtt;
+        est->rttvar = (3 * est->rttvar + err) / 4;
+        est->srtt = (7 * est->srtt + rtt) / 8;
+    }
+    est->rto = est->srtt + 4 * est->rttvar;
+    if(est->rto < RTO_MIN_US) est->rto = RTO_MIN_US;
+    if(est->rto > RTO_MAX_US) est->rto = RTO_MAX_US;
+}
+
+// Timeout for a packet already retransmitted `retries` times: the RTO
+// doubled per retry, capped at RTO_MAX_US. Backing off per packet keeps
+// one lossy packet from stretching the timers of the rest of the window.
+static inline uint64_t rtt_backoff(const RttEstimator *est, int retries) {
+    uint64_t rto = est->rto;
+    while(retries-- > 0 && rto < RTO_MAX_US) rto *= 2;
+    return rto < RTO_MAX_US ? rto : RTO_MAX_US;
+}
+
+// Indexed binary min-heap of deadlines. Timer ids are small integers
+// (the sender uses the window slot index) so a timer can be re-armed or
+// cancelled in O(log n) without leaving stale entries behind.
+typedef struct {
+    uint64_t deadline[MAX_TIMERS];
+    int heap[MAX_TIMERS];
+    int pos[MAX_TIMERS]; // index into heap, -1 when not armed
+    int size;
+} TimerQueue;
+
+static inline void timer_init(TimerQueue *q) {
+    q->size = 0;
+    for(int i = 0; i < MAX_TIMERS; i++) q->pos[i] = -1;
+}
+
+static inline void timer_swap(TimerQueue *q, int a, int b) {
+    int t = q->heap[a];
+    q->heap[a] = q->heap[b];
+    q->heap[b] = t;
+    q->pos[q->heap[a]] = a;
+    q->pos[q->heap[b]] = b;
+}
+
+static inline void timer_sift(TimerQueue *q, int i) {
+    while(i > 0 && q->deadline[q->heap[i]] < q->deadline[q->heap[(i - 1) / 2]]) {
+        timer_swap(q, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while(1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if(l < q->size && q->deadline[q->heap[l]] < q->deadline[q->heap[m]]) m = l;
+        if(r < q->size && q->deadline[q->heap[r]] < q->deadline[q->heap[m]]) m = r;
+        if(m == i) break;
+        timer_swap(q, i, m);
+        i = m;
+    }
+}
+
+static inline void timer_set(TimerQueue *q, int id, uint64_t deadline) {
+    q->deadline[id] = deadline;
+    if(q->pos[id] < 0) {
+        q->heap[q->size] = id;
+        q->pos[id] = q->size++;
+    }
+    timer_sift(q, q->pos[id]);
+}
+
+static inline void timer_cancel(TimerQueue *q, int id) {
+    int i = q->pos[id];
+    if(i < 0) return;
+    q->pos[id] = -1;
+    if(i != --q->size) {
+        q->heap[i] = q->heap[q->size];
+        q->pos[q->heap[i]] = i;
+        timer_sift(q, i);
+    }
+}
+
+// Earliest deadline, or 0 if nothing is armed.
+static inline uint64_t timer_next(const TimerQueue *q) {
+    return q->size ? q->deadline[q->heap[0]] : 0;
+}
+
+// Removes and returns one timer that is due at `now`, or -1.
+static inline int timer_pop_expired(TimerQueue *q, uint64_t now) {
+    if(q->size == 0 || q->deadline[q->heap[0]] > now) return -1;
+    int id = q->heap[0];
+    timer_cancel(q, id);
+    return id;
+}
+
+// Points the timerfd at an absolute deadline (0 disarms it).
+static inline int timer_arm_fd(int tfd, uint64_t deadline) {
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = deadline / 1000000ULL;
+    its.it_value.tv_nsec = (deadline % 1000000ULL) * 1000;
+    return timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+#endif
@@ -0,0 +1,354 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "checksum.h"
+
+// Directory transfers. A whole tree goes as one stream in one session: a
+// manifest of every entry, then the contents of the regular files back to
+// back in manifest order, so a small file costs its bytes and nothing
+// more, and the metadata of every file is in before the data gets to it.
+// Stream offsets map onto (file, offset) pairs by binary search.
+//
+// Manifest, big-endian: "UDPTREE1", manifest length, entry count (4 bytes
+// each), then per entry its size (8), st_mode (4), path length (2) and the
+// path relative to the root, '/'-separated. Directories come before what
+// they contain and have size 0.
+//
+// A single file is the same thing with no manifest and one entry, so the
+// sender reads both through tree_io.
+//
+// Only directories and regular files go: tree_walk silently skips
+// symlinks, devices, fifos and sockets.
+
+#define TREE_MAGIC "UDPTREE1"
+#define TREE_HEADER 16
+#define TREE_ENTRY_HEADER 14
+
+typedef struct {
+    char *path; // root/name
+    const char *name; // relative to the root, inside path
+    uint32_t mode;
+    long size, offset; // offset in the stream
+} TreeEntry;
+
+typedef struct {
+    TreeEntry *entries;
+    int n, cap;
+    unsigned char *manifest;
+    long manifest_len, size; // size: the whole stream
+} Tree;
+
+// A flow's open file, so consecutive chunks of one file don't reopen it
+typedef struct {
+    int idx, fd;
+} TreeCursor;
+
+static inline void tree_cursor_init(TreeCursor *c) {
+    c->idx = -1;
+    c->fd = -1;
+}
+
+static inline void tree_cursor_close(TreeCursor *c) {
+    if(c->fd >= 0) close(c->fd);
+    tree_cursor_init(c);
+}
+
+// Appends an entry; path is root/name. Returns 0, or -1 out of memory.
+static inline int tree_add(Tree *t, const char *root, const char *name, uint32_t mode, long size) {
+    if(t->n == t->cap) {
+        int cap = t->cap ? 2 * t->cap : 64;
+        TreeEntry *more = realloc(t->entries, cap * sizeof(*more));
+        if(!more) return -1;
+        t->entries = more;
+        t->cap = cap;
+    }
+    size_t root_len = root ? strlen(root) + 1 : 0;
+    char *path = malloc(root_len + strlen(name) + 1);
+    if(!path) return -1;
+    if(root) sprintf(path, "%s/%s", root, name);
+    else strcpy(path, name);
+    t->entries[t->n++] = (TreeEntry){ .path = path, .name = path + root_len, .mode = mode, .size = size };
+    return 0;
+}
+
+// Sender: adds everything under root/dir (dir "" for root itself), names in
+// sorted order. Regular files and directories only; symlinks and the like
+// are skipped. Returns 0, or -1 with errno set.
+static inline int tree_walk(Tree *t, const char *root, const char *dir) {
+    char path[4096];
+    struct dirent **list;
+    snprintf(path, sizeof(path), "%s%s%s", root, *dir ? "/" : "", dir);
+    int n = scandir(path, &list, NULL, alphasort);
+    if(n < 0) return -1;
+    int err = 0;
+    for(int i = 0; i < n; i++) {
+        const char *d = list[i]->d_name;
+        char name[4096];
+        struct stat st;
+        if(err || strcmp(d, ".") == 0 || strcmp(d, "..") == 0) goto next;
+        if(snprintf(name, sizeof(name), "%s%s%s", dir, *dir ? "/" : "", d) >= (int)sizeof(name) ||
+           snprintf(path, sizeof(path), "%s/%s", root, name) >= (int)sizeof(path)) {
+            errno = ENAMETOOLONG;
+            err = 1;
+            goto next;
+        }
+        if(lstat(path, &st) < 0) goto next;
+        if(S_ISDIR(st.st_mode)) {
+            err = tree_add(t, root, name, st.st_mode, 0) < 0 || tree_walk(t, root, name) < 0;
+        } else if(S_ISREG(st.st_mode)) {
+            err = tree_add(t, root, name, st.st_mode, st.st_size) < 0;
+        }
+    next:
+        free(list[i]);
+    }
+    free(list);
+    return err ? -1 : 0;
+}
+
+// Sender: lays the entries out in the stream behind their manifest, and
+// builds it. Returns 0, or -1 out of memory.
+static inline int tree_encode(Tree *t) {
+    long len = TREE_HEADER;
+    for(int i = 0; i < t->n; i++) len += TREE_ENTRY_HEADER + strlen(t->entries[i].name);
+    unsigned char *m = t->manifest = malloc(len);
+    if(!m) return -1;
+    uint32_t h[2] = { htonl(len), htonl(t->n) };
+    memcpy(m, TREE_MAGIC, 8);
+    memcpy(m + 8, h, 8);
+    long pos = TREE_HEADER, offset = len;
+    for(int i = 0; i < t->n; i++) {
+        TreeEntry *e = &t->entries[i];
+        uint16_t name_len = strlen(e->name);
+        uint32_t f[3] = { htonl((uint64_t)e->size >> 32), htonl((uint32_t)e->size), htonl(e->mode) };
+        uint16_t nl = htons(name_len);
+        memcpy(m + pos, f, 12);
+        memcpy(m + pos + 12, &nl, 2);
+        memcpy(m + pos + TREE_ENTRY_HEADER, e->name, name_len);
+        pos += TREE_ENTRY_HEADER + name_len;
+        e->offset = offset;
+        offset += e->size;
+    }
+    t->manifest_len = len;
+    t->size = offset;
+    return 0;
+}
+
+// Receiver: the manifest length from the stream's first bytes, or -1
+static inline long tree_manifest_length(const unsigned char *buf, int len) {
+    uint32_t m;
+    if(len < TREE_HEADER || memcmp(buf, TREE_MAGIC, 8) != 0) return -1;
+    memcpy(&m, buf + 8, 4);
+    return ntohl(m) < TREE_HEADER ? -1 : (long)ntohl(m);
+}
+
+// Nothing that could leave the root: no absolute paths, no . or .. parts
+static inline int tree_name_ok(const char *name) {
+    if(!*name || *name == '/') return 0;
+    for(const char *p = name; *p; ) {
+        const char *end = strchr(p, '/');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if(n == 0 || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.')) return 0;
+        p += n + (end != NULL);
+        if(end && !*p) return 0; // trailing slash
+    }
+    return 1;
+}
+
+// Receiver: entries from the complete manifest (t->manifest,
+// t->manifest_len), under root. Returns 0, or -1 if it is malformed, its
+// entries leave the root, or they don't add up to stream_size.
+static inline int tree_parse(Tree *t, const char *root, long stream_size) {
+    const unsigned char *m = t->manifest;
+    uint32_t h[2];
+    memcpy(h, m + 8, 8);
+    long pos = TREE_HEADER, offset = t->manifest_len;
+    for(uint32_t i = 0; i < ntohl(h[1]); i++) {
+        uint32_t f[3];
+        uint16_t nl;
+        char name[4096];
+        if(pos + TREE_ENTRY_HEADER > t->manifest_len) return -1;
+        memcpy(f, m + pos, 12);
+        memcpy(&nl, m + pos + 12, 2);
+        int name_len = ntohs(nl);
+        long size = (long)((uint64_t)ntohl(f[0]) << 32 | ntohl(f[1]));
+        uint32_t mode = ntohl(f[2]);
+        if(pos + TREE_ENTRY_HEADER + name_len > t->manifest_len || name_len >= (int)sizeof(name) || size < 0) return -1;
+        memcpy(name, m + pos + TREE_ENTRY_HEADER, name_len);
+        name[name_len] = '\0';
+        if(memchr(name, '\0', name_len) || !tree_name_ok(name) || (!S_ISREG(mode) && !S_ISDIR(mode)) || (S_ISDIR(mode) && size)) return -1;
+        if(tree_add(t, root, name, mode, size) < 0) return -1;
+        t->entries[t->n - 1].offset = offset;
+        offset += size;
+        pos += TREE_ENTRY_HEADER + name_len;
+    }
+    t->size = offset;
+    return pos == t->manifest_len && offset == stream_size ? 0 : -1;
+}
+
+// The directory e sits in, opened from the root one component at a time
+// without following symlinks, so a link left in an existing receiving
+// directory can't lead outside it; *last is e's own name in there.
+// Returns the fd, or -1 with errno set.
+static inline int tree_parent(const TreeEntry *e, const char **last) {
+    char part[4096];
+    snprintf(part, sizeof(part), "%.*s", (int)(e->name - e->path - 1), e->path);
+    int fd = open(part, O_RDONLY | O_DIRECTORY);
+    const char *p = e->name;
+    for(const char *slash; fd >= 0 && (slash = strchr(p, '/')); p = slash + 1) {
+        snprintf(part, sizeof(part), "%.*s", (int)(slash - p), p);
+        int next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        close(fd);
+        fd = next;
+    }
+    *last = p;
+    return fd;
+}
+
+// open() for an entry, through tree_parent unless it is a single file
+// with no root. Returns the fd, or -1 with errno set.
+static inline int tree_open(const TreeEntry *e, int flags, mode_t mode) {
+    if(e->name == e->path) return open(e->path, flags, mode);
+    const char *last;
+    int dir = tree_parent(e, &last);
+    if(dir < 0) return -1;
+    int fd = openat(dir, last, flags | O_NOFOLLOW, mode);
+    int err = errno;
+    close(dir);
+    errno = err;
+    return fd;
+}
+
+// Receiver: creates every directory and every file at its final size, up
+// front like a single output. Owner-only and writable for now, since a
+// read-only file or directory couldn't be filled in: tree_apply_modes
+// gives them the sender's modes once the data checks out. What is already
+// there from an earlier copy is reused only if it is a real directory; a
+// file, or a link, is replaced. Returns 0, or -1 with errno set.
+static inline int tree_create(const Tree *t, const char *root) {
+    if(mkdir(root, 0755) < 0 && errno != EEXIST) return -1;
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if(fd < 0) return -1;
+    close(fd);
+    for(int i = 0; i < t->n; i++) {
+        const TreeEntry *e = &t->entries[i];
+        const char *last;
+        int dir = tree_parent(e, &last);
+        if(dir < 0) return -1;
+        if(S_ISDIR(e->mode)) {
+            fd = mkdirat(dir, last, 0700) < 0 && errno != EEXIST ? -1 : openat(dir, last, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if(fd >= 0 && fchmod(fd, 0700) < 0) {
+                close(fd);
+                fd = -1;
+            }
+        } else {
+            fd = unlinkat(dir, last, 0) < 0 && errno != ENOENT ? -1 : openat(dir, last, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+            if(fd >= 0 && e->size > 0 && fallocate(fd, 0, 0, e->size) < 0 && ftruncate(fd, e->size) < 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        int err = errno;
+        close(dir);
+        errno = err;
+        if(fd < 0) return -1;
+        close(fd);
+    }
+    return 0;
+}
+
+// Receiver, after the digest check: the sender's modes, last entry first
+// so everything in a directory is done before the directory itself may
+// lose its write bit. Returns 0, or -1 with errno set.
+static inline int tree_apply_modes(const Tree *t) {
+    for(int i = t->n - 1; i >= 0; i--) {
+        int fd = tree_open(&t->entries[i], O_RDONLY, 0);
+        if(fd < 0) return -1;
+        int err = fchmod(fd, t->entries[i].mode & 0777);
+        close(fd);
+        if(err < 0) return -1;
+    }
+    return 0;
+}
+
+// The entry whose bytes hold stream offset off (past the manifest), or -1:
+// the last one starting at or before off, empty ones being skipped over
+// since whatever follows them starts at the same offset.
+static inline int tree_find(const Tree *t, long off) {
+    int lo = 0, hi = t->n - 1, found = -1;
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if(t->entries[mid].offset <= off) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if(found < 0 || off >= t->entries[found].offset + t->entries[found].size) return -1;
+    return found;
+}
+
+// Reads (or with write set, writes) len bytes of the stream at off:
+// manifest bytes from memory, file bytes through the cursor's file.
+// Returns 0, or -1 with errno set (EIO for a file that got shorter).
+static inline int tree_io(const Tree *t, TreeCursor *c, unsigned char *buf, long len, long off, int write) {
+    if(off < t->manifest_len) {
+        long n = len < t->manifest_len - off ? len : t->manifest_len - off;
+        if(write) memcpy(t->manifest + off, buf, n);
+        else memcpy(buf, t->manifest + off, n);
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    while(len > 0) {
+        int i = tree_find(t, off);
+        if(i < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        const TreeEntry *e = &t->entries[i];
+        if(c->idx != i) {
+            tree_cursor_close(c);
+            if((c->fd = tree_open(e, write ? O_RDWR : O_RDONLY, 0)) < 0) return -1; // a writer reads back for the digest
+            c->idx = i;
+        }
+        long n = len < e->offset + e->size - off ? len : e->offset + e->size - off;
+        ssize_t r = write ? pwrite(c->fd, buf, n, off - e->offset) : pread(c->fd, buf, n, off - e->offset);
+        if(r != n) {
+            if(r >= 0) errno = EIO;
+            return -1;
+        }
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// XXH64 of length stream bytes from offset, like digest_file
+static inline int tree_digest(const Tree *t, TreeCursor *c, long offset, long length, uint64_t *out) {
+    static __thread unsigned char buf[1 << 16];
+    Digest d;
+    digest_init(&d);
+    while(length > 0) {
+        long n = length < (long)sizeof(buf) ? length : (long)sizeof(buf);
+        if(tree_io(t, c, buf, n, offset, 0) < 0) return -1;
+        digest_update(&d, buf, n);
+        offset += n;
+        length -= n;
+    }
+    *out = digest_final(&d);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring plumbing on the raw syscalls (no liburing): one
+// submission ring, one completion ring, fixed files and registered
+// buffers. Single-threaded use only.
+
+#define URING_ENTRIES 1024
+
+// user_data layout: operation kind in the high half, slot/buffer index in the low half
+#define URING_DATA(op, idx) (((uint64_t)(op) << 32) | (uint32_t)(idx))
+#define URING_OP(data) ((int)((data) >> 32))
+#define URING_IDX(data) ((int)(uint32_t)(data))
+
+typedef struct {
+    int fd;
+    void *ring;
+    size_t ring_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail; // next sqe to hand out; published to *sq_tail on submit
+} Uring;
+
+// Sets up a ring with `entries` sqes and four times as many cqes, so a
+// burst of completions doesn't overflow before it is reaped.
+// Returns 0, or -1 with errno set (ENOSYS/EPERM when io_uring is unavailable).
+static inline int uring_init(Uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(r->fd < 0) return -1;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)) { // pre-5.4 kernels
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    char *base = r->ring;
+    r->sq_head = (unsigned *)(base + p.sq_off.head);
+    r->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(base + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(base + p.sq_off.array);
+    r->cq_head = (unsigned *)(base + p.cq_off.head);
+    r->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(base + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    for(unsigned i = 0; i < p.sq_entries; i++) r->sq_array[i] = i; // sqe i always sits in slot i
+    return 0;
+}
+
+// The fds/iovecs are then addressed by index (IOSQE_FIXED_FILE, buf_index).
+static inline int uring_register_files(Uring *r, const int *fds, unsigned n) {
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, n);
+}
+
+static inline int uring_register_buffers(Uring *r, const struct iovec *iov, unsigned n) {
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, n);
+}
+
+// Free sqes before the next submit.
+static inline unsigned uring_space(const Uring *r) {
+    return r->sq_entries - (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Publishes every queued sqe and, if wait_nr > 0, sleeps until that many
+// completions are ready. Returns the number submitted, or -1.
+static inline int uring_submit(Uring *r, unsigned wait_nr) {
+    unsigned to_submit = r->sqe_tail - *r->sq_tail;
+    if(to_submit == 0 && wait_nr == 0) return 0;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// Queues one operation on a fixed file. A full ring is submitted first,
+// so don't let that happen in the middle of an IOSQE_IO_LINK chain
+// (check uring_space). Returns the sqe for extra flags, or NULL.
+static inline struct io_uring_sqe *uring_prep(Uring *r, int opcode, int file_idx, void *buf,
+                                              unsigned len, uint64_t off, uint64_t user_data) {
+    if(uring_space(r) == 0 && (uring_submit(r, 0) < 0 || uring_space(r) == 0)) return NULL;
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = file_idx;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+// Next completion, or NULL when the ring is drained. Release it with uring_cqe_seen.
+static inline struct io_uring_cqe *uring_peek(Uring *r) {
+    unsigned head = *r->cq_head;
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void uring_cqe_seen(Uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Cancels whatever is still posted (a RECV waits forever) and reaps it, then
+// drops the registered files before closing the ring: the kernel tears a ring
+// down in the background, and until it does the sockets stay bound. Needs
+// IORING_ASYNC_CANCEL_ANY (5.19); older kernels just get the close.
+static inline void uring_exit(Uring *r) {
+    uint64_t marker = URING_DATA(-1, -1);
+    struct io_uring_sqe *sqe = uring_prep(r, IORING_OP_ASYNC_CANCEL, 0, NULL, 0, 0, marker);
+    if(sqe) {
+        sqe->flags = 0;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+    }
+    // the cancel's own completion tells how many others to wait for
+    int cancelled = -1, reaped = 0;
+    while(sqe && (cancelled < 0 || reaped < cancelled)) {
+        if(uring_submit(r, 1) < 0) break;
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek(r))) {
+            if(cqe->user_data == marker) cancelled = cqe->res > 0 ? cqe->res : 0;
+            else if(cqe->res == -ECANCELED || cqe->res == -EINTR) reaped++;
+            uring_cqe_seen(r);
+        }
+    }
+    syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_FILES, NULL, 0);
+    syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    munmap(r->ring, r->ring_size);
+    close(r->fd);
+}
+
+#endif
@@ -1,12 +1,24 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
 #define MAX_DATA_SIZE 1000
+#define MAX_WINDOW 256   // Upper bound for the sender window
+#define DEFAULT_WINDOW 32
+#define FIRST_DATA_SEQ 1 // Sequence number 0 is the INIT
 
 // Packet types
 #define TYPE_DATA 1
 #define TYPE_ACK 2
 #define TYPE_EOT 3
+#define TYPE_INIT 4   // Opens the transfer: size and name in one frame, see below
+#define TYPE_ACCEPT 5 // The receiver's answer to INIT
 
 typedef struct {
     int type;
@@ -16,6 +28,116 @@ typedef struct {
     char data[MAX_DATA_SIZE];
 } Packet;
 
+// Wire format (version 1), all fields big-endian, no padding:
+//   [0] version [1] type [2..3] length [4..7] seqNum [8..11] ackNum
+// followed by exactly `length` bytes of payload. An ACK is just the header.
+//
+// seqNum and ackNum carry the low 32 bits of the sequence number; both ends
+// recover the full one with seq_unwrap against one they know is near (the
+// sender's window base, the receiver's lowest missing chunk). The INIT
+// carries an 8-byte size, so files past 4 GB go through.
+#define PROTO_VERSION 3
+#define HEADER_SIZE 12
+#define MAX_PACKET_SIZE (HEADER_SIZE + MAX_DATA_SIZE)
+
+// Serializes pkt into buf (at least HEADER_SIZE + pkt->length bytes). Returns the wire size.
+static inline int encode_packet(const Packet *pkt, unsigned char *buf) {
+    uint16_t length = htons((uint16_t)pkt->length);
+    uint32_t seq = htonl((uint32_t)pkt->seqNum);
+    uint32_t ack = htonl((uint32_t)pkt->ackNum);
+
+    buf[0] = PROTO_VERSION;
+    buf[1] = (unsigned char)pkt->type;
+    memcpy(buf + 2, &length, 2);
+    memcpy(buf + 4, &seq, 4);
+    memcpy(buf + 8, &ack, 4);
+    memcpy(buf + HEADER_SIZE, pkt->data, pkt->length);
+    return HEADER_SIZE + pkt->length;
+}
+
+// Parses n bytes from buf into pkt. Only the payload is copied, and it is
+// NUL-terminated when there is room so string payloads work with strcmp.
+// Returns 0, or -1 for a short, truncated or foreign datagram.
+static inline int decode_packet(const unsigned char *buf, int n, Packet *pkt) {
+    uint16_t length;
+    uint32_t seq, ack;
+
+    if (n < HEADER_SIZE || buf[0] != PROTO_VERSION) return -1;
+    memcpy(&length, buf + 2, 2);
+    memcpy(&seq, buf + 4, 4);
+    memcpy(&ack, buf + 8, 4);
+
+    pkt->type = buf[1];
+    pkt->length = ntohs(length);
+    pkt->seqNum = (int)ntohl(seq);
+    pkt->ackNum = (int)ntohl(ack);
+    if (pkt->length > MAX_DATA_SIZE || HEADER_SIZE + pkt->length > n) return -1;
+
+    memcpy(pkt->data, buf + HEADER_SIZE, pkt->length);
+    if (pkt->length < MAX_DATA_SIZE) pkt->data[pkt->length] = '\0';
+    return 0;
+}
+
+// The sequence number whose low 32 bits are wire, closest to ref
+static inline long seq_unwrap(int wire, long ref) {
+    return ref + (int32_t)((uint32_t)wire - (uint32_t)ref);
+}
+
+// TYPE_INIT (seqNum 0) payload: the file size (8 bytes, big-endian), then
+// the name, not terminated. The sender resends it with backoff until the
+// ACCEPT comes, and the receiver answers every copy. An ACCEPT with a
+// payload refuses the transfer, the payload saying why.
+#define INIT_HEADER 8
+#define INIT_TRIES 8
+
+// Fills pkt with the INIT. Returns 0, or -1 if the name is empty or too long.
+static inline int encode_init(uint64_t f_size, const char *name, Packet *pkt) {
+    size_t n = strlen(name);
+    uint32_t f[2] = { htonl(f_size >> 32), htonl((uint32_t)f_size) };
+    if (n == 0 || n > MAX_DATA_SIZE - INIT_HEADER) return -1;
+    pkt->type = TYPE_INIT;
+    pkt->seqNum = 0;
+    pkt->ackNum = 0;
+    memcpy(pkt->data, f, 8);
+    memcpy(pkt->data + INIT_HEADER, name, n);
+    pkt->length = INIT_HEADER + n;
+    return 0;
+}
+
+// name needs MAX_DATA_SIZE - INIT_HEADER + 1 bytes. Returns 0, or -1 for a
+// malformed INIT.
+static inline int decode_init(const Packet *pkt, long *f_size, char *name) {
+    uint32_t f[2];
+    int n = pkt->length - INIT_HEADER;
+    if (n <= 0 || memchr(pkt->data + INIT_HEADER, '\0', n)) return -1;
+    memcpy(f, pkt->data, 8);
+    *f_size = (long)((uint64_t)ntohl(f[0]) << 32 | ntohl(f[1]));
+    if (*f_size < 0) return -1;
+    memcpy(name, pkt->data + INIT_HEADER, n);
+    name[n] = '\0';
+    return 0;
+}
+
+// sendto() of the encoded packet; only HEADER_SIZE + length bytes go on the wire.
+static inline ssize_t send_packet(int sockfd, const Packet *pkt, const struct sockaddr_in *addr, socklen_t addrlen) {
+    unsigned char buf[MAX_PACKET_SIZE];
+    int n = encode_packet(pkt, buf);
+    return sendto(sockfd, buf, n, 0, (const struct sockaddr *)addr, addrlen);
+}
+
+// recvfrom() + decode. Returns the datagram size, or -1 with errno set
+// (EBADMSG if the datagram didn't decode).
+static inline ssize_t recv_packet(int sockfd, Packet *pkt, struct sockaddr_in *addr, socklen_t *addrlen) {
+    unsigned char buf[MAX_PACKET_SIZE];
+    ssize_t n = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)addr, addrlen);
+    if (n < 0) return -1;
+    if (decode_packet(buf, n, pkt) < 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return n;
+}
+
 // Utility function to simulate packet drop
 int drop(float prob);
 
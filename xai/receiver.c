@@ -1,16 +1,37 @@
+#define _GNU_SOURCE // fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include "packet.h"
+#include "timer.h"
+#include "evlog.h"
 
-FILE *log_fp;
+
+// Every chunk is written at its own file offset as soon as it arrives, so
+// arrival order does not matter. One bit per MAX_DATA_SIZE chunk records
+// which ones are already on disk.
+unsigned char *chunk_map;
+long n_chunks; // Includes the final short (possibly empty) chunk
+long first_missing; // Lowest chunk not yet on disk, to unwrap seqNums against
+
+int chunk_received(long chunk) {
+    return chunk_map[chunk / 8] >> (chunk % 8) & 1;
+}
+
+void mark_chunk(long chunk) {
+    chunk_map[chunk / 8] |= 1 << (chunk % 8);
+}
 
 // Print progress bar for file transfer
-void print_progress_bar(int received_bytes, int total_bytes) {
+void print_progress_bar(long received_bytes, long total_bytes) {
     const int bar_width = 50;
+    if (total_bytes == 0 || !progress_due(received_bytes, total_bytes)) {
+        return;
+    }
     float percentage = (float)received_bytes / total_bytes;
     int pos = (int)(bar_width * percentage);
 
@@ -25,10 +46,32 @@ void print_progress_bar(int received_bytes, int total_bytes) {
 
 // Log events to file
 void log_event(const char *event, Packet *pkt) {
-    time_t now = time(NULL);
-    fprintf(log_fp, "[%ld] %s - type: %d, seqNum: %d, ackNum: %d, len: %d\n",
-            now, event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
-    fflush(log_fp);
+    evlog(event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
+}
+
+// Create recv_<name> at its full size, and the chunk bitmap for it.
+// Returns the fd, or -1 with errno set.
+int open_output(const char *name, long f_size) {
+    char filename[MAX_DATA_SIZE + 8];
+    snprintf(filename, sizeof(filename), "recv_%s", name);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Reserve the full size now so offset writes never grow the file piecemeal.
+    // Filesystems without fallocate still get the right length via ftruncate.
+    if (f_size > 0 && fallocate(fd, 0, 0, f_size) < 0 && ftruncate(fd, f_size) < 0) {
+        close(fd);
+        return -1;
+    }
+    n_chunks = f_size / MAX_DATA_SIZE + 1;
+    chunk_map = calloc((n_chunks + 7) / 8, 1);
+    if (!chunk_map) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 int drop(float prob) {
@@ -43,13 +86,12 @@ int main(int argc, char *argv[]) {
 
     int receiver_port = atoi(argv[1]);
     float drop_prob = atof(argv[2]);
-    int total_received = 0;
-    int f_size = 0; // Initialize to avoid undefined behavior
+    long total_received = 0;
+    long f_size = 0; // Initialize to avoid undefined behavior
     srand(time(NULL));
 
     // Open log file
-    log_fp = fopen("receiver_udp_logs", "a");
-    if (!log_fp) {
+    if (evlog_open("receiver_udp_logs.bin", 1) < 0) {
         perror("Failed to open log file");
         exit(1);
     }
@@ -58,7 +100,6 @@ int main(int argc, char *argv[]) {
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
         perror("Socket creation failed");
-        fclose(log_fp);
         exit(1);
     }
 
@@ -71,7 +112,6 @@ int main(int argc, char *argv[]) {
 
     if (bind(sockfd, (struct sockaddr *)&receiver_addr, sizeof(receiver_addr)) < 0) {
         perror("Bind failed");
-        fclose(log_fp);
         close(sockfd);
         exit(1);
     }
@@ -79,110 +119,79 @@ int main(int argc, char *argv[]) {
     struct sockaddr_in sender_addr;
     socklen_t addr_len = sizeof(sender_addr);
 
-    // Receive and validate greeting packet
-    Packet greet_pkt;
-    memset(&greet_pkt, 0, sizeof(greet_pkt));
-    if (recvfrom(sockfd, &greet_pkt, sizeof(greet_pkt), 0, (struct sockaddr *)&sender_addr, &addr_len) < 0) {
-        perror("Failed to receive greeting");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-
-    if (greet_pkt.type != TYPE_DATA || strcmp(greet_pkt.data, "Greeting") != 0 || greet_pkt.length != strlen("Greeting")) {
-        fprintf(stderr, "Invalid greeting packet\n");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-    log_event("RECV GREETING", &greet_pkt);
-
-    // Send OK acknowledgment
-    Packet ok;
-    memset(&ok, 0, sizeof(ok));
-    ok.type = TYPE_ACK;
-    ok.length = strlen("OK");
-    strcpy(ok.data, "OK");
-    if (sendto(sockfd, &ok, sizeof(ok), 0, (struct sockaddr *)&sender_addr, addr_len) < 0) {
-        perror("Failed to send OK");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-    log_event("SEND OK", &ok);
-
-    // Receive filename
-    Packet fname_pkt;
-    memset(&fname_pkt, 0, sizeof(fname_pkt));
-    if (recvfrom(sockfd, &fname_pkt, sizeof(fname_pkt), 0, (struct sockaddr *)&sender_addr, &addr_len) < 0) {
-        perror("Failed to receive filename");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-    log_event("RECV FILENAME", &fname_pkt);
-
-    // Receive file size
-    Packet size_pkt;
-    memset(&size_pkt, 0, sizeof(size_pkt));
-    if (recvfrom(sockfd, &size_pkt, sizeof(size_pkt), 0, (struct sockaddr *)&sender_addr, &addr_len) < 0) {
-        perror("Failed to receive file size");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-    if (size_pkt.type != TYPE_DATA || size_pkt.length != sizeof(int)) {
-        fprintf(stderr, "Invalid file size packet\n");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-    memcpy(&f_size, size_pkt.data, sizeof(int));
-    log_event("RECV FILE SIZE", &size_pkt);
-
-    // Open output file
-    char filename[128];
-    snprintf(filename, sizeof(filename), "recv_%s", fname_pkt.data);
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("Failed to open output file");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
+    // Nothing is written until an INIT has named the file and given its size
+    int fd = -1;
 
     // Main data transfer loop
-    int expected_seq = 3;
     while (1) {
         Packet pkt;
-        memset(&pkt, 0, sizeof(pkt));
-        ssize_t len = recvfrom(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&sender_addr, &addr_len);
+        ssize_t len = recv_packet(sockfd, &pkt, &sender_addr, &addr_len);
 
         if (len < 0) {
             perror("Receive error");
             continue;
         }
 
+        if (pkt.type == TYPE_INIT) {
+            // Answer every copy, since the sender repeats the INIT until an ACCEPT arrives
+            char name[MAX_DATA_SIZE - INIT_HEADER + 1];
+            log_event("RECV INIT", &pkt);
+            if (fd < 0 && decode_init(&pkt, &f_size, name) < 0) {
+                fprintf(stderr, "Invalid INIT packet\n");
+                continue;
+            }
+            Packet accept;
+            memset(&accept, 0, sizeof(accept));
+            accept.type = TYPE_ACCEPT;
+            if (fd < 0 && (fd = open_output(name, f_size)) < 0) {
+                // Refuse the transfer, telling the sender why
+                accept.length = snprintf(accept.data, MAX_DATA_SIZE, "%s", strerror(errno));
+                perror("Failed to open output file");
+                send_packet(sockfd, &accept, &sender_addr, addr_len);
+                close(sockfd);
+                exit(1);
+            }
+            if (send_packet(sockfd, &accept, &sender_addr, addr_len) < 0) {
+                perror("Failed to send ACCEPT");
+            } else {
+                log_event("SEND ACCEPT", &accept);
+            }
+            continue;
+        }
+        if (fd < 0) {
+            continue; // Nothing counts before the INIT
+        }
+
         if (pkt.type == TYPE_DATA) {
             log_event("RECV DATA", &pkt);
-            if (pkt.seqNum == expected_seq) {
-                fwrite(pkt.data, 1, pkt.length, fp);
+            // Write the chunk at its offset unless it is a duplicate or lies outside the file
+            long chunk = seq_unwrap(pkt.seqNum, FIRST_DATA_SEQ + first_missing) - FIRST_DATA_SEQ;
+            long offset = chunk * MAX_DATA_SIZE;
+            if (chunk >= 0 && chunk < n_chunks && offset + pkt.length <= f_size && !chunk_received(chunk)) {
+                if (pwrite(fd, pkt.data, pkt.length, offset) != pkt.length) {
+                    perror("Failed to write chunk");
+                    close(fd);
+                    close(sockfd);
+                    exit(1);
+                }
+                mark_chunk(chunk);
+                while (first_missing < n_chunks && chunk_received(first_missing)) first_missing++;
                 total_received += pkt.length;
-                expected_seq++;
                 print_progress_bar(total_received, f_size);
             }
 
             if (drop(drop_prob)) {
-                fprintf(log_fp, "Packet %d dropped intentionally\n", pkt.seqNum);
-                fflush(log_fp);
+                log_event("DROP DATA", &pkt);
                 continue;
             }
 
+            // ACKs are header-only on the wire, so there is no payload to clear
             Packet ack;
-            memset(&ack, 0, sizeof(ack));
             ack.type = TYPE_ACK;
+            ack.seqNum = 0;
             ack.ackNum = pkt.seqNum;
-            if (sendto(sockfd, &ack, sizeof(ack), 0, (struct sockaddr *)&sender_addr, addr_len) < 0) {
+            ack.length = 0;
+            if (send_packet(sockfd, &ack, &sender_addr, addr_len) < 0) {
                 perror("Failed to send ACK");
             } else {
                 log_event("SEND ACK", &ack);
@@ -194,8 +203,8 @@ int main(int argc, char *argv[]) {
     }
 
     // Cleanup
-    fclose(fp);
-    fclose(log_fp);
+    free(chunk_map);
+    close(fd);
     close(sockfd);
     printf("\nFile transfer complete.\n");
 
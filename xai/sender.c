@@ -6,22 +6,35 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
+#include <poll.h>
 #include <time.h>
+#include <errno.h>
 #include "packet.h"
+#include "timer.h"
+#include "evlog.h"
 
-#define TIMEOUT_INTERVAL 3
+// Retransmit state for one in-flight packet, indexed by seqNum % MAX_WINDOW
+typedef struct {
+    Packet pkt;
+    int acked;
+    int retries;
+    uint64_t sent_at; // Last transmission time in microseconds
+} Slot;
 
-int waiting_ack = 0;
 int sockfd;
 struct sockaddr_in receiver_addr;
 socklen_t addr_len = sizeof(receiver_addr);
-Packet last_packet;
-FILE *log_fp;
+Slot window[MAX_WINDOW];
+TimerQueue timers; // Retransmission deadlines, keyed by window slot index
+RttEstimator rtt;
+int log_sample = 1; // -l: keep every nth event in the log, 0 for none
 
 // Print progress bar for file transfer
-void print_progress_bar(int sent_bytes, int total_bytes) {
+void print_progress_bar(long sent_bytes, long total_bytes) {
     const int bar_width = 50;
+    if (total_bytes == 0 || !progress_due(sent_bytes, total_bytes)) {
+        return;
+    }
     float percentage = (float)sent_bytes / total_bytes;
     int pos = (int)(bar_width * percentage);
 
@@ -36,51 +49,80 @@ void print_progress_bar(int sent_bytes, int total_bytes) {
 
 // Log events to file
 void log_event(const char *event, Packet *pkt) {
-    time_t now = time(NULL);
-    fprintf(log_fp, "[%ld] %s - type: %d, seqNum: %d, ackNum: %d, len: %d\n",
-            now, event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
-    fflush(log_fp);
+    evlog(event, pkt->type, pkt->seqNum, pkt->ackNum, pkt->length);
 }
 
 int drop(float prob) {
     return ((float)rand() / RAND_MAX) < prob;
 }
 
-// Handle timeout for retransmission
-void handle_timeout(int sig) {
-    if (waiting_ack) {
-        fprintf(log_fp, "Timeout occurred. Retransmitting packet %d...\n", last_packet.seqNum);
-        fflush(log_fp);
-        if (sendto(sockfd, &last_packet, sizeof(last_packet), 0, (struct sockaddr *)&receiver_addr, addr_len) < 0) {
+// Retransmit every packet whose deadline has passed
+void retransmit_expired(void) {
+    uint64_t now = now_us();
+    int id;
+    while ((id = timer_pop_expired(&timers, now)) >= 0) {
+        Slot *slot = &window[id];
+
+        log_event("TIMEOUT", &slot->pkt);
+        if (send_packet(sockfd, &slot->pkt, &receiver_addr, addr_len) < 0) {
             perror("Retransmission failed");
         } else {
-            log_event("RETRANSMIT", &last_packet);
+            log_event("RETRANSMIT", &slot->pkt);
         }
-        alarm(TIMEOUT_INTERVAL);
+        slot->retries++;
+        slot->sent_at = now;
+        timer_set(&timers, id, now + rtt_backoff(&rtt, slot->retries)); // Exponential backoff per packet
     }
 }
 
+// Print usage and exit
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w window] [-l n] <sender_port> <receiver_ip> <receiver_port> <timeout> <filename> <prob>\n", prog);
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s <sender_port> <receiver_ip> <receiver_port> <timeout> <filename> <prob>\n", argv[0]);
+    // Parse options
+    int window_size = DEFAULT_WINDOW;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:l:")) != -1) {
+        switch (opt) {
+            case 'w': window_size = atoi(optarg); break;
+            case 'l': log_sample = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 6) {
+        usage(argv[0]);
+    }
+    if (window_size < 1 || window_size > MAX_WINDOW) {
+        fprintf(stderr, "Window size must be between 1 and %d\n", MAX_WINDOW);
         exit(1);
     }
+    argv += optind - 1;
 
     int sender_port = atoi(argv[1]);
     char *receiver_ip = argv[2];
     int receiver_port = atoi(argv[3]);
-    int timeout = atoi(argv[4]);
+    double timeout = atof(argv[4]); // Initial RTO in seconds, used until the first RTT sample
     char *filename = argv[5];
     float ack_drop_prob = atof(argv[6]);
-    int total_sent = 0;
-    int f_size;
+    long total_sent = 0;
+    long f_size;
 
-    signal(SIGALRM, handle_timeout);
     srand(time(NULL));
 
+    // Set up RTT estimation and the retransmission timer
+    rtt_init(&rtt, timeout * 1000000);
+    timer_init(&timers);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (tfd < 0) {
+        perror("Failed to create timerfd");
+        exit(1);
+    }
+
     // Open log file
-    log_fp = fopen("sender_udp_logs", "a");
-    if (!log_fp) {
+    if (evlog_open("sender_udp_logs.bin", log_sample) < 0) {
         perror("Failed to open log file");
         exit(1);
     }
@@ -89,7 +131,6 @@ int main(int argc, char *argv[]) {
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
         perror("Socket creation failed");
-        fclose(log_fp);
         exit(1);
     }
 
@@ -102,7 +143,6 @@ int main(int argc, char *argv[]) {
 
     if (bind(sockfd, (struct sockaddr *)&sender_addr, sizeof(sender_addr)) < 0) {
         perror("Bind failed");
-        fclose(log_fp);
         close(sockfd);
         exit(1);
     }
@@ -113,63 +153,14 @@ int main(int argc, char *argv[]) {
     receiver_addr.sin_port = htons(receiver_port);
     if (inet_pton(AF_INET, receiver_ip, &receiver_addr.sin_addr) <= 0) {
         perror("Invalid receiver IP");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-
-    // Send greeting packet
-    Packet greet_pkt;
-    memset(&greet_pkt, 0, sizeof(greet_pkt));
-    greet_pkt.type = TYPE_DATA;
-    greet_pkt.seqNum = 0;
-    greet_pkt.length = strlen("Greeting");
-    strcpy(greet_pkt.data, "Greeting");
-    if (sendto(sockfd, &greet_pkt, sizeof(greet_pkt), 0, (struct sockaddr *)&receiver_addr, addr_len) < 0) {
-        perror("Failed to send greeting");
-        fclose(log_fp);
         close(sockfd);
         exit(1);
     }
-    log_event("SEND GREETING", &greet_pkt);
-
-    // Receive OK acknowledgment
-    Packet ack_pkt;
-    memset(&ack_pkt, 0, sizeof(ack_pkt));
-    if (recvfrom(sockfd, &ack_pkt, sizeof(ack_pkt), 0, (struct sockaddr *)&receiver_addr, &addr_len) < 0) {
-        perror("Failed to receive OK");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-    if (ack_pkt.type != TYPE_ACK || strcmp(ack_pkt.data, "OK") != 0) {
-        fprintf(stderr, "Unexpected response. Aborting.\n");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-    log_event("RECV OK", &ack_pkt);
-
-    // Send filename
-    Packet fname_pkt;
-    memset(&fname_pkt, 0, sizeof(fname_pkt));
-    fname_pkt.type = TYPE_DATA;
-    fname_pkt.seqNum = 1;
-    fname_pkt.length = strlen(filename);
-    strncpy(fname_pkt.data, filename, MAX_DATA_SIZE);
-    if (sendto(sockfd, &fname_pkt, sizeof(fname_pkt), 0, (struct sockaddr *)&receiver_addr, addr_len) < 0) {
-        perror("Failed to send filename");
-        fclose(log_fp);
-        close(sockfd);
-        exit(1);
-    }
-    log_event("SEND FILENAME", &fname_pkt);
 
-    // Open input file and send file size
+    // Open input file and get its size
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
         perror("Failed to open input file");
-        fclose(log_fp);
         close(sockfd);
         exit(1);
     }
@@ -177,70 +168,165 @@ int main(int argc, char *argv[]) {
     f_size = ftell(fp);
     rewind(fp);
 
-    Packet size_pkt;
-    memset(&size_pkt, 0, sizeof(size_pkt));
-    size_pkt.type = TYPE_DATA;
-    size_pkt.seqNum = 2;
-    size_pkt.length = sizeof(int);
-    memcpy(size_pkt.data, &f_size, sizeof(int));
-    if (sendto(sockfd, &size_pkt, sizeof(size_pkt), 0, (struct sockaddr *)&receiver_addr, addr_len) < 0) {
-        perror("Failed to send file size");
+    // One INIT carries the filename and file size; resend it with backoff until the ACCEPT arrives
+    Packet init_pkt;
+    if (encode_init(f_size, filename, &init_pkt) < 0) {
+        fprintf(stderr, "File name too long\n");
         fclose(fp);
-        fclose(log_fp);
         close(sockfd);
         exit(1);
     }
-    log_event("SEND FILE SIZE", &size_pkt);
-
-    // Main data transfer loop
-    int seq = 3;
+    if (send_packet(sockfd, &init_pkt, &receiver_addr, addr_len) < 0) {
+        perror("Failed to send INIT");
+    } else {
+        log_event("SEND INIT", &init_pkt);
+    }
+    int init_tries = 0;
+    uint64_t init_sent = now_us();
+    uint64_t init_deadline = init_sent + rtt.rto;
     while (1) {
-        Packet pkt;
-        memset(&pkt, 0, sizeof(pkt));
-        pkt.type = TYPE_DATA;
-        pkt.seqNum = seq;
-        pkt.length = fread(pkt.data, 1, MAX_DATA_SIZE, fp);
-        last_packet = pkt;
-
-        if (sendto(sockfd, &pkt, sizeof(pkt), 0, (struct sockaddr *)&receiver_addr, addr_len) < 0) {
-            perror("Failed to send data packet");
+        uint64_t now = now_us();
+        if (now >= init_deadline) {
+            if (++init_tries == INIT_TRIES) {
+                fprintf(stderr, "No answer from the receiver. Aborting.\n");
+                fclose(fp);
+                close(sockfd);
+                exit(1);
+            }
+            if (send_packet(sockfd, &init_pkt, &receiver_addr, addr_len) < 0) {
+                perror("Retransmission failed");
+            } else {
+                log_event("RETRANSMIT INIT", &init_pkt);
+            }
+            init_deadline = now + rtt_backoff(&rtt, init_tries);
+            continue;
+        }
+
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        if (poll(&pfd, 1, (init_deadline - now + 999) / 1000) <= 0) {
+            continue;
+        }
+        Packet reply;
+        if (recv_packet(sockfd, &reply, &receiver_addr, &addr_len) < 0 || reply.type != TYPE_ACCEPT) {
+            continue;
+        }
+        log_event("RECV ACCEPT", &reply);
+        if (reply.length > 0) {
+            fprintf(stderr, "Receiver refused: %.*s\n", reply.length, reply.data);
             fclose(fp);
-            fclose(log_fp);
             close(sockfd);
             exit(1);
         }
-        log_event("SEND DATA", &pkt);
-        waiting_ack = 1;
-        alarm(timeout);
-
-        while (waiting_ack) {
-            Packet ack;
-            memset(&ack, 0, sizeof(ack));
-            ssize_t recv_len = recvfrom(sockfd, &ack, sizeof(ack), 0, (struct sockaddr *)&receiver_addr, &addr_len);
-            if (recv_len > 0 && ack.type == TYPE_ACK && ack.ackNum == seq) {
-                if (drop(ack_drop_prob)) {
-                    fprintf(log_fp, "ACK %d dropped intentionally\n", ack.ackNum);
-                    fflush(log_fp);
-                    continue;
-                }
-                log_event("RECV ACK", &ack);
-                alarm(0);
-                waiting_ack = 0;
+        if (init_tries == 0) {
+            rtt_sample(&rtt, now_us() - init_sent); // Karn's rule
+        }
+        break;
+    }
+
+    // Main data transfer loop (selective repeat)
+    long base = FIRST_DATA_SEQ;
+    long next_seq = FIRST_DATA_SEQ;
+    long last_seq = -1; // Sequence number of the final (short) chunk, once read
+    uint64_t armed = 0; // Deadline the timerfd currently points at
+    while (last_seq < 0 || base <= last_seq) {
+        // Fill the window
+        while (last_seq < 0 && next_seq < base + window_size) {
+            Slot *slot = &window[next_seq % MAX_WINDOW];
+            slot->pkt.type = TYPE_DATA;
+            slot->pkt.seqNum = next_seq;
+            slot->pkt.ackNum = 0;
+            slot->pkt.length = fread(slot->pkt.data, 1, MAX_DATA_SIZE, fp);
+            slot->acked = 0;
+            slot->retries = 0;
+            slot->sent_at = now_us();
+
+            if (send_packet(sockfd, &slot->pkt, &receiver_addr, addr_len) < 0) {
+                perror("Failed to send data packet");
+                fclose(fp);
+                close(sockfd);
+                exit(1);
+            }
+            log_event("SEND DATA", &slot->pkt);
+            timer_set(&timers, next_seq % MAX_WINDOW, slot->sent_at + rtt.rto);
+
+            if (slot->pkt.length < MAX_DATA_SIZE) {
+                last_seq = next_seq;
+            }
+            next_seq++;
+        }
+
+        // Point the timerfd at the earliest deadline if it changed
+        if (timer_next(&timers) != armed) {
+            armed = timer_next(&timers);
+            timer_arm_fd(tfd, armed);
+        }
+
+        // Wait for an ACK or a timeout
+        struct pollfd fds[2] = {
+            { .fd = sockfd, .events = POLLIN },
+            { .fd = tfd, .events = POLLIN }
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                perror("poll failed");
+            }
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(tfd, &expirations, sizeof(expirations)) > 0) {
+                armed = 0;
+                retransmit_expired();
             }
         }
-        total_sent += pkt.length;
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        Packet ack;
+        ssize_t recv_len = recv_packet(sockfd, &ack, &receiver_addr, &addr_len);
+        if (recv_len < 0) {
+            perror("Failed to receive ACK");
+            continue;
+        }
+
+        // Ignore anything that is not an ACK for an in-flight packet
+        long acked = seq_unwrap(ack.ackNum, base);
+        if (ack.type != TYPE_ACK || acked < base || acked >= next_seq) {
+            continue;
+        }
+        if (drop(ack_drop_prob)) {
+            log_event("DROP ACK", &ack);
+            continue;
+        }
+
+        Slot *slot = &window[acked % MAX_WINDOW];
+        if (slot->acked) {
+            continue; // Duplicate ACK
+        }
+        log_event("RECV ACK", &ack);
+        slot->acked = 1;
+        timer_cancel(&timers, acked % MAX_WINDOW);
+
+        // Karn's rule: only packets sent exactly once give a usable RTT sample
+        if (slot->retries == 0) {
+            rtt_sample(&rtt, now_us() - slot->sent_at);
+        }
+        total_sent += slot->pkt.length;
         print_progress_bar(total_sent, f_size);
 
-        if (pkt.length < MAX_DATA_SIZE) break;
-        seq++;
+        // Slide the window past every acknowledged packet
+        while (base < next_seq && window[base % MAX_WINDOW].acked) {
+            base++;
+        }
     }
 
     // Send EOT packet
     Packet eot;
     memset(&eot, 0, sizeof(eot));
     eot.type = TYPE_EOT;
-    eot.seqNum = seq;
-    if (sendto(sockfd, &eot, sizeof(eot), 0, (struct sockaddr *)&receiver_addr, addr_len) < 0) {
+    eot.seqNum = last_seq;
+    if (send_packet(sockfd, &eot, &receiver_addr, addr_len) < 0) {
         perror("Failed to send EOT");
     } else {
         log_event("SEND EOT", &eot);
@@ -248,7 +334,7 @@ int main(int argc, char *argv[]) {
 
     // Cleanup
     fclose(fp);
-    fclose(log_fp);
+    close(tfd);
     close(sockfd);
     printf("\nFile transfer complete.\n");
 
@@ -3,8 +3,8 @@
 mkdir -p sender_dir
 mkdir -p receiver_dir
 
-gcc sender.c -o send
-gcc receiver.c -o receive
+gcc -pthread sender.c -o send
+gcc -pthread receiver.c -o receive
 
 mv send sender_dir/
 cp ../test_files/img_test.png sender_dir/